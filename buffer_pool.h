@@ -0,0 +1,192 @@
+#pragma once
+
+#include "sharded_counter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POOL_MIN_SHIFT 8        // the smallest class is 256 bytes
+#define POOL_CLASSES 17         // the largest class is 16MB
+#define POOL_MAX_SIZE (1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+#define POOL_SHARD_FREE_BYTES (256 * 1024)     // free bytes kept per class in a shard, the rest go back to the allocator
+
+// shared arena of buffers in power-of-two size classes, the free lists are split in
+// cache-line-padded shards like the counters, so each thread takes and returns buffers
+// mostly on its own lock
+class BufferPool
+{
+    struct FreeBuffer
+    {
+        FreeBuffer* next;
+    };
+
+    struct alignas(CACHE_LINE_SIZE) Shard
+    {
+        pthread_mutex_t lock;
+        FreeBuffer* free_lists[POOL_CLASSES];
+        int free_counts[POOL_CLASSES];
+        long in_use;        //the accounting is updated under the shard lock and summed by the readers
+        long cached;
+    };
+
+    Shard shards[COUNTER_SHARDS];
+
+public:
+    BufferPool();
+    ~BufferPool();
+
+    static inline int ClassOf(int size)
+    {
+        int cls = 0;
+        while ((1 << (cls + POOL_MIN_SHIFT)) < size)
+            cls++;
+        return cls;
+    }
+    static inline int ClassSize(int cls) { return 1 << (cls + POOL_MIN_SHIFT); }
+
+    void* Acquire(int size, int& cap);
+    void Release(void* buf, int cap);
+
+    // typed helpers, the counts are in elements of T
+    template <class T>
+    bool Grow(T*& buf, int& cap, int count, int used);
+    template <class T>
+    void Free(T*& buf, int& cap);
+
+    long InUse();
+    long Cached();
+};
+
+inline BufferPool::BufferPool()
+{
+    for (int i = 0; i < COUNTER_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        memset(shards[i].free_lists, 0, sizeof(shards[i].free_lists));
+        memset(shards[i].free_counts, 0, sizeof(shards[i].free_counts));
+        shards[i].in_use = shards[i].cached = 0;
+    }
+}
+
+inline BufferPool::~BufferPool()
+{
+    for (int i = 0; i < COUNTER_SHARDS; i++)
+    {
+        for (int cls = 0; cls < POOL_CLASSES; cls++)
+            while (shards[i].free_lists[cls])
+            {
+                FreeBuffer* next = shards[i].free_lists[cls]->next;
+                free(shards[i].free_lists[cls]);
+                shards[i].free_lists[cls] = next;
+            }
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+}
+
+// a buffer of at least the given size (up to POOL_MAX_SIZE), cap gets its real size
+inline void* BufferPool::Acquire(int size, int& cap)
+{
+    if (size > POOL_MAX_SIZE)
+        return NULL;
+
+    int cls = ClassOf(size);
+    cap = ClassSize(cls);
+
+    Shard& shard = shards[counterThreadSlot()];
+    pthread_mutex_lock(&shard.lock);
+    FreeBuffer* buf = shard.free_lists[cls];
+    if (buf)
+    {
+        shard.free_lists[cls] = buf->next;
+        shard.free_counts[cls]--;
+        shard.cached -= cap;
+    }
+    shard.in_use += cap;
+    pthread_mutex_unlock(&shard.lock);
+
+    if (!buf)
+    {
+        buf = (FreeBuffer*)malloc(cap);
+        if (!buf)
+        {
+            perror("can't allocate pool buffer");
+            pthread_mutex_lock(&shard.lock);
+            shard.in_use -= cap;
+            pthread_mutex_unlock(&shard.lock);
+            return NULL;
+        }
+    }
+
+    return buf;
+}
+
+// the buffer goes to the free list of the calling thread's shard
+inline void BufferPool::Release(void* buf, int cap)
+{
+    if (!buf)
+        return;
+
+    int cls = ClassOf(cap);
+    Shard& shard = shards[counterThreadSlot()];
+    pthread_mutex_lock(&shard.lock);
+    shard.in_use -= cap;
+    if (shard.free_counts[cls] < POOL_SHARD_FREE_BYTES / cap)
+    {
+        FreeBuffer* free_buf = (FreeBuffer*)buf;
+        free_buf->next = shard.free_lists[cls];
+        shard.free_lists[cls] = free_buf;
+        shard.free_counts[cls]++;
+        shard.cached += cap;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&shard.lock);
+
+    free(buf);
+}
+
+// the buffers taken from one shard may be returned to another, only the sum is meaningful
+inline long BufferPool::InUse()
+{
+    long sum = 0;
+    for (int i = 0; i < COUNTER_SHARDS; i++)
+        sum += __atomic_load_n(&shards[i].in_use, __ATOMIC_RELAXED);
+    return sum;
+}
+
+inline long BufferPool::Cached()
+{
+    long sum = 0;
+    for (int i = 0; i < COUNTER_SHARDS; i++)
+        sum += __atomic_load_n(&shards[i].cached, __ATOMIC_RELAXED);
+    return sum;
+}
+
+// grow the buffer to at least count elements, keeping the first used ones
+template <class T>
+bool BufferPool::Grow(T*& buf, int& cap, int count, int used)
+{
+    if (count <= cap)
+        return true;
+
+    int new_cap;
+    T* new_buf = (T*)Acquire(count * sizeof(T), new_cap);
+    if (!new_buf)
+        return false;
+
+    if (used > 0)
+        memcpy(new_buf, buf, used * sizeof(T));
+    Release(buf, cap * sizeof(T));
+
+    buf = new_buf;
+    cap = new_cap / sizeof(T);
+    return true;
+}
+
+template <class T>
+void BufferPool::Free(T*& buf, int& cap)
+{
+    Release(buf, cap * sizeof(T));
+    buf = NULL;
+    cap = 0;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <strings.h>
+
+#define COMMAND_MAX_LENGTH 63       // the lengths of the commands are kept in a 64-bit mask
+#define COMMAND_SEED_TRIES 100000
+
+// case-insensitive command registry with a perfect hash built at compile time -
+// a message is a command candidate only if a command has its length, and then a single
+// hash slot is compared, so the ordinary messages mostly skip the lookup after the length check
+template <int N>
+class CommandTable
+{
+    static constexpr int slot_count = N * 4 > 16 ? 1 << (32 - __builtin_clz(N * 4 - 1)) : 16;
+
+    const char* names[N] = {};
+    int lengths[N] = {};
+    int8_t slots[slot_count] = {};
+    uint64_t length_mask = 0;
+    uint32_t seed = 0;
+    bool valid = false;
+
+    static constexpr uint8_t lower(char c) { return (uint8_t)c | 0x20; }
+
+    // mixes the length with the first, middle and last characters
+    static constexpr uint32_t hash(uint32_t key, const char* s, int len)
+    {
+        uint32_t h = key ^ (uint32_t)len;
+        h = (h ^ lower(s[0])) * 0x9E3779B1u;
+        h = (h ^ lower(s[len / 2])) * 0x85EBCA6Bu;
+        h = (h ^ lower(s[len - 1])) * 0xC2B2AE35u;
+        return h ^ (h >> 15);
+    }
+
+    static constexpr int length(const char* s)
+    {
+        int len = 0;
+        while (s[len])
+            len++;
+        return len;
+    }
+
+    // the first seed without collisions between the commands
+    constexpr bool place(uint32_t try_seed)
+    {
+        for (int i = 0; i < slot_count; i++)
+            slots[i] = -1;
+
+        for (int i = 0; i < N; i++)
+        {
+            int slot = hash(try_seed, names[i], lengths[i]) & (slot_count - 1);
+            if (slots[slot] != -1)
+                return false;
+            slots[slot] = i;
+        }
+        return true;
+    }
+
+public:
+    constexpr CommandTable(const char* const (&commands)[N])
+    {
+        for (int i = 0; i < N; i++)
+        {
+            names[i] = commands[i];
+            lengths[i] = length(commands[i]);
+            if (lengths[i] == 0 || lengths[i] > COMMAND_MAX_LENGTH)
+                return;
+            length_mask |= 1ULL << lengths[i];
+        }
+
+        for (uint32_t try_seed = 0; try_seed < COMMAND_SEED_TRIES; try_seed++)
+            if (place(try_seed))
+            {
+                seed = try_seed;
+                valid = true;
+                return;
+            }
+    }
+
+    constexpr bool Valid() const { return valid; }
+
+    // the index of the command in the registration order, -1 for the other messages
+    inline int Find(const char* msg, int msg_len) const
+    {
+        if (msg_len > COMMAND_MAX_LENGTH || !((length_mask >> msg_len) & 1))
+            return -1;
+
+        int index = slots[hash(seed, msg, msg_len) & (slot_count - 1)];
+        if (index < 0 || lengths[index] != msg_len || strncasecmp(msg, names[index], msg_len))
+            return -1;
+        return index;
+    }
+};
@@ -0,0 +1,608 @@
+#include "typed_server.h"
+#include "latency_histogram.h"
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include <signal.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define BENCH_TCP_PORT  2121
+#define BENCH_RECV_SIZE (64 * 1024)
+#define BENCH_IDLE_NS   100'000'000LL
+#define BENCH_UNIX_PATH "/tmp/echo_bench.sock"
+
+//------------------------------------------------------------------------------------
+//benchmark settings
+
+static const char *host = "127.0.0.1";
+static int port = BENCH_TCP_PORT;
+static int connection_count = 10;
+static int duration_sec = 5;
+static int warmup_sec = 1;
+static int message_size = 64;       //including the <LF>, the payload of a frame, the chunk of a raw stream
+static Framing framing = FRAMING_LINES;
+static int message_bytes;           //on the wire, with the length prefix of a frame
+static int depth = 1;               //messages in flight per connection
+static int rate = 0;                //messages per second of all connections, 0 - closed loop
+static int epoll_threads = 0;       //0 - one blocking thread per connection
+static int idle_count = 0;          //connections held open without traffic, for the memory report
+static const char *unix_path = NULL;    //Unix socket of the server, the clients connect over it instead of TCP
+static bool compare_unix = false;   //a run over TCP and another one over the Unix socket
+static bool over_unix = false;      //transport of the current run
+
+static char *send_buf;              //depth messages, sent in one call
+static bool bench_running = true;
+static uint64_t record_from_ns;
+
+static inline timespec toTimespec(uint64_t ns)
+{
+    timespec ts;
+    ts.tv_sec = ns / 1'000'000'000ULL;
+    ts.tv_nsec = ns % 1'000'000'000ULL;
+    return ts;
+}
+
+//------------------------------------------------------------------------------------
+//client connection, the replies come in order so the send times are kept in a ring
+
+struct BenchConn
+{
+    int sock;
+    uint64_t *sent_at;
+    int head = 0;
+    int inflight = 0;
+    uint64_t next_due = 0;
+    uint64_t interval = 0;     //0 - closed loop
+    int reply_bytes = 0;       //of the reply frame being received
+
+    bool sendDue(uint64_t now);
+    void completeReply(uint64_t now, LatencyHistogram &histogram, uint64_t &replies);
+    int readReplies(LatencyHistogram &histogram, uint64_t &replies, int flags);
+    uint64_t waitNs(uint64_t now);
+};
+
+// closed loop keeps the pipeline full, open loop sends the messages that are due,
+// their latency is measured from the scheduled time even if the pipeline was full
+bool BenchConn::sendDue(uint64_t now)
+{
+    int count = 0;
+    if (interval == 0)
+    {
+        for (; inflight + count < depth; count++)
+            sent_at[(head + inflight + count) % depth] = now;
+    }
+    else
+    {
+        for (; inflight + count < depth && next_due <= now; count++)
+        {
+            sent_at[(head + inflight + count) % depth] = next_due;
+            next_due += interval;
+        }
+    }
+
+    if (count == 0)
+        return true;
+
+    int len = count * message_bytes;
+    int sent = 0;
+    while (sent < len)
+    {
+        int sz = send(sock, send_buf + sent, len - sent, MSG_NOSIGNAL);
+        if (sz <= 0)
+        {
+            if (sz < 0 && errno == EINTR)
+                continue;
+            perror("bench send");
+            return false;
+        }
+        sent += sz;
+    }
+
+    inflight += count;
+    return true;
+}
+
+// returns the received bytes, 0 if nothing is available, -1 on error
+int BenchConn::readReplies(LatencyHistogram &histogram, uint64_t &replies, int flags)
+{
+    char recv_buf[BENCH_RECV_SIZE];
+    int sz = recv(sock, recv_buf, sizeof(recv_buf), flags);
+    if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (sz <= 0)
+    {
+        if (bench_running)
+            fprintf(stderr, "bench connection closed by the server\n");
+        return -1;
+    }
+
+    uint64_t now = monotonicNs();
+    if (framing == FRAMING_LINES)
+    {
+        for (char *p = recv_buf; (p = (char *)memchr(p, '\n', recv_buf + sz - p)) != NULL; p++)
+            completeReply(now, histogram, replies);
+        return sz;
+    }
+
+    // the echoed frames and raw chunks have the size of the sent ones, so they are only counted
+    reply_bytes += sz;
+    for (; reply_bytes >= message_bytes; reply_bytes -= message_bytes)
+        completeReply(now, histogram, replies);
+    return sz;
+}
+
+void BenchConn::completeReply(uint64_t now, LatencyHistogram &histogram, uint64_t &replies)
+{
+    if (inflight == 0)
+        return;
+
+    uint64_t sent = sent_at[head];
+    head = (head + 1) % depth;
+    inflight--;
+
+    if (sent >= record_from_ns)
+    {
+        histogram.Record(now - sent);
+        replies++;
+    }
+}
+
+// time until the next message is due, the running flag is checked at least every 100ms
+uint64_t BenchConn::waitNs(uint64_t now)
+{
+    if (interval == 0 || inflight == depth)
+        return BENCH_IDLE_NS;
+    if (next_due <= now)
+        return 0;
+    return next_due - now < BENCH_IDLE_NS ? next_due - now : BENCH_IDLE_NS;
+}
+
+//------------------------------------------------------------------------------------
+//client threads
+
+struct BenchThread
+{
+    pthread_t thread;
+    BenchConn *conns;
+    int conn_count;
+    LatencyHistogram histogram;
+    uint64_t replies = 0;
+};
+
+// blocking client - one connection per thread
+static void *blockingLoop(void *param)
+{
+    BenchThread *bt = (BenchThread *)param;
+    BenchConn *conn = bt->conns;
+
+    pollfd pfd;
+    pfd.fd = conn->sock;
+    pfd.events = POLLIN;
+
+    while (bench_running)
+    {
+        if (!conn->sendDue(monotonicNs()))
+            break;
+
+        timespec ts = toTimespec(conn->waitNs(monotonicNs()));
+        int ready = ppoll(&pfd, 1, &ts, NULL);
+        if (ready > 0 && conn->readReplies(bt->histogram, bt->replies, 0) < 0)
+            break;
+    }
+
+    return NULL;
+}
+
+// epoll client - a subset of the connections per thread
+static void *epollLoop(void *param)
+{
+    BenchThread *bt = (BenchThread *)param;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        perror("can't create epoll instance");
+        return NULL;
+    }
+
+    for (int i = 0; i < bt->conn_count; i++)
+    {
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &bt->conns[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bt->conns[i].sock, &ev))
+        {
+            perror("can't add connection to epoll");
+            close(epoll_fd);
+            return NULL;
+        }
+    }
+
+    epoll_event events[REACTOR_MAX_EVENTS];
+    while (bench_running)
+    {
+        uint64_t now = monotonicNs();
+        uint64_t wait = BENCH_IDLE_NS;
+        for (int i = 0; i < bt->conn_count; i++)
+        {
+            if (!bt->conns[i].sendDue(now))
+                bench_running = false;
+
+            uint64_t conn_wait = bt->conns[i].waitNs(now);
+            if (conn_wait < wait)
+                wait = conn_wait;
+        }
+
+        timespec ts = toTimespec(wait);
+        int count = epoll_pwait2(epoll_fd, events, REACTOR_MAX_EVENTS, &ts, NULL);
+        for (int i = 0; i < count; i++)
+        {
+            BenchConn *conn = (BenchConn *)events[i].data.ptr;
+            int sz;
+            while ((sz = conn->readReplies(bt->histogram, bt->replies, MSG_DONTWAIT)) > 0)
+                ;
+            if (sz < 0)
+                bench_running = false;
+        }
+    }
+
+    close(epoll_fd);
+    return NULL;
+}
+
+static int connectBench()
+{
+    int sock = socket(over_unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (sock == -1)
+    {
+        perror("can't create socket");
+        return -1;
+    }
+
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    if (over_unix)
+    {
+        sockaddr_un *un_addr = (sockaddr_un *)&addr;
+        un_addr->sun_family = AF_UNIX;
+        strncpy(un_addr->sun_path, unix_path, sizeof(un_addr->sun_path) - 1);
+        addr_len = sizeof(sockaddr_un);
+    }
+    else
+    {
+        int nodelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        sockaddr_in *in_addr = (sockaddr_in *)&addr;
+        in_addr->sin_family = AF_INET;
+        in_addr->sin_port = htons(port);
+        inet_pton(AF_INET, host, &in_addr->sin_addr);
+        addr_len = sizeof(sockaddr_in);
+    }
+
+    if (connect(sock, (sockaddr *)&addr, addr_len))
+    {
+        perror("can't connect");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// resident memory of this process
+static long residentBytes()
+{
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// the idle connections need a descriptor each, and another one for the in-process server
+static void raiseFileLimit()
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+//------------------------------------------------------------------------------------
+//one measured run over TCP or the Unix socket
+
+static bool runBench(bool unix_transport)
+{
+    over_unix = unix_transport;
+
+    //connect all clients before the traffic starts
+    BenchConn *conns = new BenchConn[connection_count];
+    for (int i = 0; i < connection_count; i++)
+    {
+        conns[i].sock = connectBench();
+        if (conns[i].sock == -1)
+            return false;
+        conns[i].sent_at = (uint64_t *)malloc(depth * sizeof(uint64_t));
+    }
+
+    bench_running = true;
+    uint64_t start = monotonicNs();
+    record_from_ns = start + warmup_sec * 1'000'000'000ULL;
+
+    for (int i = 0; i < connection_count; i++)
+    {
+        if (rate > 0)
+        {
+            // the connections are spread evenly over the interval
+            conns[i].interval = 1'000'000'000ULL * connection_count / rate;
+            conns[i].next_due = start + conns[i].interval * i / connection_count;
+        }
+    }
+
+    int thread_count = epoll_threads > 0 ? epoll_threads : connection_count;
+    if (thread_count > connection_count)
+        thread_count = connection_count;
+
+    BenchThread *threads = new BenchThread[thread_count];
+    for (int i = 0; i < thread_count; i++)
+    {
+        int first = connection_count * i / thread_count;
+        threads[i].conns = conns + first;
+        threads[i].conn_count = connection_count * (i + 1) / thread_count - first;
+
+        if (pthread_create(&threads[i].thread, NULL, epoll_threads > 0 ? epollLoop : blockingLoop, &threads[i]))
+        {
+            perror("can't run bench thread");
+            return false;
+        }
+    }
+
+    sleep(warmup_sec + duration_sec);
+    bench_running = false;
+
+    LatencyHistogram histogram;
+    uint64_t replies = 0;
+    for (int i = 0; i < thread_count; i++)
+    {
+        void *retVal;
+        pthread_join(threads[i].thread, &retVal);
+        histogram.Add(threads[i].histogram);
+        replies += threads[i].replies;
+    }
+
+    double elapsed = (monotonicNs() - record_from_ns) / 1e9;
+
+    const char *framing_name = framing == FRAMING_LINES ? "lines" : framing == FRAMING_LENGTH32 ? "4-byte length frames" :
+                               framing == FRAMING_VARINT ? "varint length frames" : "a raw stream";
+    printf("%d %s connections, %d byte messages in %s, pipelining %d, %s, %s clients\n",
+           connection_count, over_unix ? "unix" : "tcp", message_size, framing_name, depth, rate > 0 ? "open loop" : "closed loop",
+           epoll_threads > 0 ? "epoll" : "blocking");
+    if (rate > 0)
+        printf("target rate: %d msg/s\n", rate);
+    printf("messages: %" PRIu64 " in %.2f s, throughput: %.0f msg/s, %.2f MB/s\n",
+           replies, elapsed, replies / elapsed, replies * message_bytes / elapsed / 1e6);
+    printf("latency us: p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           histogram.Percentile(50) / 1e3, histogram.Percentile(99) / 1e3,
+           histogram.Percentile(99.9) / 1e3, histogram.Max() / 1e3);
+
+    // the replies in flight are read first, a socket closed with unread data is reset
+    LatencyHistogram unused;
+    for (int i = 0; i < connection_count; i++)
+    {
+        while (conns[i].inflight > 0 && conns[i].readReplies(unused, replies, 0) > 0)
+            ;
+        close(conns[i].sock);
+        free(conns[i].sent_at);
+    }
+    delete[] conns;
+    delete[] threads;
+
+    return true;
+}
+
+//------------------------------------------------------------------------------------
+//in-process server
+
+static void echoMessage(Connection *conn, const char *message, int message_len)
+{
+    conn->sendFrame(message, message_len);
+}
+
+struct EchoHandler
+{
+    static inline void Process(Connection *conn, const char *message, int message_len) { conn->sendFrame(message, message_len); }
+};
+
+//------------------------------------------------------------------------------------
+//main program
+
+int main(int argc, char *argv[])
+{
+    TypedServer<EchoHandler> server;
+    bool typed_handler = false;
+    bool local_server = false;
+
+    //check args for overriding
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strncmp(argv[i], "-h", 2))
+            host = argv[i] + 2;
+        if (!strncmp(argv[i], "-p", 2))
+            port = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-c", 2))
+            connection_count = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-t", 2))
+            duration_sec = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-W", 2))
+            warmup_sec = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-m", 2))
+            message_size = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-P", 2))
+            depth = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-r", 2))
+            rate = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-I", 2))
+            idle_count = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-E", 2))
+            epoll_threads = argv[i][2] ? atoi(argv[i] + 2) : 1;
+        if (!strcmp(argv[i], "-T"))
+            typed_handler = true;
+        if (!strncmp(argv[i], "-z", 2))
+            server.zerocopy_min_size = argv[i][2] ? atoi(argv[i] + 2) : ZEROCOPY_MIN_SIZE;
+        if (!strncmp(argv[i], "-u", 2))
+            unix_path = argv[i][2] ? argv[i] + 2 : BENCH_UNIX_PATH;
+        if (!strcmp(argv[i], "-U"))
+            compare_unix = true;
+        if (!strncmp(argv[i], "-f", 2))
+            framing = argv[i][2] == 'v' ? FRAMING_VARINT : argv[i][2] == 'r' ? FRAMING_RAW_ECHO : FRAMING_LENGTH32;
+        if (!strncmp(argv[i], "-l", 2))
+        {
+            local_server = true;
+            if (argv[i][2] == 'e')
+                server.io_mode = IO_EPOLL;
+            if (argv[i][2] == 'i')
+                server.io_mode = IO_URING;
+            if (argv[i][2] == 'w')
+                server.io_mode = IO_POOL;
+        }
+    }
+
+    if (port < 1 || port > 0xFFFF || connection_count < 1 || duration_sec < 1 || warmup_sec < 0 ||
+        message_size < 1 || message_size >= POOL_MAX_SIZE || depth < 1 || rate < 0 || epoll_threads < 0 || idle_count < 0 ||
+        server.zerocopy_min_size < 0)
+    {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    if (compare_unix && !unix_path)
+        unix_path = BENCH_UNIX_PATH;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (idle_count > 0)
+        raiseFileLimit();
+
+    //the server runs on loopback in this process
+    if (local_server)
+    {
+        host = "127.0.0.1";
+        // the function pointer handler unless the typed one is selected
+        if (!typed_handler)
+        {
+            server.ProcessDataPtr = NULL;
+            server.ProcessMessageViewPtr = &echoMessage;
+        }
+        if (server.max_connections < connection_count + idle_count)
+            server.max_connections = connection_count + idle_count;
+        // a worker serves one client until it leaves, the pool admits no more clients than workers
+        if (server.io_mode == IO_POOL && server.pool_threads < connection_count + idle_count)
+            server.pool_threads = connection_count + idle_count;
+        if (server.backlog < connection_count + idle_count)
+            server.backlog = connection_count + idle_count;
+        if (server.max_message_size < message_size + 1)
+            server.max_message_size = message_size + 1;
+        server.framing = framing;
+
+        // both endpoints share the connection table and the handler
+        if (!server.SetupListening(port, htonl(INADDR_LOOPBACK)) || (unix_path && !server.AddListeningUnix(unix_path)) || !server.Start())
+            return 1;
+        usleep(100'000);
+    }
+
+    //depth lines of message_size bytes, frames with the payload of message_size bytes, or raw chunks
+    unsigned char prefix[VARINT_MAX_BYTES];
+    int prefix_len = 0;
+    if (framing == FRAMING_LENGTH32)
+    {
+        uint32_t len = htonl(message_size);
+        memcpy(prefix, &len, sizeof(len));
+        prefix_len = sizeof(len);
+    }
+    else if (framing == FRAMING_VARINT)
+        for (uint32_t len = message_size;; len >>= 7)
+        {
+            prefix[prefix_len++] = (len & 0x7F) | (len > 0x7F ? 0x80 : 0);
+            if (len <= 0x7F)
+                break;
+        }
+
+    message_bytes = prefix_len + message_size;
+    send_buf = (char *)malloc(depth * message_bytes);
+    for (int i = 0; i < depth; i++)
+    {
+        char *message = send_buf + i * message_bytes;
+        memcpy(message, prefix, prefix_len);
+        memset(message + prefix_len, 'x', message_size);
+        if (framing == FRAMING_LINES)
+            message[message_size - 1] = '\n';
+    }
+
+    //the idle clients are connected first and stay silent during the run
+    over_unix = unix_path && !compare_unix;
+    long resident_before = residentBytes();
+    int *idle_socks = idle_count ? (int *)malloc(idle_count * sizeof(int)) : NULL;
+    for (int i = 0; i < idle_count; i++)
+    {
+        idle_socks[i] = connectBench();
+        if (idle_socks[i] == -1)
+            return 1;
+    }
+
+    //over TCP, over the Unix socket, or both one after another
+    if (!runBench(unix_path && !compare_unix))
+        return 1;
+    if (compare_unix && !runBench(true))
+        return 1;
+
+    //how many of the large replies of the in-process server went without the kernel copy
+    if (local_server && server.zerocopy_min_size > 0)
+        printf("zero-copy sends: %" PRIu64 ", completed %" PRIu64 ", copied by the kernel %" PRIu64 "\n",
+               server.getZerocopySendCount(), server.getZerocopyDoneCount(), server.getZerocopyCopiedCount());
+
+    //memory of the server per connection, with the idle ones still open
+    if (idle_count > 0 && local_server)
+    {
+        long table = server.getConnectionTableBytes();
+        long buffers = server.getBufferBytes();
+        int active = server.getConnectionCount();
+        printf("memory with %d idle connections: %ld bytes per connection (table %ld, buffers %ld), process resident growth %ld bytes per connection\n",
+               idle_count, (table + buffers) / active, table, buffers, (residentBytes() - resident_before) / active);
+    }
+    else if (idle_count > 0)
+    {
+        // a remote echo_server reports its own memory
+        char report[RECV_BUF_SIZE];
+        int len = 0, sz;
+        send(idle_socks[0], "stats memory\n", 13, MSG_NOSIGNAL);
+        for (int lines = 0; lines < 3 && (sz = recv(idle_socks[0], report + len, sizeof(report) - 1 - len, 0)) > 0;)
+        {
+            for (int i = len; i < len + sz; i++)
+                lines += report[i] == '\n';
+            len += sz;
+        }
+        report[len] = 0;
+        printf("memory with %d idle connections:\n%s", idle_count, report);
+    }
+
+    for (int i = 0; i < idle_count; i++)
+        close(idle_socks[i]);
+    free(idle_socks);
+    free(send_buf);
+
+    if (local_server)
+    {
+        server.Stop();
+        server.WaitServer();
+    }
+
+    return 0;
+}
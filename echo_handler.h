@@ -0,0 +1,81 @@
+#pragma once
+
+#include "typed_server.h"
+#include "command_table.h"
+#include <inttypes.h>
+
+//------------------------------------------------------------------------------------
+//message processor for clent messages
+
+//service commands, in the order of their names
+enum EchoCommand
+{
+    CMD_STATS,
+    CMD_STATS_LATENCY,
+    CMD_STATS_MEMORY,
+    CMD_CLOSE,
+    CMD_SHUTDOWN,
+};
+
+static constexpr const char *command_names[] = {"stats", "stats latency", "stats memory", "close", "shutdown"};
+static constexpr CommandTable<5> commands(command_names);
+static_assert(commands.Valid(), "no perfect hash for the commands");
+
+static void sendLatency(Connection* conn, const char *name, LatencyPercentiles latency)
+{
+    conn->sendMessage("%s latency us: count %" PRIu64 ", p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", name,
+                      latency.count, latency.p50 / 1e3, latency.p90 / 1e3, latency.p99 / 1e3, latency.p999 / 1e3, latency.max / 1e3);
+}
+
+//the message is a view into the receive buffer, it is checked against the commands with one hash slot,
+//the binary frames are only echoed
+struct EchoHandler
+{
+    static inline void Process(Connection *conn, const char *message, int message_len)
+    {
+        switch (conn->framing == FRAMING_LINES ? commands.Find(message, message_len) : -1)
+        {
+        case CMD_STATS_MEMORY:
+        {
+            TCPServer *server = conn->server;
+            long table = server->getConnectionTableBytes();
+            long buffers = server->getBufferBytes();
+            conn->sendMessage("connection table bytes: %ld\n", table);
+            conn->sendMessage("buffer bytes: %ld (pooled free %ld)\n", buffers, server->getPooledFreeBytes());
+            // the datagram connections are not in the table, a probe may come with no clients
+            int count = server->getConnectionCount();
+            if (count > 0)
+                conn->sendMessage("bytes per connection: %ld\n", (table + buffers) / count);
+            else
+                conn->sendMessage("bytes per connection: n/a\n");
+            break;
+        }
+        case CMD_STATS_LATENCY:
+            sendLatency(conn, "response", conn->server->getResponseLatency());
+            sendLatency(conn, "handler", conn->server->getHandlerLatency());
+            break;
+        case CMD_STATS:
+            conn->sendMessage("client count: %d\n", conn->server->getConnectionCount());
+            conn->sendMessage("client messages: %" PRIu64 "\n", conn->message_count);
+            conn->sendMessage("server messages: %" PRIu64 "\n", conn->server->getMessageCount());
+            if (conn->server->udp_port > 0)
+                conn->sendMessage("server datagrams: %" PRIu64 " (%" PRIu64 "/s)\n", conn->server->getDatagramCount(), conn->server->getDatagramRate());
+            if (conn->server->zerocopy_min_size > 0)
+                conn->sendMessage("server zero-copy sends: %" PRIu64 " (completed %" PRIu64 ", copied %" PRIu64 ")\n", conn->server->getZerocopySendCount(),
+                                  conn->server->getZerocopyDoneCount(), conn->server->getZerocopyCopiedCount());
+            break;
+        case CMD_CLOSE:
+            conn->sendMessage("Goodbye\n");
+            conn->disconnect();
+            break;
+        case CMD_SHUTDOWN:
+            conn->server->Stop();
+            break;
+        default:
+            conn->sendFrame(message, message_len);
+            // increase counters
+            conn->message_count++;
+            conn->server->incMessageCount();
+        }
+    }
+};
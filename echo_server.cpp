@@ -1,43 +1,19 @@
-#include "tcp_server.h"
+#include "echo_handler.h"
 #include <stdlib.h>
 
 #define ECHO_TCP_PORT   2121
-//------------------------------------------------------------------------------------
-//message processor for clent messages
-
-void processMessage(Connection* conn, char *message, int message_len)
-{
-    if (!strcasecmp(message, "stats"))
-    {
-        conn->sendMessage("client count: %d\n", conn->server->getConnectionCount());
-        conn->sendMessage("client messages: %d\n", conn->message_count);
-        conn->sendMessage("server messages: %d\n", conn->server->getMessageCount());
-    }
-    else if (!strcasecmp(message, "close"))
-    {
-        conn->sendMessage("Goodbye\n");
-        shutdown(conn->socket, SHUT_RDWR);
-    }
-    else if (!strcasecmp(message, "shutdown"))
-    {
-        conn->server->Stop();
-    }
-    else
-    {
-        conn->sendMessage("%s\n", message);
-        // increase counters
-        conn->message_count++;
-        conn->server->incMessageCount();
-    }
-}
-
 //------------------------------------------------------------------------------------
 //main program
 
 int main(int argc, char *argv[])
 {
-    TCPServer server;
+    TypedServer<EchoHandler> server;
     int port = ECHO_TCP_PORT; //default port number is TCP:2121
+    bool ipv6 = false;
+    const char *unix_path = NULL;
+    int frame_port = 0;
+    Framing frame_framing = FRAMING_LENGTH32;
+    int raw_port = 0;
 
     //check args for overriding
     for (int i = 1; i < argc; i++)
@@ -46,6 +22,67 @@ int main(int argc, char *argv[])
             port = atoi(argv[i] + 2);
         if (!strcmp(argv[i], "-d"))
             server.debug_printing = true;
+        if (!strcmp(argv[i], "-l"))
+            server.track_latency = true;
+        if (!strncmp(argv[i], "-e", 2))
+        {
+            server.io_mode = IO_EPOLL;
+            server.reactor_threads = atoi(argv[i] + 2);
+        }
+        if (!strcmp(argv[i], "-i"))
+            server.io_mode = IO_URING;
+        if (!strncmp(argv[i], "-w", 2))
+        {
+            server.io_mode = IO_POOL;
+            server.pool_threads = atoi(argv[i] + 2);
+        }
+        if (!strncmp(argv[i], "-a", 2))
+            server.admin_port = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-k", 2))
+            server.thread_stack_size = atoi(argv[i] + 2) * 1024;
+        if (!strncmp(argv[i], "-m", 2))
+            server.max_message_size = atoi(argv[i] + 2) + 1;
+        if (!strcmp(argv[i], "-oreject"))
+            server.overflow_policy = OVERFLOW_REJECT;
+        if (!strcmp(argv[i], "-odisconnect"))
+            server.overflow_policy = OVERFLOW_DISCONNECT;
+        if (!strncmp(argv[i], "-c", 2))
+            server.max_connections = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-ti", 3))
+            server.idle_timeout_ms = atoi(argv[i] + 3);
+        if (!strncmp(argv[i], "-tr", 3))
+            server.read_timeout_ms = atoi(argv[i] + 3);
+        if (!strncmp(argv[i], "-tw", 3))
+            server.write_timeout_ms = atoi(argv[i] + 3);
+        if (!strncmp(argv[i], "-D", 2))
+            server.defer_accept_sec = atoi(argv[i] + 2);
+        if (!strncmp(argv[i], "-s", 2))
+            server.listener_shards = atoi(argv[i] + 2);
+        if (!strcmp(argv[i], "-Scpu"))
+            server.cpu_steering = STEER_INCOMING_CPU;
+        if (!strcmp(argv[i], "-Sbpf"))
+            server.cpu_steering = STEER_BPF;
+        if (!strncmp(argv[i], "-U", 2))
+            server.handoff_path = argv[i] + 2;
+        if (!strcmp(argv[i], "-L"))
+            server.handoff_connections = true;
+        if (!strcmp(argv[i], "-6"))
+            ipv6 = true;
+        if (!strncmp(argv[i], "-u", 2))
+            unix_path = argv[i] + 2;
+        if (!strncmp(argv[i], "-g", 2))
+            server.udp_port = atoi(argv[i] + 2);
+        if (!strcmp(argv[i], "-G"))
+            server.udp_offload = true;
+        if (!strncmp(argv[i], "-z", 2))
+            server.zerocopy_min_size = argv[i][2] ? atoi(argv[i] + 2) : ZEROCOPY_MIN_SIZE;
+        if (!strncmp(argv[i], "-fr", 3))
+            raw_port = atoi(argv[i] + 3);
+        else if (!strncmp(argv[i], "-f", 2))
+        {
+            frame_framing = argv[i][2] == 'v' ? FRAMING_VARINT : FRAMING_LENGTH32;
+            frame_port = atoi(argv[i] + (argv[i][2] == 'v' ? 3 : 2));
+        }
     }
 
     //check if port number is valid
@@ -55,12 +92,88 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    server.ProcessMessagePtr = &processMessage;
+    if (server.admin_port < 0 || server.admin_port > 0xFFFF || server.admin_port == port)
+    {
+        fprintf(stderr, "invalid admin port number\n");
+        return 1;
+    }
+
+    if (server.udp_port < 0 || server.udp_port > 0xFFFF)
+    {
+        fprintf(stderr, "invalid UDP port number\n");
+        return 1;
+    }
+
+    if (frame_port < 0 || frame_port > 0xFFFF || (frame_port && frame_port == port))
+    {
+        fprintf(stderr, "invalid frame port number\n");
+        return 1;
+    }
+
+    if (raw_port < 0 || raw_port > 0xFFFF || (raw_port && (raw_port == port || raw_port == frame_port)))
+    {
+        fprintf(stderr, "invalid raw echo port number\n");
+        return 1;
+    }
+
+    if (server.max_message_size < 2 || server.max_message_size > POOL_MAX_SIZE)
+    {
+        fprintf(stderr, "invalid maximum line length\n");
+        return 1;
+    }
+
+    if (server.max_connections < 1)
+    {
+        fprintf(stderr, "invalid connection limit\n");
+        return 1;
+    }
+
+    if (server.idle_timeout_ms < 0 || server.read_timeout_ms < 0 || server.write_timeout_ms < 0)
+    {
+        fprintf(stderr, "invalid timeout\n");
+        return 1;
+    }
+
+    if (server.zerocopy_min_size < 0)
+    {
+        fprintf(stderr, "invalid zero-copy threshold\n");
+        return 1;
+    }
+
+    if (server.handoff_path && !*server.handoff_path)
+    {
+        fprintf(stderr, "invalid handoff path\n");
+        return 1;
+    }
+
+    if (unix_path && !*unix_path)
+    {
+        fprintf(stderr, "invalid Unix socket path\n");
+        return 1;
+    }
 
-    //activate server
-    if (!server.SetupListening(port))
+    //activate server, taking over the endpoints of the running one on a hot upgrade
+    if (server.handoff_path && !server.SetupHandoff())
         return 1;
 
+    //IPv4 or dual-stack IPv6 on the port, and the Unix socket next to it,
+    //the length-prefixed frames and the raw echo on their own ports
+    if (!server.getListenerCount())
+    {
+        if (!(ipv6 ? server.AddListening6(port) : server.AddListening(port)))
+            return 1;
+        if (unix_path && !server.AddListeningUnix(unix_path))
+            return 1;
+
+        server.framing = frame_framing;
+        if (frame_port && !(ipv6 ? server.AddListening6(frame_port) : server.AddListening(frame_port)))
+            return 1;
+
+        server.framing = FRAMING_RAW_ECHO;
+        if (raw_port && !(ipv6 ? server.AddListening6(raw_port) : server.AddListening(raw_port)))
+            return 1;
+    }
+
     if (!server.Start())
         return 1;
 
@@ -69,6 +182,6 @@ int main(int argc, char *argv[])
     // wait during server operation
     server.WaitServer();
 
-    printf("finished\n");
+    printf(server.isHandedOff() ? "handed off\n" : "finished\n");
     return 0;
 }
\ No newline at end of file
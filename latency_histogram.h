@@ -0,0 +1,174 @@
+#pragma once
+
+#include "sharded_counter.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+static inline uint64_t monotonicNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000ULL + ts.tv_nsec;
+}
+
+// the common percentiles of a histogram
+struct LatencyPercentiles
+{
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+// log-linear histogram of 64-bit values, every power of two is split in 64 buckets,
+// so the reported values are within 1.6% of the recorded ones.
+// the recording is lock-free, so a histogram may be shared by a few threads
+class LatencyHistogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+
+    static inline int bucketOf(uint64_t value)
+    {
+        if (value < HIST_SUB_COUNT)
+            return value;
+
+        int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        return (shift + 1) * HIST_SUB_COUNT + (int)(value >> shift) - HIST_SUB_COUNT;
+    }
+
+    // the highest value counted in the bucket
+    static inline uint64_t valueOf(int bucket)
+    {
+        if (bucket < HIST_SUB_COUNT)
+            return bucket;
+
+        int shift = bucket / HIST_SUB_COUNT - 1;
+        uint64_t sub = bucket % HIST_SUB_COUNT + HIST_SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() { Reset(); }
+
+    inline void Record(uint64_t value)
+    {
+        __atomic_fetch_add(&counts[bucketOf(value)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total, 1, __ATOMIC_RELAXED);
+
+        uint64_t current = __atomic_load_n(&max, __ATOMIC_RELAXED);
+        while (value > current && !__atomic_compare_exchange_n(&max, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+
+    // the other histogram may be recorded meanwhile, the result is a close snapshot
+    void Add(const LatencyHistogram &other)
+    {
+        for (int i = 0; i < HIST_BUCKETS; i++)
+            counts[i] += __atomic_load_n(&other.counts[i], __ATOMIC_RELAXED);
+        total += __atomic_load_n(&other.total, __ATOMIC_RELAXED);
+        uint64_t other_max = __atomic_load_n(&other.max, __ATOMIC_RELAXED);
+        if (other_max > max)
+            max = other_max;
+    }
+
+    // the value below which the given percent of the recorded values are
+    uint64_t Percentile(double percent)
+    {
+        if (total == 0)
+            return 0;
+
+        uint64_t target = (uint64_t)(total * percent / 100.0 + 0.5);
+        if (target < 1)
+            target = 1;
+
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen >= target)
+                return valueOf(i) < max ? valueOf(i) : max;
+        }
+
+        return max;
+    }
+
+    LatencyPercentiles Percentiles()
+    {
+        LatencyPercentiles result;
+        result.count = total;
+        result.p50 = Percentile(50);
+        result.p90 = Percentile(90);
+        result.p99 = Percentile(99);
+        result.p999 = Percentile(99.9);
+        result.max = max;
+        return result;
+    }
+
+    inline uint64_t Count() { return total; }
+    inline uint64_t Max() { return max; }
+
+    void Reset()
+    {
+        memset(counts, 0, sizeof(counts));
+        total = max = 0;
+    }
+};
+
+// histogram with a lazily allocated shard per thread slot, merged when it is read
+class ShardedHistogram
+{
+    LatencyHistogram *shards[COUNTER_SHARDS] = {};
+
+public:
+    ~ShardedHistogram()
+    {
+        for (int i = 0; i < COUNTER_SHARDS; i++)
+            delete shards[i];
+    }
+
+    inline void Record(uint64_t value)
+    {
+        int slot = counterThreadSlot();
+        LatencyHistogram *shard = __atomic_load_n(&shards[slot], __ATOMIC_ACQUIRE);
+        if (!shard)
+        {
+            // another thread of the same slot may install its shard first
+            LatencyHistogram *created = new LatencyHistogram();
+            if (__atomic_compare_exchange_n(&shards[slot], &shard, created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                shard = created;
+            else
+                delete created;
+        }
+
+        shard->Record(value);
+    }
+
+    void Merge(LatencyHistogram &result)
+    {
+        for (int i = 0; i < COUNTER_SHARDS; i++)
+        {
+            LatencyHistogram *shard = __atomic_load_n(&shards[i], __ATOMIC_ACQUIRE);
+            if (shard)
+                result.Add(*shard);
+        }
+    }
+
+    void Reset()
+    {
+        for (int i = 0; i < COUNTER_SHARDS; i++)
+        {
+            LatencyHistogram *shard = __atomic_load_n(&shards[i], __ATOMIC_ACQUIRE);
+            if (shard)
+                shard->Reset();
+        }
+    }
+};
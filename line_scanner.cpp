@@ -0,0 +1,78 @@
+#include "line_scanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+int findTerminatorScalar(const unsigned char *data, int size)
+{
+    for (int i = 0; i < size; i++)
+        if (data[i] == '\r' || data[i] == '\n')
+            return i;
+
+    return size;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2"))) int findTerminatorSSE2(const unsigned char *data, int size)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, cr), _mm_cmpeq_epi8(block, lf)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + findTerminatorScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2"))) int findTerminatorAVX2(const unsigned char *data, int size)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    int i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, cr), _mm256_cmpeq_epi8(block, lf)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    // the rest is shorter than one AVX2 block
+    return i + findTerminatorSSE2(data + i, size - i);
+}
+
+#endif
+
+// resolved on the first call, the race between threads writes the same value
+static int findTerminatorDispatch(const unsigned char *data, int size);
+static FindTerminatorFunc find_terminator_impl = findTerminatorDispatch;
+
+static int findTerminatorDispatch(const unsigned char *data, int size)
+{
+    FindTerminatorFunc impl = findTerminatorScalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        impl = findTerminatorAVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        impl = findTerminatorSSE2;
+#endif
+
+    __atomic_store_n(&find_terminator_impl, impl, __ATOMIC_RELAXED);
+    return impl(data, size);
+}
+
+int findTerminator(const unsigned char *data, int size)
+{
+    return __atomic_load_n(&find_terminator_impl, __ATOMIC_RELAXED)(data, size);
+}
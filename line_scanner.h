@@ -0,0 +1,13 @@
+#pragma once
+
+// search for the first <CR> or <LF> byte, returns its offset or size if there is none
+typedef int (*FindTerminatorFunc)(const unsigned char* data, int size);
+
+// dispatches to the widest implementation supported by the CPU (AVX2, SSE2 or scalar)
+int findTerminator(const unsigned char* data, int size);
+
+int findTerminatorScalar(const unsigned char* data, int size);
+#if defined(__x86_64__) || defined(__i386__)
+int findTerminatorSSE2(const unsigned char* data, int size);
+int findTerminatorAVX2(const unsigned char* data, int size);
+#endif
@@ -1,13 +1,21 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
 
-template <int SIZE>
+#define LLIST_CHUNK_SIZE 256
+
+// double linked list of positions with runtime capacity,
+// the position arrays are allocated in chunks when the free list runs out
 class LList
 {
-    int next[SIZE];
-    int prev[SIZE];
+    int** next_chunks = NULL;
+    int** prev_chunks = NULL;
+    int chunk_count = 0;
+    int allocated = 0;
+    int capacity = 0;
+
     int head;
     int tail;
     int firstFree;
@@ -16,56 +24,113 @@ class LList
 
     pthread_mutex_t access_lock = PTHREAD_MUTEX_INITIALIZER;
     bool validItemAtPos(int pos);
+    bool grow();
+    void release();
+
+    inline int& next(int pos) { return next_chunks[pos / LLIST_CHUNK_SIZE][pos % LLIST_CHUNK_SIZE]; }
+    inline int& prev(int pos) { return prev_chunks[pos / LLIST_CHUNK_SIZE][pos % LLIST_CHUNK_SIZE]; }
 
 public:
-    void Reset();
-    LList() { Reset(); }
+    void Reset(int new_capacity);
+    LList(int capacity = 0) { Reset(capacity); }
+    ~LList() { release(); }
 
     int AddPos();
     bool RemoveAt(int pos);
     inline int Head() { return head; }
     inline int Tail() { return tail; }
-    inline int Next(int pos) { return next[pos]; }
-    inline int Prev(int pos) { return prev[pos]; }
+    inline int Next(int pos) { return next(pos); }
+    inline int Prev(int pos) { return prev(pos); }
     inline int Count() { return count; }
+    inline int Capacity() { return capacity; }
+    inline int Allocated() { return allocated; }
+    inline long MemoryBytes() { return (long)allocated * 2 * sizeof(int) + chunk_count * 2 * sizeof(int*); }
 };
 
-template <int SIZE>
-void LList<SIZE>::Reset()
+inline void LList::release()
+{
+    for (int i = 0; i < chunk_count; i++)
+    {
+        free(next_chunks[i]);
+        free(prev_chunks[i]);
+    }
+
+    free(next_chunks);
+    free(prev_chunks);
+    next_chunks = prev_chunks = NULL;
+    chunk_count = 0;
+    allocated = 0;
+}
+
+inline void LList::Reset(int new_capacity)
 {
-    for (int i = 1; i < SIZE; i++)
+    release();
+
+    // only the chunk pointers are allocated upfront, they never move after that
+    capacity = new_capacity > 0 ? new_capacity : 0;
+    chunk_count = (capacity + LLIST_CHUNK_SIZE - 1) / LLIST_CHUNK_SIZE;
+    if (chunk_count)
     {
-        next[i - 1] = i;
-        prev[i] = -1;
+        next_chunks = (int **)calloc(chunk_count, sizeof(int *));
+        prev_chunks = (int **)calloc(chunk_count, sizeof(int *));
     }
 
-    prev[0] = -1;
-    firstFree = 0;
+    firstFree = -1;
     head = tail = -1;
     count = 0;
 }
 
-template <int SIZE>
-int LList<SIZE>::AddPos()
+// allocate the next chunk and put its positions in the free list, in order
+inline bool LList::grow()
+{
+    if (allocated >= capacity)
+        return false;
+
+    int chunk = allocated / LLIST_CHUNK_SIZE;
+    next_chunks[chunk] = (int *)malloc(LLIST_CHUNK_SIZE * sizeof(int));
+    prev_chunks[chunk] = (int *)malloc(LLIST_CHUNK_SIZE * sizeof(int));
+    if (!next_chunks[chunk] || !prev_chunks[chunk])
+    {
+        perror("can't allocate list chunk");
+        free(next_chunks[chunk]);
+        free(prev_chunks[chunk]);
+        next_chunks[chunk] = prev_chunks[chunk] = NULL;
+        return false;
+    }
+
+    int first = allocated;
+    int last = allocated + LLIST_CHUNK_SIZE < capacity ? allocated + LLIST_CHUNK_SIZE : capacity;
+    for (int i = first; i < last; i++)
+    {
+        next(i) = i + 1 < last ? i + 1 : firstFree;
+        prev(i) = -1;
+    }
+
+    firstFree = first;
+    allocated = last;
+    return true;
+}
+
+inline int LList::AddPos()
 {
     pthread_mutex_lock(&access_lock);
 
-    if (count == SIZE)
+    if (count == capacity || (firstFree == -1 && !grow()))
     {
         pthread_mutex_unlock(&access_lock);
         return -1;
     }
 
     int pos = firstFree;
-    firstFree = next[firstFree];
+    firstFree = next(firstFree);
 
-    prev[pos] = tail;
+    prev(pos) = tail;
     if (tail != -1)
-        next[tail] = pos;
+        next(tail) = pos;
     tail = pos;
     if (head == -1)
         head = pos;
-    next[pos] = -1;
+    next(pos) = -1;
 
     count++;
 
@@ -74,20 +139,18 @@ int LList<SIZE>::AddPos()
     return pos;
 }
 
-template <int SIZE>
-bool LList<SIZE>::validItemAtPos(int pos)
+inline bool LList::validItemAtPos(int pos)
 {
-    if (pos < 0 || pos >= SIZE)
+    if (pos < 0 || pos >= allocated)
         return false;
 
-    if (pos != head && prev[pos] == -1)
+    if (pos != head && prev(pos) == -1)
         return false;
 
     return true;
 }
 
-template <int SIZE>
-bool LList<SIZE>::RemoveAt(int pos)
+inline bool LList::RemoveAt(int pos)
 {
     pthread_mutex_lock(&access_lock);
 
@@ -103,18 +166,18 @@ bool LList<SIZE>::RemoveAt(int pos)
         return false;
     }
 
-    if (prev[pos] == -1)
-        head = next[pos];
+    if (prev(pos) == -1)
+        head = next(pos);
     else
-        next[prev[pos]] = next[pos];
+        next(prev(pos)) = next(pos);
 
-    if (next[pos] == -1)
-        tail = prev[pos];
+    if (next(pos) == -1)
+        tail = prev(pos);
     else
-        prev[next[pos]] = prev[pos];
+        prev(next(pos)) = prev(pos);
 
-    prev[pos] = -1;
-    next[pos] = firstFree;
+    prev(pos) = -1;
+    next(pos) = firstFree;
     firstFree = pos;
 
     count--;
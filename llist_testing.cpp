@@ -3,7 +3,7 @@
 
 
 TEST(LList, Support1) {
-    LList<100> list;
+    LList list(100);
     for (int i = 0; i < 100; i++)
         EXPECT_EQ(list.AddPos(), i);
     EXPECT_EQ(list.AddPos(), -1);
@@ -18,7 +18,7 @@ TEST(LList, Support1) {
 }
 
 TEST(LList, Support2) {
-    LList<100> list;
+    LList list(100);
     for (int i = 0; i < 100; i++)
         EXPECT_EQ(list.AddPos(), i);
     EXPECT_EQ(list.RemoveAt(0), true);
@@ -39,8 +39,42 @@ TEST(LList, Support2) {
     EXPECT_EQ(list.RemoveAt(99), false);
 }
 
+TEST(LList, ChunkedGrowth) {
+    LList list(100'000);
+    EXPECT_EQ(list.Capacity(), 100'000);
+    EXPECT_EQ(list.Allocated(), 0);
+    for (int i = 0; i < 1000; i++)
+        EXPECT_EQ(list.AddPos(), i);
+    EXPECT_EQ(list.Allocated(), 4 * LLIST_CHUNK_SIZE);
+    EXPECT_EQ(list.Count(), 1000);
+    for (int i = 1; i < 1000; i++)
+    {
+        EXPECT_EQ(list.Next(i - 1), i);
+        EXPECT_EQ(list.Prev(i), i - 1);
+    }
+
+    // freed positions are reused before the list grows again
+    for (int i = 0; i < 1000; i += 2)
+        EXPECT_EQ(list.RemoveAt(i), true);
+    for (int i = 0; i < 500; i++)
+        EXPECT_NE(list.AddPos(), -1);
+    EXPECT_EQ(list.Count(), 1000);
+    EXPECT_EQ(list.Allocated(), 4 * LLIST_CHUNK_SIZE);
+}
+
+TEST(LList, CapacityLimit) {
+    LList list(300);
+    for (int i = 0; i < 300; i++)
+        EXPECT_EQ(list.AddPos(), i);
+    EXPECT_EQ(list.AddPos(), -1);
+    EXPECT_EQ(list.Allocated(), 300);
+    EXPECT_EQ(list.RemoveAt(299), true);
+    EXPECT_EQ(list.RemoveAt(300), false);
+    EXPECT_EQ(list.AddPos(), 299);
+}
+
 void* adding_routine(void* arg) {
-    LList<1000>* llist = (LList<1000>*)arg;
+    LList* llist = (LList*)arg;
     for (int i = 0; i < 100; i++)
     {
         usleep(100);
@@ -50,7 +84,7 @@ void* adding_routine(void* arg) {
 }
 
 void* removing_routine(void* arg) {
-    LList<1000>* llist = (LList<1000>*)arg;
+    LList* llist = (LList*)arg;
     for (int i = 0; i < 1000; i++)
     {
         usleep(100);
@@ -60,7 +94,7 @@ void* removing_routine(void* arg) {
 }
 
 TEST(LList, ThreadSafetyTest) {
-    LList<1000> llist;
+    LList llist(1000);
 
     pthread_t thread[10];
     for (int i = 0; i < 10; i++)
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+#define COUNTER_SHARDS 64
+#define CACHE_LINE_SIZE 64
+
+// the slot of the calling thread, assigned round-robin on its first use
+inline int counterThreadSlot()
+{
+    static int next_slot = 0;
+    static thread_local int slot = -1;
+    if (slot == -1)
+        slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % COUNTER_SHARDS;
+    return slot;
+}
+
+// 64-bit counter split in cache-line-padded slots, each thread increments its own slot
+// and the slots are summed only when the value is read
+class ShardedCounter
+{
+    struct alignas(CACHE_LINE_SIZE) Slot
+    {
+        uint64_t value;
+    };
+
+    Slot slots[COUNTER_SHARDS];
+
+public:
+    ShardedCounter() { Reset(); }
+
+    // the slot is shared only when there are more threads than slots, so the add is uncontended
+    inline void Add(uint64_t count = 1)
+    {
+        __atomic_fetch_add(&slots[counterThreadSlot()].value, count, __ATOMIC_RELAXED);
+    }
+
+    inline uint64_t Sum()
+    {
+        uint64_t sum = 0;
+        for (int i = 0; i < COUNTER_SHARDS; i++)
+            sum += __atomic_load_n(&slots[i].value, __ATOMIC_RELAXED);
+        return sum;
+    }
+
+    inline void Reset()
+    {
+        for (int i = 0; i < COUNTER_SHARDS; i++)
+            __atomic_store_n(&slots[i].value, 0, __ATOMIC_RELAXED);
+    }
+};
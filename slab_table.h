@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define SLAB_CHUNK_SIZE 256
+
+// table of objects with runtime capacity, the objects are allocated in chunks on first use
+// and never move after that, so the pointers to them stay valid
+template <class T>
+class SlabTable
+{
+    T** chunks = NULL;
+    int chunk_count = 0;
+    int allocated_chunks = 0;
+    int capacity = 0;
+
+    pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+public:
+    SlabTable() {}
+    ~SlabTable() { Reset(0); }
+
+    void Reset(int new_capacity);
+    T* Get(int pos);
+    inline T* At(int pos) { return &chunks[pos / SLAB_CHUNK_SIZE][pos % SLAB_CHUNK_SIZE]; }
+    inline int Capacity() { return capacity; }
+    inline int Allocated() { return allocated_chunks * SLAB_CHUNK_SIZE; }
+    inline long MemoryBytes() { return (long)allocated_chunks * SLAB_CHUNK_SIZE * sizeof(T) + chunk_count * sizeof(T*); }
+};
+
+// not thread-safe, called only when no object is in use
+template <class T>
+void SlabTable<T>::Reset(int new_capacity)
+{
+    for (int i = 0; i < chunk_count; i++)
+        delete[] chunks[i];
+    delete[] chunks;
+
+    capacity = new_capacity > 0 ? new_capacity : 0;
+    chunk_count = (capacity + SLAB_CHUNK_SIZE - 1) / SLAB_CHUNK_SIZE;
+    chunks = chunk_count ? new T *[chunk_count]() : NULL;
+    allocated_chunks = 0;
+}
+
+// get the object at the position, allocating its chunk if needed
+template <class T>
+T *SlabTable<T>::Get(int pos)
+{
+    if (pos < 0 || pos >= capacity)
+        return NULL;
+
+    int chunk = pos / SLAB_CHUNK_SIZE;
+    if (!__atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&grow_lock);
+        if (!chunks[chunk])
+        {
+            T *objects = new T[SLAB_CHUNK_SIZE];
+            __atomic_store_n(&chunks[chunk], objects, __ATOMIC_RELEASE);
+            allocated_chunks++;
+        }
+        pthread_mutex_unlock(&grow_lock);
+    }
+
+    return &chunks[chunk][pos % SLAB_CHUNK_SIZE];
+}
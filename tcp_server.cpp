@@ -1,12 +1,35 @@
 #include "tcp_server.h"
+#include <linux/filter.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
 
-bool TCPServer::makeSocket()
+bool Listener::setEndpoint(const sockaddr *endpoint, socklen_t len)
 {
-    if (server_sock != -1)
-        close(server_sock);
+    if (len > sizeof(addr))
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, endpoint, len);
+    addr_len = len;
+    family = endpoint->sa_family;
+
+    if (family == AF_INET)
+        port = ntohs(((sockaddr_in *)&addr)->sin_port);
+    else if (family == AF_INET6)
+        port = ntohs(((sockaddr_in6 *)&addr)->sin6_port);
+    else
+        port = 0;
+
+    return true;
+}
+
+bool Listener::makeSocket()
+{
+    if (sock != -1)
+        close(sock);
 
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock == -1)
+    sock = socket(family, SOCK_STREAM, 0);
+    if (sock == -1)
     {
         perror("can't create socket");
         return false;
@@ -15,58 +38,145 @@ bool TCPServer::makeSocket()
     return true;
 }
 
-bool TCPServer::setReuseAddr()
+bool Listener::setReuseAddr()
 {
-    if (server_sock == -1)
+    if (sock == -1)
         return false;
 
-    int optval = reuse_address ? 1 : 0;
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)))
+    int optval = server->reuse_address ? 1 : 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)))
     {
         perror("Error setting SO_REUSEADDR");
-        close(server_sock);
-        server_sock = -1;
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    return true;
+}
+
+// sharded listeners are bound to the same port, the kernel spreads the connections between them
+bool Listener::setReusePort()
+{
+    if (sock == -1)
+        return false;
+
+    // the admin listener and the Unix sockets are not sharded
+    if (shards == 1 || index < 0)
+        return true;
+
+    int optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)))
+    {
+        perror("Error setting SO_REUSEPORT");
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    if (server->cpu_steering == STEER_INCOMING_CPU)
+    {
+        optval = cpu;
+        if (setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &optval, sizeof(optval)))
+            perror("Error setting SO_INCOMING_CPU");
+    }
+
+    return true;
+}
+
+// a dual-stack socket accepts the IPv4 clients too, as mapped addresses
+bool Listener::setV6Only()
+{
+    if (sock == -1)
+        return false;
+
+    if (family != AF_INET6)
+        return true;
+
+    int optval = v6only ? 1 : 0;
+    if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval)))
+    {
+        perror("Error setting IPV6_V6ONLY");
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    return true;
+}
+
+// the kernel completes the handshake but queues the connection only when its first data arrives
+bool Listener::setDeferAccept()
+{
+    if (sock == -1)
+        return false;
+
+    if (server->defer_accept_sec <= 0 || index < 0 || family == AF_UNIX)
+        return true;
+
+    int optval = server->defer_accept_sec;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &optval, sizeof(optval)))
+        perror("Error setting TCP_DEFER_ACCEPT");
+
+    return true;
+}
+
+// select the listener by the CPU receiving the connection request: listener = cpu % count
+bool Listener::attachSteeringProgram()
+{
+    sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)shards },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+    {
+        perror("Error attaching the reuseport steering program");
         return false;
     }
 
     return true;
 }
 
-bool TCPServer::bindToEndPoint()
+bool Listener::bindToEndPoint()
 {
-    if (server_sock == -1)
+    if (sock == -1)
         return false;
 
-    sockaddr_in ls_addr;
-    memset(&ls_addr, 0, sizeof(ls_addr));
-    ls_addr.sin_family = AF_INET;
-    ls_addr.sin_port = htons(tcp_port);
-    ls_addr.sin_addr.s_addr = bindAddr;
+    // a stale socket file is left by a process that didn't pass it on
+    if (family == AF_UNIX)
+        unlink(((sockaddr_un *)&addr)->sun_path);
 
-    if (bind(server_sock, (sockaddr *)&ls_addr, sizeof(ls_addr)))
+    if (bind(sock, (sockaddr *)&addr, addr_len))
     {
         perror("can't bind the socket");
-        close(server_sock);
-        server_sock = -1;
+        close(sock);
+        sock = -1;
         return false;
     }
 
     return true;
 }
 
-bool TCPServer::listenOnSocket()
+bool Listener::listenOnSocket()
 {
-    if (server_sock == -1)
+    if (sock == -1)
         return false;
 
-    if (listen(server_sock, backlog))
+    if (listen(sock, server->backlog))
     {
         perror("can't listen");
-        close(server_sock);
-        server_sock = -1;
+        close(sock);
+        sock = -1;
         return false;
     }
 
+    // the program is shared by the whole reuseport group, so it is attached once
+    if (server->cpu_steering == STEER_BPF && shards > 1 && shard == 0)
+        attachSteeringProgram();
+
     return true;
 }
 
@@ -98,17 +208,34 @@ bool TCPServer::pollForRead(int socket, int timeout_ms)
     return poll(&pfd, 1, timeout_ms) == 1;
 }
 
-bool TCPServer::setupSocket()
+bool TCPServer::pollForWrite(int socket, int timeout_ms)
+{
+    pollfd pfd;
+    pfd.fd = socket;
+    pfd.events = POLLOUT;
+    return poll(&pfd, 1, timeout_ms) == 1;
+}
+
+bool Listener::setupSocket()
 {
     if (!makeSocket())
         return false;
 
-    if (!setNonBlockingMode(server_sock))
+    if (!TCPServer::setNonBlockingMode(sock))
         return false;
 
     if (!setReuseAddr())
         return false;
 
+    if (!setReusePort())
+        return false;
+
+    if (!setV6Only())
+        return false;
+
+    if (!setDeferAccept())
+        return false;
+
     if (!bindToEndPoint())
         return false;
 
@@ -118,114 +245,546 @@ bool TCPServer::setupSocket()
     return true;
 }
 
+void Listener::closeSocket()
+{
+    if (sock == -1)
+        return;
+
+    close(sock);
+    sock = -1;
+}
+
 bool TCPServer::SetupListening(int port, int addr)
 {
-    bindAddr = addr;
-    tcp_port = port;
+    if (running)
+        return false;
 
-    return setupSocket();
+    closeListeners();
+    return AddListening(port, addr);
 }
 
-void TCPServer::closeSocket()
+bool TCPServer::AddListening(int port, int addr)
 {
-    if (server_sock == -1)
-        return;
+    if (running)
+        return false;
+
+    sockaddr_in endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.sin_family = AF_INET;
+    endpoint.sin_port = htons(port);
+    endpoint.sin_addr.s_addr = addr;
 
-    close(server_sock);
-    server_sock = -1;
+    int count = shardCount();
+    return openListeners(addListeners(count, (sockaddr *)&endpoint, sizeof(endpoint)), count);
 }
 
-// server main thread
-void *TCPServer::serverLoop(void *param)
+bool TCPServer::AddListening6(int port, const in6_addr &addr, bool v6only)
 {
-    auto server = (TCPServer *)param;
-    while (server->running)
+    if (running)
+        return false;
+
+    sockaddr_in6 endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.sin6_family = AF_INET6;
+    endpoint.sin6_port = htons(port);
+    endpoint.sin6_addr = addr;
+
+    int count = shardCount();
+    Listener *added = addListeners(count, (sockaddr *)&endpoint, sizeof(endpoint));
+    for (int i = 0; added && i < count; i++)
+        added[i].v6only = v6only;
+    return openListeners(added, count);
+}
+
+// same-host clients skip the TCP stack, the socket file is replaced if it exists
+bool TCPServer::AddListeningUnix(const char *path)
+{
+    if (running)
+        return false;
+
+    sockaddr_un endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.sun_family = AF_UNIX;
+    if (!path || !*path || strlen(path) >= sizeof(endpoint.sun_path))
+    {
+        fprintf(stderr, "invalid Unix socket path\n");
+        return false;
+    }
+    strcpy(endpoint.sun_path, path);
+
+    return openListeners(addListeners(1, (sockaddr *)&endpoint, sizeof(endpoint)), 1);
+}
+
+int TCPServer::shardCount()
+{
+    int count = listener_shards > 0 ? listener_shards : sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+// append the listeners of one endpoint without their sockets, NULL on failure
+Listener *TCPServer::addListeners(int count, const sockaddr *endpoint, socklen_t len)
+{
+    int first = listener_count;
+    Listener *grown = new Listener[listener_count + count];
+    for (int i = 0; i < listener_count; i++)
+        grown[i] = listeners[i];
+    delete[] listeners;
+    listeners = grown;
+    listener_count += count;
+
+    int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = first; i < listener_count; i++)
+    {
+        listeners[i].index = i;
+        listeners[i].shard = i - first;
+        listeners[i].shards = count;
+        listeners[i].cpu = listeners[i].shard % (cpu_count > 0 ? cpu_count : 1);
+        listeners[i].server = this;
+        listeners[i].framing = framing;
+        if (!listeners[i].setEndpoint(endpoint, len))
+        {
+            closeListeners(first);
+            return NULL;
+        }
+
+        listeners[i].wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (listeners[i].wakeup_fd == -1)
+        {
+            perror("can't create eventfd");
+            closeListeners(first);
+            return NULL;
+        }
+    }
+
+    splitCapacity();
+    return &listeners[first];
+}
+
+bool TCPServer::openListeners(Listener *added, int count)
+{
+    if (!added)
+        return false;
+
+    // the endpoint is all set up or not added at all
+    for (int i = 0; i < count; i++)
+        if (!added[i].setupSocket())
+        {
+            closeListeners(added->index);
+            splitCapacity();
+            return false;
+        }
+
+    return true;
+}
+
+// the shards of an endpoint split the connection table, the endpoints share it -
+// each listener also stops at the count of the whole table
+void TCPServer::splitCapacity()
+{
+    // a worker serves its connection until the client leaves, so the pool admits one per worker -
+    // the clients above wait in the listen backlog instead of a queue no worker may ever take
+    admitted_max = max_connections;
+    if (io_mode == IO_POOL && poolThreads() < admitted_max)
+        admitted_max = poolThreads();
+
+    for (int i = 0; i < listener_count; i++)
+    {
+        Listener &listener = listeners[i];
+        listener.capacity = admitted_max / listener.shards + (listener.shard < admitted_max % listener.shards ? 1 : 0);
+    }
+}
+
+// the listeners from first on, all of them by default - a failed endpoint drops only its own
+void TCPServer::closeListeners(int first)
+{
+    for (int i = first; i < listener_count; i++)
+    {
+        listeners[i].closeSocket();
+        if (listeners[i].wakeup_fd != -1)
+            close(listeners[i].wakeup_fd);
+        listeners[i].wakeup_fd = -1;
+    }
+    listener_count = first;
+
+    if (first == 0)
+    {
+        delete[] listeners;
+        listeners = NULL;
+    }
+}
+
+// accept loop of a single listener
+void *Listener::listenerLoop(void *param)
+{
+    auto listener = (Listener *)param;
+    auto server = listener->server;
+
+    // keep the accepting thread on the CPU that receives the connections of this listener
+    if (server->cpu_steering != STEER_NONE)
     {
-        if (server->connections_list.Count() >= MAX_ACTIVE_CONNECTIONS)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(listener->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    // after a handoff the next process accepts on the same sockets
+    while (server->running && !server->handing_off)
+    {
+        if (listener->atCapacity() && listener->steered())
         {
-            if (!server->isSocketClosed() && server->closeOnMaxConnections)
+            listener->rejectClients();
+            listener->pollForClients(POLL_TIMEOUT_MS);
+            continue;
+        }
+
+        if (listener->atCapacity())
+        {
+            if (!listener->isSocketClosed() && server->closeOnMaxConnections)
             {
                 if (server->debug_printing)
                     fprintf(stderr, "too many active connections\n");
-                server->closeSocket();
+                server->closeListenerSocket(listener);
+                server->listener_closes.Add();
             }
 
-            sleep(1);
+            // reopened as soon as a connection completes
+            listener->waitForSlot(POLL_TIMEOUT_MS);
             continue;
         }
 
-        if (server->isSocketClosed())
-            if (!server->setupSocket())
-            {
-                fprintf(stderr, "can't setup the listening socket\n");
-                server->running = false;
-                return NULL;
-            }
+        if (listener->isSocketClosed())
+        {
+            if (!server->reopenListenerSocket(listener))
+                break;
+            if (listener->isSocketClosed())
+                continue;
+        }
 
-        if (!pollForRead(server->server_sock, POLL_TIMEOUT_MS))
+        if (!listener->pollForClients(POLL_TIMEOUT_MS))
             continue;
 
-        server->acceptClient();
+        listener->acceptClients();
     }
 
     // closing the listening socket
-    server->closeSocket();
+    server->closeListenerSocket(listener);
+
+    return NULL;
+}
+
+// the sockets being passed to the next process are not closed meanwhile
+void TCPServer::closeListenerSocket(Listener *listener)
+{
+    pthread_mutex_lock(&handoff_lock);
+    listener->closeSocket();
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+// false if the socket can't be set up, the socket stays closed once it is handed off
+bool TCPServer::reopenListenerSocket(Listener *listener)
+{
+    pthread_mutex_lock(&handoff_lock);
+    bool reopened = !handing_off && listener->setupSocket();
+    bool failed = !handing_off && !reopened;
+    pthread_mutex_unlock(&handoff_lock);
+
+    if (failed)
+    {
+        fprintf(stderr, "can't setup the listening socket\n");
+        running = false;
+        return false;
+    }
+
+    if (reopened)
+        listener_reopens.Add();
+    return true;
+}
+
+// server main thread, runs the accept loop of the first listener
+void *TCPServer::serverLoop(void *param)
+{
+    auto server = (TCPServer *)param;
+
+    for (int i = 1; i < server->listener_count; i++)
+        if (pthread_create(&server->listeners[i].listener_thread, NULL, Listener::listenerLoop, &server->listeners[i]))
+        {
+            perror("can't run listener thread");
+            server->listeners[i].closeSocket();
+            server->listeners[i].listener_thread = 0;
+        }
+
+    Listener::listenerLoop(&server->listeners[0]);
+
+    for (int i = 1; i < server->listener_count; i++)
+        if (server->listeners[i].listener_thread)
+        {
+            void *retVal;
+            pthread_join(server->listeners[i].listener_thread, &retVal);
+            server->listeners[i].listener_thread = 0;
+        }
+
+    // the next process accepts now, the connections are passed to it or served until they finish
+    if (server->handing_off)
+    {
+        server->handOffConnections();
+
+        uint64_t deadline = monotonicNs() + server->drain_timeout_ms * 1'000'000ULL;
+        while (!server->drainExpired(deadline))
+            usleep(10'000);
+        server->running = false;
+    }
 
     // close all connections and wait their threads
     int pos = server->connections_list.Head();
     while (pos != -1)
     {
-        Connection *conn = &server->connections[pos];
+        Connection *conn = server->connections.At(pos);
         conn->closeAndWaitConnection();
         pos = server->connections_list.Head();
     }
 
+    if (server->io_mode == IO_EPOLL)
+        server->stopReactors();
+    if (server->io_mode == IO_POOL)
+        server->stopPool();
+
     return NULL;
 }
 
 void TCPServer::connectionComplete(Connection *conn)
 {
+    // the output and message buffers are not kept for the idle slot
+    conn->releaseOutput();
+    conn->releaseMessage();
+
     connections_list.RemoveAt(conn->pos);
     conn->pos = -1;
+
+    // the listeners waiting at the connection limit reopen at once - with the whole table full,
+    // all the endpoints wait for any slot
+    __atomic_sub_fetch(&conn->listener->active, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&table_active, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < listener_count; i++)
+        if (__atomic_load_n(&listeners[i].waiting, __ATOMIC_SEQ_CST))
+            listeners[i].wakeup();
 }
 
-void TCPServer::acceptClient()
+// drain the backlog on each readiness event, up to the free slots of the listener
+void Listener::acceptClients()
 {
-    sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    // the reactors need non-blocking sockets, the other engines block in their own threads
+    int flags = SOCK_CLOEXEC | (server->io_mode == IO_EPOLL ? SOCK_NONBLOCK : 0);
 
-    int client_socket = accept(server_sock, (sockaddr *)&client_addr, &client_len);
-    if (client_socket < 0)
+    while (server->running && !atCapacity())
     {
-        perror("can't accept client");
+        sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
 
-        usleep(100'000);
-        return;
+        int client_socket = accept4(sock, (sockaddr *)&client_addr, &client_len, flags);
+        if (client_socket < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            perror("can't accept client");
+
+            // the pending connection stays in the backlog, so it is retried after a descriptor is freed
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                waitForClose(ACCEPT_BACKOFF_MS, active);
+            return;
+        }
+
+        server->setupClient(this, client_socket, (sockaddr *)&client_addr);
+    }
+}
+
+// the steering program picks the listener by its position in the reuseport group, which a closed
+// and reopened shard would move (the last socket takes the vacated place), so these are never closed
+bool Listener::steered()
+{
+    return server->cpu_steering == STEER_BPF && shards > 1;
+}
+
+// a steered listener at the limit accepts and closes the waiting clients
+void Listener::rejectClients()
+{
+    while (server->running && atCapacity())
+    {
+        int client_socket = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (client_socket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("can't accept client");
+            return;
+        }
+
+        server->rejected_clients.Add();
+        close(client_socket);
     }
+}
+
+// the slots of this listener or the whole table are taken
+bool Listener::atCapacity()
+{
+    return __atomic_load_n(&active, __ATOMIC_SEQ_CST) >= capacity ||
+           __atomic_load_n(&server->table_active, __ATOMIC_SEQ_CST) >= server->admitted_max;
+}
+
+// wait at the connection limit until a slot is freed, the check after the waiting flag is set
+// can't miss the wakeup of a connection completing meanwhile
+void Listener::waitForSlot(int timeout_ms)
+{
+    __atomic_store_n(&waiting, true, __ATOMIC_SEQ_CST);
+
+    if (atCapacity() && TCPServer::pollForRead(wakeup_fd, timeout_ms))
+    {
+        uint64_t value;
+        if (read(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            perror("can't read listener wakeup");
+    }
+
+    __atomic_store_n(&waiting, false, __ATOMIC_SEQ_CST);
+}
+
+// wait until a connection of this listener completes, only this thread adds connections,
+// so the count lower than the seen one means a connection has completed meanwhile
+void Listener::waitForClose(int timeout_ms, int seen_active)
+{
+    __atomic_store_n(&waiting, true, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&active, __ATOMIC_SEQ_CST) >= seen_active && TCPServer::pollForRead(wakeup_fd, timeout_ms))
+    {
+        uint64_t value;
+        if (read(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            perror("can't read listener wakeup");
+    }
+
+    __atomic_store_n(&waiting, false, __ATOMIC_SEQ_CST);
+}
 
+// false on the timeout or a wakeup, the handoff stops the accepting at once
+bool Listener::pollForClients(int timeout_ms)
+{
+    pollfd pfd[2];
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wakeup_fd;
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, timeout_ms) <= 0)
+        return false;
+
+    if (pfd[1].revents & POLLIN)
+    {
+        uint64_t value;
+        if (read(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            perror("can't read listener wakeup");
+    }
+
+    return (pfd[0].revents & POLLIN) != 0;
+}
+
+void Listener::wakeup()
+{
+    uint64_t value = 1;
+    if (write(wakeup_fd, &value, sizeof(value)) < 0)
+        perror("can't wake up listener");
+}
+
+// register an accepted socket in the connections list and start serving it,
+// a connection passed by the previous process continues its partial message
+bool TCPServer::setupClient(Listener *listener, int client_socket, const sockaddr *client_addr, const HandoffState *state)
+{
     // initialize client object
     int pos = connections_list.AddPos();
-    Connection *conn = &connections[pos];
+    if (pos == -1)
+    {
+        close(client_socket);
+        return false;
+    }
+
+    Connection *conn = connections.Get(pos);
+    if (!conn)
+    {
+        close(client_socket);
+        connections_list.RemoveAt(pos);
+        return false;
+    }
+
+    // counted with the slot taken, before the connection is served
+    if (state)
+        handoffs_in.Add();
+    else
+        accepts.Add();
+
     conn->pos = pos;
     conn->socket = client_socket;
     conn->server = this;
+    conn->listener = listener;
+    __atomic_add_fetch(&listener->active, 1, __ATOMIC_RELAXED);
+
+    // the last free slot is taken - the other listeners close their sockets now instead of after their poll
+    if (__atomic_add_fetch(&table_active, 1, __ATOMIC_SEQ_CST) >= admitted_max && io_mode != IO_URING)
+        for (int i = 0; i < listener_count; i++)
+            if (&listeners[i] != listener)
+                listeners[i].wakeup();
     conn->message_count = 0;
+    conn->message_len = 0;
+    conn->last_term = '\0';
+    conn->message_truncated = false;
+    conn->input_closed = false;
+    conn->framing = listener->framing;
+    conn->frame_header_len = 0;
+    conn->frame_left = 0;
+    conn->read_paused = false;
+    conn->disconnect_pending = false;
 
     // get remote address and port
-    inet_ntop(AF_INET, &client_addr.sin_addr, conn->remote_addr, MAX_LENGTH_REMOTE_IP);
-    conn->remote_port = client_addr.sin_port;
+    conn->setRemote(client_addr);
+
+    // the timer is armed first, the connection may be closed before start returns
+    armTimeouts(conn);
+
+    if (state)
+    {
+        conn->message_count = state->message_count;
+        conn->last_term = state->last_term;
+        conn->message_truncated = state->message_truncated;
+        conn->framing = state->framing;
+        conn->frame_header_len = state->frame_header_len;
+        conn->frame_left = state->frame_left;
+        if (state->zerocopy_seq)
+            conn->startZerocopy(state->zerocopy_seq);
+        if (state->message_len > 0 && conn->reserveMessage(state->message_len))
+        {
+            memcpy(conn->message, state->message, state->message_len);
+            conn->message_len = state->message_len;
+            conn->line_tick = conn->read_tick;
+        }
+    }
 
     // start the client thread
     if (!conn->start())
     {
-        close(client_socket);
+        timeouts.Cancel(pos);
+        conn->releaseMessage();
+        if (conn->socket != -1)
+            close(conn->socket);
+        __atomic_sub_fetch(&listener->active, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&table_active, 1, __ATOMIC_RELAXED);
         connections_list.RemoveAt(pos);
-        usleep(100'000);
-        return;
+        return false;
     }
 
+    char addr[INET6_ADDRSTRLEN];
     if (debug_printing)
-        printf("%d] client accepted %s:%d\n", pos, conn->remote_addr, conn->remote_port);
+        printf("%d] client accepted %s:%d\n", pos, conn->remoteAddress(addr), conn->remote_port);
+
+    return true;
 }
 
 bool TCPServer::Start()
@@ -234,15 +793,138 @@ bool TCPServer::Start()
         return true;
 
     running = true;
-    message_count = 0;
+    message_count.Reset();
+    response_latency.Reset();
+    handler_latency.Reset();
+    accepts.Reset();
+    bytes_in.Reset();
+    bytes_out.Reset();
+    truncated_messages.Reset();
+    listener_closes.Reset();
+    rejected_clients.Reset();
+    listener_reopens.Reset();
+    read_pauses.Reset();
+    idle_timeouts.Reset();
+    read_timeouts.Reset();
+    write_timeouts.Reset();
+    handoffs_in.Reset();
+    handoffs_out.Reset();
+    datagrams_in.Reset();
+    datagrams_out.Reset();
+    zerocopy_sends.Reset();
+    zerocopy_done.Reset();
+    zerocopy_copied.Reset();
+    zerocopy_leaked.Reset();
+    handing_off = false;
+    accept_rate = 0;
+    table_active = 0;
+    datagram_rate = 0;
+
+    if (!listeners)
+    {
+        fprintf(stderr, "the listening is not set up\n");
+        running = false;
+        return false;
+    }
 
-    if (pthread_create(&server_thread, NULL, serverLoop, this))
+    if (max_message_size < 2 || max_message_size > POOL_MAX_SIZE)
+    {
+        fprintf(stderr, "invalid message size limit\n");
+        running = false;
+        return false;
+    }
+
+    // the handlers are resumed by the reactor timers and events
+    if (ProcessMessageAsyncPtr && io_mode != IO_EPOLL)
+    {
+        fprintf(stderr, "asynchronous handlers need the epoll engine\n");
+        running = false;
+        return false;
+    }
+
+    // the connection table grows in chunks up to the configured capacity
+    if (connections_list.Capacity() != max_connections)
+    {
+        connections_list.Reset(max_connections);
+        connections.Reset(max_connections);
+    }
+
+    // the timeouts of all connections share one wheel, advanced by the timeout thread
+    timer_base = monotonicNs();
+    timer_now = 1;
+    if (!timeouts.Reset(timeoutsEnabled() ? max_connections : 0, timer_now))
+    {
+        running = false;
+        return false;
+    }
+
+    // io_uring serves all clients from one thread, so one listener per endpoint is enough
+    if (io_mode == IO_URING)
+    {
+        int kept = 0;
+        for (int i = 0; i < listener_count; i++)
+        {
+            if (listeners[i].shard > 0)
+            {
+                listeners[i].closeSocket();
+                close(listeners[i].wakeup_fd);
+                continue;
+            }
+
+            listeners[kept] = listeners[i];
+            listeners[kept].index = kept;
+            listeners[kept].shards = 1;
+            kept++;
+        }
+        listener_count = kept;
+    }
+    splitCapacity();
+
+    // the existing thread per connection path serves on the kernels without io_uring
+    if (io_mode == IO_URING && !startUring())
+    {
+        fprintf(stderr, "io_uring is not available, falling back to the threaded engine\n");
+        io_mode = IO_THREADED;
+    }
+
+    if (io_mode == IO_EPOLL && !startReactors())
+    {
+        running = false;
+        return false;
+    }
+
+    if (io_mode == IO_POOL && !startPool())
+    {
+        running = false;
+        return false;
+    }
+
+    if (pthread_create(&server_thread, NULL, io_mode == IO_URING ? uringLoop : serverLoop, this))
     {
         perror("can't run a thread");
         running = false;
+        if (io_mode == IO_EPOLL)
+            stopReactors();
+        if (io_mode == IO_URING)
+            releaseUring();
+        if (io_mode == IO_POOL)
+            stopPool();
+        return false;
+    }
+
+    // the server thread stops the engines when it sees the running flag cleared
+    if ((admin_port > 0 && !startAdmin()) || (udp_port > 0 && !startUdp()) || (timeoutsEnabled() && !startTimeouts()) ||
+        (handoff_path && !startHandoff()))
+    {
+        running = false;
+        WaitServer();
         return false;
     }
 
+    // the connections of the previous process join the ones already accepted
+    if (handoff_peer != -1)
+        receiveConnections();
+
     return true;
 }
 
@@ -259,12 +941,42 @@ void TCPServer::WaitServer()
 {
     void *retVal;
     pthread_join(server_thread, &retVal);
+
+    if (admin_thread)
+    {
+        pthread_join(admin_thread, &retVal);
+        admin_thread = 0;
+    }
+
+    if (udp_workers)
+        stopUdp();
+
+    if (timeout_thread)
+    {
+        pthread_join(timeout_thread, &retVal);
+        timeout_thread = 0;
+    }
+
+    if (handoff_thread)
+    {
+        pthread_join(handoff_thread, &retVal);
+        handoff_thread = 0;
+    }
+
+    reapDeferredZerocopy(true);
+}
+
+// percentiles of all the recorded latencies in nanoseconds
+LatencyPercentiles TCPServer::getResponseLatency()
+{
+    LatencyHistogram merged;
+    response_latency.Merge(merged);
+    return merged.Percentiles();
 }
 
-void TCPServer::incMessageCount()
+LatencyPercentiles TCPServer::getHandlerLatency()
 {
-    // needs to handle concurrent access for incrementing the counter
-    pthread_mutex_lock(&message_count_lock);
-    message_count++;
-    pthread_mutex_unlock(&message_count_lock);
+    LatencyHistogram merged;
+    handler_latency.Merge(merged);
+    return merged.Percentiles();
 }
@@ -1,84 +1,631 @@
 #pragma once
 
 #include "llist_safe.h"
+#include "slab_table.h"
+#include "sharded_counter.h"
+#include "latency_histogram.h"
+#include "buffer_pool.h"
+#include "timer_wheel.h"
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <atomic>
 
 #define MAX_ACTIVE_CONNECTIONS 200
-#define MAX_LENGTH_REMOTE_IP 200
 #define RECV_BUF_SIZE 1024
-#define RECV_MESSAGE_SIZE 4096
+#define RECV_MESSAGE_SIZE 4096      //default message size limit, including the null terminator
 #define POLL_TIMEOUT_MS 500
+#define ACCEPT_BACKOFF_MS 100       //wait after running out of descriptors, cut short by a closed connection
+#define REACTOR_MAX_EVENTS 64
+#define URING_ENTRIES 256
+#define URING_RECV_BUFFERS 256
+#define POOL_THREADS_PER_CPU 2      //default IO_POOL workers, they block in recv between the messages
+#define OUTPUT_FLUSH_THRESHOLD (64 * 1024)
+#define OUTPUT_HIGH_WATERMARK (1024 * 1024)
+#define OUTPUT_LOW_WATERMARK (256 * 1024)
+#define OUT_IOV_MAX 64
+#define OUT_BORROW_MIN 256
+#define SPLICE_PIPE_SIZE (256 * 1024)   //pipe of a thread serving the raw echo, the default one if not allowed
+#define ZEROCOPY_MIN_SIZE (16 * 1024)   //default zero-copy threshold, the smaller output is cheaper to copy
+#define ZEROCOPY_MAX_INFLIGHT 64        //zero-copy send calls of a connection waiting for their completion, up to 64
+#define ZEROCOPY_MAX_BUFFERS 8          //output buffers of a connection held for the zero-copy sends
+#define ZEROCOPY_DEFER_MAX_MS 30000     //a closed socket's held buffers wait for their completions, then they are leaked
+#define ZEROCOPY_HELD_MAX (64 * 1024 * 1024)    //default limit of the deferred and leaked buffer bytes, above it the sends are copied
+#define MESSAGE_TOO_LONG_REPLY "ERROR: message too long\n"
+#define FRAME_DIRECT_MIN RECV_BUF_SIZE  //the rest of a longer frame is received straight into its message buffer
+#define FRAME_PAYLOAD 0xFF          //frame_header_len of a connection after the length prefix
+#define VARINT_MAX_BYTES 5          //32-bit frame length
+#define ASYNC_MAX_INFLIGHT 64
+#define ASYNC_OFFLOAD_THREADS 4
+#define TIMER_TICK_MS 100           //resolution of the connection timeouts
+#define HANDOFF_TIMEOUT_MS 5000     //wait for the other process during a hot upgrade
+#define DRAIN_TIMEOUT_MS 30000
+#define UDP_BATCH 64                //datagrams per recvmmsg and sendmmsg
+#define UDP_BATCH_BYTES (1024 * 1024)   //receive buffers of a UDP thread, fewer datagrams per batch when they are larger
+#define UDP_MAX_DATAGRAM 65536      //receive buffer of a datagram with GRO, or of the longest one
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_SEGMENT 1400    //larger replies are sent one by one, a segment must fit the path MTU
+#define UDP_GSO_MAX_BYTES 65000     //all segments of one send, below the IP packet limit
 
 class TCPServer;
+struct Listener;
+struct AsyncRequest;
+struct AsyncTask;
+struct OffloadPool;
+struct UdpWorker;
 
-//connection holder struct
+//connection I/O engines
+enum IOMode
+{
+    IO_THREADED,    //one thread per connection with blocking recv
+    IO_EPOLL,       //edge-triggered epoll reactor threads, each owning a subset of the connections
+    IO_URING,       //single io_uring thread for accept, recv and send, falls back to IO_THREADED
+    IO_POOL,        //pre-started worker threads taking the accepted connections from a queue, blocking recv
+};
+
+//connection steering between the sharded listeners
+enum CPUSteering
+{
+    STEER_NONE,             //the kernel hashes the connections between the listeners
+    STEER_INCOMING_CPU,     //SO_INCOMING_CPU - prefer the listener bound to the receiving CPU
+    STEER_BPF,              //reuseport BPF program selecting the listener by the receiving CPU
+};
+
+//message framing of an endpoint
+enum Framing
+{
+    FRAMING_LINES,          //<CR>, <LF> or <CR><LF> terminated lines
+    FRAMING_LENGTH32,       //4-byte big-endian payload length before each frame
+    FRAMING_VARINT,         //LEB128 varint payload length before each frame
+    FRAMING_RAW_ECHO,       //no messages - the bytes are echoed back as they come, without the handler
+};
+
+//handling of the messages longer than the message size limit
+enum OverflowPolicy
+{
+    OVERFLOW_TRUNCATE,      //the bytes over the limit are skipped and the rest is processed
+    OVERFLOW_REJECT,        //the message is not processed, the client gets an error reply
+    OVERFLOW_DISCONNECT,    //the client gets an error reply and the connection is closed
+};
+
+//growable byte buffer for the queued output, taken from the server pool
+struct OutBuffer
+{
+    char* data = NULL;
+    int len = 0;
+    int cap = 0;
+
+    bool append(BufferPool& pool, const char* buf, int size);
+    void release(BufferPool& pool);
+};
+
+//zero-copy sends of a connection waiting for their notifications from the socket error queue -
+//the kernel numbers the send calls from 0, an output buffer is held until its last call is completed
+struct ZerocopyState
+{
+    uint32_t next_seq;          //of the next zero-copy send call
+    uint32_t done_seq;          //the calls before it are completed
+    uint64_t done_bits;         //completed calls from done_seq on, the notifications may come out of order
+    bool copied;                //the kernel copied the data anyway - the copy path is used
+    bool unsupported;           //the socket can't send without a copy and has no error queue (a Unix socket peer)
+    int buffer_head;
+    int buffer_count;
+    struct
+    {
+        char* data;
+        int cap;
+        uint32_t end_seq;       //after its last send call
+    } buffers[ZEROCOPY_MAX_BUFFERS];
+
+    //set when the connection is closed with buffers still held
+    int socket;                 //a duplicate kept for the error queue
+    uint64_t deadline;
+    ZerocopyState* next;
+};
+
+//connection holder struct, kept compact for many idle clients -
+//the message, output and latency buffers are taken from the server pool only while data is in flight
 struct Connection
 {
-    char remote_addr[MAX_LENGTH_REMOTE_IP];
-    int remote_port;
+    TCPServer* server;
+    Listener* listener;
+    pthread_t client_thread = 0;
+    int reactor = -1;
 
     int pos;
     int socket;
-    int message_count;
-    bool running;
+    in6_addr remote_ip;         //IPv4 clients as mapped addresses, unspecified for a Unix socket peer
+    uint16_t remote_port;       //host byte order
+    std::atomic<bool> running = false;  //cleared by the serving thread when the connection is closed
+    Framing framing = FRAMING_LINES;    //of the listener
 
-    TCPServer* server;
-    pthread_t client_thread = 0;
+    //touched only by the thread serving the connection, kept on its own cache line
+    alignas(CACHE_LINE_SIZE) uint64_t message_count;
+
+    //framing state, kept between the receive calls,
+    //the message buffer is grown up to the limit and returned when no partial message is left
+    unsigned char* message = NULL;
+    int message_cap = 0;
+    int message_len = 0;
+    char last_term = '\0';
+    bool message_truncated = false;
+    bool input_closed = false;      //disconnected by the overflow policy, the rest is not processed
+    uint8_t frame_header_len = 0;   //length prefix bytes read, FRAME_PAYLOAD after the whole prefix
+    uint32_t frame_left = 0;        //payload bytes of the frame still to come, the prefix value while it is read
+
+    //output collected during the receive batch and sent with one call,
+    //the small pieces are copied, the large views into the receive data are referenced
+    OutBuffer out_pending;
+    iovec* out_iov = NULL;          //pieces in order, the copied ones have NULL base
+    int out_iov_count = 0;
+    int out_iov_cap = 0;
+    int out_bytes = 0;
+    const unsigned char* batch_data = NULL;
+    int batch_size = 0;
+
+    //detection times of the messages with replies not sent yet, for the latency histogram
+    uint64_t* reply_times = NULL;
+    int reply_count = 0;
+    int reply_cap = 0;
+    int reply_sending = 0;          //io_uring - the replies of the send in flight
+    unsigned send_calls = 0;
+
+    //output waiting for the socket - the send in flight in io_uring mode, the unsent output in epoll mode,
+    //the reading is paused above the high watermark and resumed below the low one
+    OutBuffer out_sending;
+    int out_sent = 0;
+    bool read_paused = false;
+    bool disconnect_pending = false;
+
+    //io_uring state
+    int uring_ops = 0;
+    bool closing = false;
+    bool send_queued = false;
+
+    bool datagram = false;          //the connection of a UDP thread, the replies are collected until its batch is sent
+
+    //asynchronous handlers in flight, in the order of the requests,
+    //a closing connection keeps its socket until the offloaded work returns
+    AsyncRequest* async_head = NULL;
+    AsyncRequest* async_tail = NULL;
+    int async_count = 0;
+    bool async_closing = false;
+
+    //timeout state in wheel ticks, set by the serving thread and checked by the timeout thread,
+    //0 - the partial line or the unsent output is not there
+    uint32_t read_tick = 0;         //last receive
+    uint32_t line_tick = 0;         //first bytes of the partial line
+    uint32_t write_tick = 0;        //output waiting since, or its last progress
+
+    ZerocopyState* zerocopy = NULL; //taken with the first large output when TCPServer::zerocopy_min_size is set
 
     static void* clientLoop(void*);
+    void processData(const unsigned char* data, int size);
+    void processAsync(const unsigned char* data, int size);
+    //framing loop, defined in tcp_server_framing.h
+    template <class Handler> void processMessages(const unsigned char* data, int size);
+    template <class Handler> void processLines(const unsigned char* data, int size);
+    template <class Handler> void processFrames(const unsigned char* data, int size);
+    template <class Handler> void completeMessage(char* msg, int msg_len, uint64_t found_at);
+    template <class Handler> void deliverMessage(const char* msg, int msg_len, uint64_t found_at);
+    inline uint64_t foundTime();
+    bool reserveMessage(int size);
+    char* terminateMessage();
+    unsigned char* frameTarget(int& size);
+    void echoRaw(const unsigned char* data, int size);
+    int spliceEcho();
+    bool queueSpliced(int size);
+    void rejectMessage();
+    void releaseMessage();
     bool sendMessage(const char* format, ...);
+    bool sendBytes(const void* data, int size);
+    bool sendLine(const char* data, int size);
+    bool sendFrame(const char* data, int size);    //the message in the framing of the connection
+    bool sendVector(iovec* iov, int count);
+    bool flush();
+    bool queueOutput(const char* data, int size);
+    bool collectOutput(const char* data, int size);
+    bool writeOutput(iovec* iov, int count, bool zerocopy_send = false);
+    bool writeQueued(iovec* iov, int count, bool zerocopy_send = false);
+    bool drainOutput();
+    inline int queuedOutput() { return out_pending.len + out_sending.len - out_sent; }
+    void flushUring();
+    void releaseOutput();
+    void releaseIdle();
+    bool startZerocopy(uint32_t seq);
+    bool zerocopyReady();
+    bool zerocopyRoom();
+    void holdZerocopy(uint32_t first_seq);
+    void reapZerocopy();
+    void finishZerocopy(bool passed = false);
+    void addReplyTime(uint64_t time);
+    void completeReplies(int count);
+    void disconnect();
     void closeAndWaitConnection();
     bool start();
+    bool startUring();
+    void startRequest(const char* msg, int msg_len);
+    void completeRequests();
+    void cancelRequests();
+    bool asyncFull();
+
+    void setRemote(const sockaddr* addr);
+    const char* remoteAddress(char* buf);      //buf of INET6_ADDRSTRLEN
+};
+
+//framing state of a connection passed from the previous process by a hot upgrade
+struct HandoffState
+{
+    uint64_t message_count;
+    const unsigned char* message;   //partial message bytes
+    int message_len;
+    char last_term;
+    bool message_truncated;
+    Framing framing;
+    uint8_t frame_header_len;
+    uint32_t frame_left;
+    uint32_t zerocopy_seq;          //the next zero-copy send call number of the socket
+};
+
+//epoll reactor thread, used in IO_EPOLL mode
+struct Reactor
+{
+    int index;
+    int epoll_fd = -1;
+    int wakeup_fd = -1;
+    bool running = false;
+
+    TCPServer* server;
+    pthread_t reactor_thread = 0;
+    unsigned char recv_buf[RECV_BUF_SIZE];
+
+    //asynchronous handlers - the sleeping ones in a heap by deadline, the ones resumed
+    //by the offload threads in the ready queue, the finished ones kept for reuse
+    AsyncRequest** timers = NULL;
+    int timer_count = 0;
+    int timer_cap = 0;
+    AsyncRequest* ready_head = NULL;
+    AsyncRequest* ready_tail = NULL;
+    pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+    AsyncRequest* free_requests = NULL;
+    AsyncRequest* retired_requests = NULL;  //not reused until the current events are handled
+
+    static void* reactorLoop(void*);
+    void readConnection(Connection* conn, unsigned char* recv_buf);
+    void closeConnection(Connection* conn);
+    bool addConnection(Connection* conn);
+    bool start();
+    void stopAndWait();
+
+    AsyncRequest* allocRequest();
+    void releaseRequest(AsyncRequest* req);
+    void releaseRequests();
+    bool addTimer(AsyncRequest* req);
+    void removeTimer(AsyncRequest* req);
+    void moveTimer(int index);
+    int timerTimeout();
+    void runTimers();
+    bool pushReady(AsyncRequest* req);
+    void runReady();
+    void completePoll(AsyncRequest* req, uint32_t events);
+    void resumeRequest(AsyncRequest* req);
 };
 
+//pre-started worker threads, used in IO_POOL mode
+struct WorkerPool
+{
+    pthread_t* threads = NULL;
+    int thread_count = 0;
+    bool running;
+
+    //accepted connections waiting for a free worker
+    Connection** queue = NULL;
+    int queue_cap = 0;
+    int queue_head = 0;
+    int queue_len = 0;
+    pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+    TCPServer* server;
+
+    static void* workerLoop(void*);
+    bool push(Connection* conn);
+    Connection* pop();
+    bool start(int threads, int queue_size);
+    void stopAndWait();
+};
+
+//listening socket with its own accept loop and slice of the connection table
+struct Listener
+{
+    int index;          //-1 for the admin listener
+    int port;           //0 for a Unix socket
+    int sock = -1;
+    int cpu;
+
+    //endpoint - IPv4, IPv6 (dual-stack unless v6only) or a Unix socket path
+    int family = AF_INET;
+    sockaddr_storage addr;
+    socklen_t addr_len = 0;
+    bool v6only = false;
+    Framing framing = FRAMING_LINES;
+    int shard = 0;      //position in the SO_REUSEPORT group of the endpoint
+    int shards = 1;
+    int capacity;       //max active connections accepted by this listener
+    int active = 0;     //currently active connections accepted by this listener
+
+    //woken by connectionComplete while the listener waits for a free slot, and by the handoff
+    int wakeup_fd = -1;
+    bool waiting = false;
+
+    //io_uring multishot accept
+    bool accepting = false;
+    int accept_gen = 0;
+
+    TCPServer* server;
+    pthread_t listener_thread = 0;
+
+    //low-level methods
+    bool setEndpoint(const sockaddr* endpoint, socklen_t len);
+    bool makeSocket();
+    bool setReuseAddr();
+    bool setReusePort();
+    bool setV6Only();
+    bool setDeferAccept();
+    bool attachSteeringProgram();
+    bool bindToEndPoint();
+    bool listenOnSocket();
+    void acceptClients();
+    void rejectClients();
+    bool steered();
+    bool atCapacity();
+    void waitForSlot(int timeout_ms);
+    void waitForClose(int timeout_ms, int seen_active);
+    bool pollForClients(int timeout_ms);
+    void wakeup();
+    inline bool isSocketClosed() { return sock == -1; }
+
+    //high-level methods
+    bool setupSocket();
+    void closeSocket();
+
+    static void* listenerLoop(void*);
+};
+
+//reply datagram of a UDP batch, the consecutive equal replies to one peer are sent as one GSO send
+struct UdpReply
+{
+    int peer;           //received datagram with the peer address
+    int offset;         //in the output of the worker connection
+    int len;
+    int segment;        //GSO segment size, the last segment may be shorter
+};
+
+//datagram thread with its own SO_REUSEPORT socket, used with TCPServer::udp_port
+struct UdpWorker
+{
+    int index;
+    int sock = -1;
+    bool offload = false;       //UDP_GRO and UDP_SEGMENT are available
+
+    TCPServer* server;
+    pthread_t worker_thread = 0;
+
+    //the handlers reply through the connection of the worker, all replies of a batch are collected in its output
+    Connection conn;
+
+    //receive batch, the datagrams are read into buffers of one size
+    int batch = 0;
+    int buf_size = 0;
+    unsigned char* recv_buf = NULL;
+    mmsghdr* recv_msgs = NULL;
+    iovec* recv_iov = NULL;
+    sockaddr_storage* peers = NULL;
+    char* recv_control = NULL;
+
+    UdpReply replies[UDP_BATCH];
+    int reply_count = 0;
+
+    static void* workerLoop(void*);
+    void receiveBatch();
+    void processDatagram(int peer, const unsigned char* data, int size, bool truncated);
+    void addReply(int peer, int offset, int len);
+    void sendReplies();
+    bool start(const sockaddr* endpoint, socklen_t len, bool v6only);
+    void stopAndWait();
+};
+
+struct UringEngine;
+
 //server holder class
 class TCPServer
 {
     private:
 
-        Connection connections[MAX_ACTIVE_CONNECTIONS];
-        LList<MAX_ACTIVE_CONNECTIONS> connections_list;
-        int server_sock = -1;
+        SlabTable<Connection> connections;
+        LList connections_list;
+        Listener* listeners = NULL;     //the endpoints one after another, each with its shards
+        int listener_count = 0;
+        int table_active = 0;           //connections of all the endpoints, which share the table
+        int admitted_max = 0;           //connections served at once - max_connections, or the workers of IO_POOL
         pthread_t server_thread = 0;
-        int tcp_port;
-        int bindAddr;
+
+        Reactor* reactors = NULL;
+        int reactor_count = 0;
+        int next_reactor = 0;
+
+        UringEngine* uring = NULL;
+
+        WorkerPool* pool = NULL;
+
+        OffloadPool* offload = NULL;
+
+        UdpWorker* udp_workers = NULL;
+        int udp_worker_count = 0;
 
         //low-level methods
-        bool makeSocket();
-        bool setReuseAddr();
-        bool bindToEndPoint();
-        bool listenOnSocket();
-        void acceptClient();
-        inline bool isSocketClosed() { return server_sock == -1; }
+        bool setupClient(Listener* listener, int client_socket, const sockaddr* client_addr, const HandoffState* state = NULL);
         static bool setNonBlockingMode(int& socket);
+        bool createThread(pthread_t* thread, void* (*proc)(void*), void* param);
 
         //high-level methods
-        bool setupSocket();
-        void closeSocket();
+        Listener* addListeners(int count, const sockaddr* endpoint, socklen_t len);
+        bool openListeners(Listener* added, int count);
+        void splitCapacity();
+        int shardCount();
+        void closeListeners(int first = 0);
+        void closeListenerSocket(Listener* listener);
+        bool reopenListenerSocket(Listener* listener);
+
+        //reactor threads
+        bool startReactors();
+        void stopReactors();
+
+        //worker pool threads
+        int poolThreads();
+        bool startPool();
+        void stopPool();
+
+        //UDP threads
+        bool startUdp();
+        void stopUdp();
+
+        //offload threads of the asynchronous handlers
+        bool startOffload();
+        void stopOffload();
+
+        //io_uring thread
+        bool startUring();
+        void releaseUring();
+        static void* uringLoop(void*);
 
         //server thread
         static void* serverLoop(void*);
 
-        pthread_mutex_t message_count_lock = PTHREAD_MUTEX_INITIALIZER;
-        int message_count = 0;
+        ShardedCounter message_count;
+        ShardedHistogram response_latency;  //terminator detection to send completion
+        ShardedHistogram handler_latency;   //time in the message processing function
+
+        //metrics, summed only by the readers
+        ShardedCounter accepts;
+        ShardedCounter bytes_in;
+        ShardedCounter bytes_out;
+        ShardedCounter truncated_messages;
+        ShardedCounter listener_closes;     //closed at the connection limit
+        ShardedCounter listener_reopens;
+        ShardedCounter rejected_clients;    //closed at once by a steered listener kept open at the limit
+        ShardedCounter read_pauses;         //output queue above the high watermark
+        ShardedCounter datagrams_in;
+        ShardedCounter datagrams_out;
+        uint64_t datagram_rate = 0;         //received datagrams in the last second
+        int worker_queue_depth = 0;         //published by the engines, the admin thread never reads an engine being stopped
+        int uring_send_queue_depth = 0;
+        ShardedCounter zerocopy_sends;      //send calls with MSG_ZEROCOPY
+        ShardedCounter zerocopy_done;       //of them completed without a copy
+        ShardedCounter zerocopy_copied;     //completed with the data copied by the kernel
+        ShardedCounter zerocopy_leaked;     //held buffers never completed, kept out of the pool for good
+
+        //closed sockets with zero-copy sends in flight, their buffers return to the pool with the completions
+        pthread_mutex_t zerocopy_lock = PTHREAD_MUTEX_INITIALIZER;
+        ZerocopyState* zerocopy_deferred = NULL;
+        int zerocopy_deferred_buffers = 0;
+        long zerocopy_held_bytes = 0;       //of the deferred and leaked buffers, kept across restarts as the leaked ones stay out of the pool
+        void reapZerocopy(ZerocopyState* state, int socket);
+        bool deferZerocopy(ZerocopyState* state, int socket);
+        void reapDeferredZerocopy(bool final);
+
+        BufferPool buffer_pool;             //message, output and latency buffers of the connections
+
+        //connection timeouts, one timer per connection slot in a shared wheel
+        TimerWheel timeouts;
+        pthread_t timeout_thread = 0;
+        uint64_t timer_base = 0;
+        uint32_t timer_now = 1;             //current tick, read by the serving threads
+        ShardedCounter idle_timeouts;
+        ShardedCounter read_timeouts;
+        ShardedCounter write_timeouts;
+        inline bool timeoutsEnabled() { return idle_timeout_ms > 0 || read_timeout_ms > 0 || write_timeout_ms > 0; }
+        inline uint32_t timerNow() { return __atomic_load_n(&timer_now, __ATOMIC_RELAXED); }
+        uint32_t currentTick();
+        uint32_t shortestTimeout();
+        bool startTimeouts();
+        static void* timeoutLoop(void*);
+        void armTimeouts(Connection* conn);
+        uint32_t checkTimeouts(int pos, uint32_t now);
+        void closeClientSocket(Connection* conn);
+
+        //hot upgrade - the listening sockets and the live connections passed to the next process
+        int handoff_sock = -1;      //Unix socket waiting for the next process
+        int handoff_peer = -1;      //the other process during the handoff
+        pthread_t handoff_thread = 0;
+        bool handing_off = false;   //the listeners are passed on, this process drains
+        pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;  //listening sockets being passed or reopened
+        ShardedCounter handoffs_in;
+        ShardedCounter handoffs_out;
+        bool startHandoff();
+        static void* handoffLoop(void*);
+        bool sendListeners(int peer);
+        bool takeListeners(int* fds, uint8_t* framings, int fd_count, int admin_index);
+        void handOffConnections();
+        bool handOffConnection(Connection* conn, uint64_t deadline);
+        void receiveConnections();
+        bool drainExpired(uint64_t deadline);
+
+        //admin port thread
+        Listener admin_listener;
+        pthread_t admin_thread = 0;
+        uint64_t accept_rate = 0;   //accepts in the last second
+        bool startAdmin();
+        static void* adminLoop(void*);
+        void serveAdminClient(int client_socket);
+        void writeMetrics(OutBuffer& out);
+        socklen_t ipEndpoint(int port, sockaddr_storage& endpoint, bool& v6only);
 
     private:
         //used from Connection struct
         friend struct Connection;
+        friend struct Reactor;
+        friend struct Listener;
+        friend struct UringEngine;
+        friend struct WorkerPool;
+        friend struct OffloadPool;
+        friend struct AsyncRequest;
+        friend struct UdpWorker;
         void connectionComplete(Connection* conn);
         static bool pollForRead(int socket, int timeout_ms);
+        static bool pollForWrite(int socket, int timeout_ms);
 
     public:
         //used from outside
         inline int getConnectionCount() { return connections_list.Count(); }
-        inline int getMessageCount() { return message_count; }
-        void incMessageCount();
+        inline int getListenerCount() { return listener_count; }
+        inline uint64_t getListenerCloseCount() { return listener_closes.Sum(); }
+        inline uint64_t getRejectedCount() { return rejected_clients.Sum(); }
+        inline uint64_t getMessageCount() { return message_count.Sum(); }
+        inline void incMessageCount() { message_count.Add(); }
+        inline long getBufferBytes() { return buffer_pool.InUse(); }
+        inline long getPooledFreeBytes() { return buffer_pool.Cached(); }
+        inline long getConnectionTableBytes() { return connections.MemoryBytes() + connections_list.MemoryBytes() + timeouts.MemoryBytes(); }
+        inline uint64_t getTimeoutCount() { return idle_timeouts.Sum() + read_timeouts.Sum() + write_timeouts.Sum(); }
+        inline uint64_t getHandoffCount() { return handoffs_in.Sum(); }
+        inline uint64_t getDatagramCount() { return datagrams_in.Sum(); }
+        inline uint64_t getDatagramRate() { return __atomic_load_n(&datagram_rate, __ATOMIC_RELAXED); }
+        inline uint64_t getZerocopySendCount() { return zerocopy_sends.Sum(); }
+        inline uint64_t getZerocopyDoneCount() { return zerocopy_done.Sum(); }
+        inline uint64_t getZerocopyCopiedCount() { return zerocopy_copied.Sum(); }
+        inline int getZerocopyDeferredCount() { return __atomic_load_n(&zerocopy_deferred_buffers, __ATOMIC_RELAXED); }
+        inline uint64_t getZerocopyLeakedCount() { return zerocopy_leaked.Sum(); }
+        inline long getZerocopyHeldBytes() { return __atomic_load_n(&zerocopy_held_bytes, __ATOMIC_RELAXED); }
+        inline bool isHandedOff() { return handing_off; }
+        LatencyPercentiles getResponseLatency();
+        LatencyPercentiles getHandlerLatency();
 
 
     public:
@@ -86,14 +633,54 @@ class TCPServer
         bool debug_printing = false;
 
         //config values
-        int backlog = 10;
+        int backlog = SOMAXCONN;    //capped by net.core.somaxconn
+        int defer_accept_sec = 0;   //TCP_DEFER_ACCEPT - the connection is accepted when its first data arrives, 0 - disabled
         bool reuse_address = true;
         bool closeOnMaxConnections = true;
+        int max_connections = MAX_ACTIVE_CONNECTIONS;
+        IOMode io_mode = IO_THREADED;
+        int reactor_threads = 0;    //0 - one reactor per CPU core
+        int listener_shards = 1;    //SO_REUSEPORT listeners with own accept loops, 0 - one per CPU core
+        CPUSteering cpu_steering = STEER_NONE;
+        int pool_threads = 0;       //IO_POOL workers, 0 - POOL_THREADS_PER_CPU per CPU core
+        size_t thread_stack_size = 0;   //stack of the connection and worker threads, 0 - the system default
+        int admin_port = 0;         //Prometheus metrics over HTTP, 0 - disabled
+        bool track_latency = false; //record the response and handler latency histograms
+        int output_flush_threshold = OUTPUT_FLUSH_THRESHOLD;   //collected output size sent before the batch end
+        int output_high_watermark = OUTPUT_HIGH_WATERMARK;     //queued output pausing the reading (epoll and io_uring)
+        int output_low_watermark = OUTPUT_LOW_WATERMARK;       //queued output resuming the reading
+        int max_message_size = RECV_MESSAGE_SIZE;   //longest message including the null terminator, up to POOL_MAX_SIZE
+        OverflowPolicy overflow_policy = OVERFLOW_TRUNCATE;
+        int idle_timeout_ms = 0;    //no input and no output waiting, 0 - disabled
+        int read_timeout_ms = 0;    //a line not completed since its first bytes, 0 - disabled
+        int write_timeout_ms = 0;   //queued output not progressing, 0 - disabled
         //message processing function
         void (*ProcessMessagePtr)(Connection* conn, char *, int) = NULL;
+        //zero-copy alternative - the message is a view into the receive buffer, not null-terminated
+        void (*ProcessMessageViewPtr)(Connection* conn, const char *, int) = NULL;
+        //framing loop with an inlined handler, set by TypedServer
+        void (*ProcessDataPtr)(Connection* conn, const unsigned char *, int) = NULL;
+        //coroutine handler, see tcp_server_async.h, IO_EPOLL only
+        AsyncTask (*ProcessMessageAsyncPtr)(AsyncRequest& req) = NULL;
+        int async_max_inflight = ASYNC_MAX_INFLIGHT;   //handlers in flight per connection pausing the reading
+        int offload_threads = ASYNC_OFFLOAD_THREADS;
+        const char* handoff_path = NULL;    //Unix socket of the hot upgrade, NULL - disabled
+        bool handoff_connections = false;   //pass the live connections too (IO_EPOLL), otherwise they are drained
+        int drain_timeout_ms = DRAIN_TIMEOUT_MS;    //the drained connections still open are closed after it
+        Framing framing = FRAMING_LINES;    //of the endpoints set up next, each endpoint keeps its own
+        int udp_port = 0;           //datagram echo on the address of the first TCP endpoint, 0 - disabled
+        int udp_threads = 0;        //SO_REUSEPORT sockets with own threads, 0 - one per CPU core
+        bool udp_offload = false;   //UDP_GRO on receive and UDP_SEGMENT on send
+        int zerocopy_min_size = 0;  //the flushed output of at least this size is sent with MSG_ZEROCOPY, 0 - disabled
+        long zerocopy_max_held = ZEROCOPY_HELD_MAX; //deferred and leaked buffer bytes of the closed sockets, above it the new sends are copied
 
         //control methods
-        bool SetupListening(int port, int addr = INADDR_ANY);
+        bool SetupListening(int port, int addr = INADDR_ANY);      //replaces all endpoints with one IPv4 endpoint
+        //more endpoints sharing the connection table and the handler
+        bool AddListening(int port, int addr = INADDR_ANY);
+        bool AddListening6(int port, const in6_addr& addr = in6addr_any, bool v6only = false);   //dual-stack by default
+        bool AddListeningUnix(const char* path);
+        bool SetupHandoff();        //take over the endpoints of the process at handoff_path
         bool Start();
         bool Stop();
         void WaitServer();
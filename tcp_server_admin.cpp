@@ -0,0 +1,226 @@
+#include "tcp_server.h"
+#include <inttypes.h>
+
+#define ADMIN_REQUEST_TIMEOUT_MS 1000
+#define ADMIN_SEND_TIMEOUT_MS 1000
+
+static void appendMetric(BufferPool &pool, OutBuffer &out, const char *name, const char *type, const char *help, uint64_t value)
+{
+    char line[RECV_BUF_SIZE];
+    int len = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", name, help, name, type, name, value);
+    out.append(pool, line, len);
+}
+
+static void appendSummary(BufferPool &pool, OutBuffer &out, const char *name, const char *help, LatencyPercentiles latency)
+{
+    char lines[RECV_BUF_SIZE];
+    int len = snprintf(lines, sizeof(lines),
+                       "# HELP %s %s\n# TYPE %s summary\n"
+                       "%s{quantile=\"0.5\"} %.9f\n%s{quantile=\"0.9\"} %.9f\n%s{quantile=\"0.99\"} %.9f\n%s{quantile=\"0.999\"} %.9f\n"
+                       "%s_count %" PRIu64 "\n",
+                       name, help, name, name, latency.p50 / 1e9, name, latency.p90 / 1e9, name, latency.p99 / 1e9,
+                       name, latency.p999 / 1e9, name, latency.count);
+    out.append(pool, lines, len);
+}
+
+// Prometheus text snapshot, only the lock-free counters are read
+void TCPServer::writeMetrics(OutBuffer &out)
+{
+    appendMetric(buffer_pool, out, "echo_active_connections", "gauge", "Currently active connections.", connections_list.Count());
+    appendMetric(buffer_pool, out, "echo_max_connections", "gauge", "Maximum active connections.", max_connections);
+    appendMetric(buffer_pool, out, "echo_accepts_total", "counter", "Accepted connections.", accepts.Sum());
+    appendMetric(buffer_pool, out, "echo_accepts_per_second", "gauge", "Accepted connections in the last second.", accept_rate);
+    appendMetric(buffer_pool, out, "echo_messages_total", "counter", "Processed messages.", message_count.Sum());
+    appendMetric(buffer_pool, out, "echo_received_bytes_total", "counter", "Received bytes.", bytes_in.Sum());
+    appendMetric(buffer_pool, out, "echo_sent_bytes_total", "counter", "Sent bytes.", bytes_out.Sum());
+    appendMetric(buffer_pool, out, "echo_truncated_messages_total", "counter", "Messages longer than the message size limit.", truncated_messages.Sum());
+    appendMetric(buffer_pool, out, "echo_listener_closes_total", "counter", "Listening socket closes at the connection limit.", listener_closes.Sum());
+    appendMetric(buffer_pool, out, "echo_rejected_connections_total", "counter", "Clients closed at the connection limit by the steered listeners.", rejected_clients.Sum());
+    appendMetric(buffer_pool, out, "echo_listener_reopens_total", "counter", "Listening socket reopens below the connection limit.", listener_reopens.Sum());
+    appendMetric(buffer_pool, out, "echo_buffer_bytes", "gauge", "Pooled message and output buffers held by the connections.", getBufferBytes());
+    appendMetric(buffer_pool, out, "echo_pooled_free_bytes", "gauge", "Free buffers kept in the pool for reuse.", getPooledFreeBytes());
+    appendMetric(buffer_pool, out, "echo_connection_table_bytes", "gauge", "Allocated connection table.", getConnectionTableBytes());
+    appendMetric(buffer_pool, out, "echo_read_pauses_total", "counter", "Connections not read because of their queued output.", read_pauses.Sum());
+    appendMetric(buffer_pool, out, "echo_idle_timeouts_total", "counter", "Connections closed without input for the idle timeout.", idle_timeouts.Sum());
+    appendMetric(buffer_pool, out, "echo_read_timeouts_total", "counter", "Connections closed with a line not completed in the read timeout.", read_timeouts.Sum());
+    appendMetric(buffer_pool, out, "echo_write_timeouts_total", "counter", "Connections closed with output not progressing for the write timeout.", write_timeouts.Sum());
+    appendMetric(buffer_pool, out, "echo_armed_timers", "gauge", "Connection timers in the timer wheel.", timeouts.Count());
+    appendMetric(buffer_pool, out, "echo_handoffs_in_total", "counter", "Connections taken over from the previous process.", handoffs_in.Sum());
+    appendMetric(buffer_pool, out, "echo_handoffs_out_total", "counter", "Connections passed to the next process.", handoffs_out.Sum());
+    if (udp_port > 0)
+    {
+        appendMetric(buffer_pool, out, "echo_datagrams_in_total", "counter", "Received datagrams.", datagrams_in.Sum());
+        appendMetric(buffer_pool, out, "echo_datagrams_out_total", "counter", "Sent reply datagrams.", datagrams_out.Sum());
+        appendMetric(buffer_pool, out, "echo_datagrams_per_second", "gauge", "Received datagrams in the last second.", getDatagramRate());
+    }
+
+    if (zerocopy_min_size > 0)
+    {
+        appendMetric(buffer_pool, out, "echo_zerocopy_sends_total", "counter", "Send calls with MSG_ZEROCOPY.", zerocopy_sends.Sum());
+        appendMetric(buffer_pool, out, "echo_zerocopy_completions_total", "counter", "Zero-copy sends completed without a copy.", zerocopy_done.Sum());
+        appendMetric(buffer_pool, out, "echo_zerocopy_copied_total", "counter", "Zero-copy sends the kernel copied anyway.", zerocopy_copied.Sum());
+        appendMetric(buffer_pool, out, "echo_zerocopy_deferred_buffers", "gauge", "Output buffers of closed sockets awaiting their completions.", getZerocopyDeferredCount());
+        appendMetric(buffer_pool, out, "echo_zerocopy_leaked_total", "counter", "Output buffers given up without their completions.", zerocopy_leaked.Sum());
+        appendMetric(buffer_pool, out, "echo_zerocopy_held_bytes", "gauge", "Bytes of the deferred and leaked output buffers, the sends are copied above the limit.", getZerocopyHeldBytes());
+    }
+
+    // the engines publish their queue lengths, a close value is enough
+    if (io_mode == IO_POOL)
+        appendMetric(buffer_pool, out, "echo_worker_queue_depth", "gauge", "Connections waiting for a free worker.", __atomic_load_n(&worker_queue_depth, __ATOMIC_RELAXED));
+    if (io_mode == IO_URING)
+        appendMetric(buffer_pool, out, "echo_uring_send_queue_depth", "gauge", "Connections with output waiting for the batch end.", __atomic_load_n(&uring_send_queue_depth, __ATOMIC_RELAXED));
+
+    if (track_latency)
+    {
+        appendSummary(buffer_pool, out, "echo_response_latency_seconds", "Time from the message terminator to the send completion of the reply.", getResponseLatency());
+        appendSummary(buffer_pool, out, "echo_handler_latency_seconds", "Time in the message processing function.", getHandlerLatency());
+    }
+}
+
+// any request gets the metrics, the connection is closed after the response
+void TCPServer::serveAdminClient(int client_socket)
+{
+    char request[RECV_BUF_SIZE];
+    if (pollForRead(client_socket, ADMIN_REQUEST_TIMEOUT_MS))
+        recv(client_socket, request, sizeof(request), MSG_DONTWAIT);
+
+    OutBuffer body;
+    writeMetrics(body);
+
+    char header[200];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                              body.len);
+
+    iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+    iov[1].iov_base = body.data;
+    iov[1].iov_len = body.len;
+
+    // a slow scraper gets the rest as it reads, a stalled one is dropped at the deadline,
+    // so the admin thread goes back to sampling the rates
+    uint64_t deadline = monotonicNs() + ADMIN_SEND_TIMEOUT_MS * 1'000'000ULL;
+    int first = 0;
+    while (first < 2)
+    {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = 2 - first;
+        ssize_t sent = sendmsg(client_socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            uint64_t now = monotonicNs();
+            if (errno == EINTR || (errno == EAGAIN && now < deadline && pollForWrite(client_socket, (deadline - now + 999'999) / 1'000'000)))
+                continue;
+
+            if (errno == EAGAIN)
+                fprintf(stderr, "admin client too slow, the metrics are dropped\n");
+            else
+                perror("admin send");
+            break;
+        }
+
+        // the sent part of the header and body is skipped
+        while (first < 2 && (size_t)sent >= iov[first].iov_len)
+            sent -= iov[first++].iov_len;
+        if (first < 2)
+        {
+            iov[first].iov_base = (char *)iov[first].iov_base + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+
+    body.release(buffer_pool);
+    close(client_socket);
+}
+
+// admin thread, serves one metrics request at a time and samples the accept rate
+void *TCPServer::adminLoop(void *param)
+{
+    auto server = (TCPServer *)param;
+    Listener *listener = &server->admin_listener;
+
+    uint64_t last_accepts = server->accepts.Sum();
+    uint64_t last_sample = monotonicNs();
+
+    // after a handoff the next process serves the metrics on the same socket
+    while (server->running && !server->handing_off)
+    {
+        uint64_t now = monotonicNs();
+        if (now - last_sample >= 1'000'000'000ULL)
+        {
+            uint64_t accepts = server->accepts.Sum();
+            server->accept_rate = (accepts - last_accepts) * 1'000'000'000ULL / (now - last_sample);
+            last_accepts = accepts;
+            last_sample = now;
+        }
+
+        if (!pollForRead(listener->sock, POLL_TIMEOUT_MS))
+            continue;
+
+        int client_socket = accept(listener->sock, NULL, NULL);
+        if (client_socket < 0)
+        {
+            perror("can't accept admin client");
+            continue;
+        }
+
+        server->serveAdminClient(client_socket);
+    }
+
+    server->closeListenerSocket(listener);
+    return NULL;
+}
+
+// the address of the first TCP endpoint with the other port, any IPv4 address with only Unix endpoints
+socklen_t TCPServer::ipEndpoint(int port, sockaddr_storage &endpoint, bool &v6only)
+{
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.ss_family = AF_INET;
+    socklen_t endpoint_len = sizeof(sockaddr_in);
+    v6only = false;
+    for (int i = 0; i < listener_count; i++)
+        if (listeners[i].family != AF_UNIX)
+        {
+            memcpy(&endpoint, &listeners[i].addr, listeners[i].addr_len);
+            endpoint_len = listeners[i].addr_len;
+            v6only = listeners[i].v6only;
+            break;
+        }
+
+    if (endpoint.ss_family == AF_INET6)
+        ((sockaddr_in6 *)&endpoint)->sin6_port = htons(port);
+    else
+        ((sockaddr_in *)&endpoint)->sin_port = htons(port);
+    return endpoint_len;
+}
+
+bool TCPServer::startAdmin()
+{
+    admin_listener.index = -1;
+    admin_listener.server = this;
+
+    // bound to the address of the first TCP endpoint
+    sockaddr_storage endpoint;
+    socklen_t endpoint_len = ipEndpoint(admin_port, endpoint, admin_listener.v6only);
+    admin_listener.setEndpoint((sockaddr *)&endpoint, endpoint_len);
+
+    // the socket may be taken over from the previous process
+    if (admin_listener.isSocketClosed() && !admin_listener.setupSocket())
+    {
+        fprintf(stderr, "can't setup the admin socket\n");
+        return false;
+    }
+
+    if (pthread_create(&admin_thread, NULL, adminLoop, this))
+    {
+        perror("can't run admin thread");
+        admin_listener.closeSocket();
+        admin_thread = 0;
+        return false;
+    }
+
+    return true;
+}
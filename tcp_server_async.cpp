@@ -0,0 +1,574 @@
+#include "tcp_server_async.h"
+#include "tcp_server_framing.h"
+#include <sys/epoll.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <new>
+
+// the framing loop passes the messages as views, the request keeps its own copy
+struct AsyncHandler
+{
+    static inline bool TakesViews(TCPServer*) { return true; }
+    static inline void Process(Connection *conn, const char *msg, int msg_len) { conn->startRequest(msg, msg_len); }
+};
+
+void Connection::processAsync(const unsigned char *data, int size)
+{
+    processMessages<AsyncHandler>(data, size);
+}
+
+// start the handler of a message, it runs until its first wait
+void Connection::startRequest(const char *msg, int msg_len)
+{
+    Reactor *owner = &server->reactors[reactor];
+    AsyncRequest *req = owner->allocRequest();
+    if (!req)
+        return;
+
+    if (!server->buffer_pool.Grow(req->msg, req->msg_cap, msg_len + 1, 0))
+    {
+        owner->releaseRequest(req);
+        return;
+    }
+    memcpy(req->msg, msg, msg_len);
+    req->msg[msg_len] = 0;
+    req->msg_len = msg_len;
+    req->conn = this;
+
+    // the detection time added by deliverMessage goes with the request to its reply
+    if (server->track_latency && reply_count > 0)
+        req->start = reply_times[--reply_count];
+
+    // the messages of the batch past the limit wait for their handlers to start
+    bool queued = asyncFull();
+    if (async_tail)
+        async_tail->next = req;
+    else
+        async_head = req;
+    async_tail = req;
+
+    if (!queued)
+    {
+        req->started = true;
+        async_count++;
+        server->ProcessMessageAsyncPtr(*req);
+        completeRequests();
+    }
+
+    // the rest of the input waits in the socket until the handlers catch up
+    if (asyncFull())
+        read_paused = true;
+}
+
+// the handlers in flight are at the limit, or messages wait for a handler
+bool Connection::asyncFull()
+{
+    return async_count >= server->async_max_inflight || (async_tail && !async_tail->started);
+}
+
+// send the replies of the completed handlers at the head, in the order of the requests
+void Connection::completeRequests()
+{
+    Reactor *owner = &server->reactors[reactor];
+    bool replied = false;
+
+    while (true)
+    {
+        // a freed slot starts the next waiting message, its handler may complete at once
+        if (!async_head || !async_head->done)
+        {
+            if (async_closing || async_count >= server->async_max_inflight || !async_tail || async_tail->started)
+                break;
+
+            // the started requests are the first async_count of the list
+            AsyncRequest *req = async_head;
+            for (int i = 0; i < async_count; i++)
+                req = req->next;
+            req->started = true;
+            async_count++;
+            server->ProcessMessageAsyncPtr(*req);
+            continue;
+        }
+
+        AsyncRequest *req = async_head;
+        async_head = req->next;
+        if (!async_head)
+            async_tail = NULL;
+        async_count--;
+
+        // a closing connection only releases the finished handlers
+        if (!async_closing)
+        {
+            if (req->reply.len > 0)
+            {
+                if (server->track_latency && req->start)
+                    addReplyTime(req->start);
+                send_calls++;
+                collectOutput(req->reply.data, req->reply.len);
+                replied = true;
+            }
+
+            if (req->close_after)
+            {
+                input_closed = true;
+                disconnect();
+            }
+        }
+
+        owner->releaseRequest(req);
+    }
+
+    if (async_closing)
+        return;
+
+    // inside a receive batch the replies go out with the batch
+    if (!batch_data)
+    {
+        if (replied)
+            flush();
+        releaseIdle();
+    }
+    else if (out_bytes >= server->output_flush_threshold)
+        flush();
+
+    if (read_paused && !asyncFull() && queuedOutput() <= server->output_low_watermark)
+        read_paused = false;
+}
+
+// a closing connection wakes up its waiting handlers with the cancelled result,
+// the offloaded work can't be interrupted and is waited for
+void Connection::cancelRequests()
+{
+    Reactor *owner = &server->reactors[reactor];
+    async_closing = true;
+
+    // the messages waiting for a handler are dropped
+    AsyncRequest **link = &async_head;
+    for (int i = 0; i < async_count; i++)
+    {
+        async_tail = *link;
+        link = &(*link)->next;
+    }
+    while (*link)
+    {
+        AsyncRequest *req = *link;
+        *link = req->next;
+        owner->releaseRequest(req);
+    }
+    if (!async_head)
+        async_tail = NULL;
+
+    for (AsyncRequest *req = async_head; req; req = req->next)
+    {
+        if (req->waiting == WAIT_TIMER)
+            owner->removeTimer(req);
+        else if (req->waiting == WAIT_POLL)
+            epoll_ctl(owner->epoll_fd, EPOLL_CTL_DEL, req->wait_fd, NULL);
+        else
+            continue;
+
+        req->waiting = WAIT_NONE;
+        req->cancelled = true;
+        req->handle.resume();
+    }
+
+    completeRequests();
+}
+
+bool AsyncRequest::send(const void *data, int size)
+{
+    return reply.append(conn->server->buffer_pool, (const char*)data, size);
+}
+
+bool AsyncRequest::sendLine(const char *data, int size)
+{
+    return send(data, size) && send("\n", 1);
+}
+
+// formatted directly into the reply buffer
+bool AsyncRequest::sendMessage(const char *format, ...)
+{
+    va_list args, args_copy;
+    va_start(args, format);
+    va_copy(args_copy, args);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (length < 0 || !conn->server->buffer_pool.Grow(reply.data, reply.cap, reply.len + length + 1, reply.len))
+    {
+        va_end(args_copy);
+        return false;
+    }
+
+    vsnprintf(reply.data + reply.len, length + 1, format, args_copy);
+    va_end(args_copy);
+    reply.len += length;
+    return true;
+}
+
+AsyncAwait AsyncRequest::sleep(int ms)
+{
+    deadline = monotonicNs() + (uint64_t)ms * 1'000'000;
+    return {this, WAIT_TIMER};
+}
+
+AsyncAwait AsyncRequest::poll(int fd, uint32_t events)
+{
+    wait_fd = fd;
+    wait_events = events;
+    revents = 0;
+    return {this, WAIT_POLL};
+}
+
+AsyncAwait AsyncRequest::offload(void (*work)(void*), void *arg)
+{
+    this->work = work;
+    work_arg = arg;
+    return {this, WAIT_OFFLOAD};
+}
+
+// register the wait, false if it can't be made - the handler continues with the cancelled result
+bool AsyncRequest::suspend(AsyncWaitKind kind)
+{
+    Reactor *owner = &conn->server->reactors[conn->reactor];
+    bool result;
+
+    if (kind == WAIT_TIMER)
+        result = owner->addTimer(this);
+    else if (kind == WAIT_POLL)
+    {
+        // the low bit tells the request from a connection
+        epoll_event ev;
+        ev.events = wait_events | EPOLLONESHOT;
+        ev.data.ptr = (void*)((uintptr_t)this | 1);
+        result = epoll_ctl(owner->epoll_fd, EPOLL_CTL_ADD, wait_fd, &ev) == 0;
+        if (!result)
+            perror("can't add descriptor to epoll");
+    }
+    else
+        result = conn->server->offload->push(this);
+
+    waiting = result ? kind : WAIT_NONE;
+    cancelled = !result;
+    return result;
+}
+
+// the finished requests are reused by the reactor, the buffers go back to the pool
+AsyncRequest *Reactor::allocRequest()
+{
+    AsyncRequest *req = free_requests;
+    if (req)
+    {
+        free_requests = req->next;
+        *req = AsyncRequest();
+        return req;
+    }
+
+    req = new (std::nothrow) AsyncRequest();
+    if (!req)
+        fprintf(stderr, "can't allocate request\n");
+    return req;
+}
+
+void Reactor::releaseRequest(AsyncRequest *req)
+{
+    if (req->handle)
+        req->handle.destroy();
+    server->buffer_pool.Free(req->msg, req->msg_cap);
+    req->reply.release(server->buffer_pool);
+
+    req->next = retired_requests;
+    retired_requests = req;
+}
+
+// the events of the current batch may still refer to the retired requests
+void Reactor::releaseRequests()
+{
+    while (retired_requests)
+    {
+        AsyncRequest *req = retired_requests;
+        retired_requests = req->next;
+        req->next = free_requests;
+        free_requests = req;
+    }
+}
+
+// binary heap ordered by the deadline, each request knows its index for the removal
+bool Reactor::addTimer(AsyncRequest *req)
+{
+    if (timer_count == timer_cap)
+    {
+        int new_cap = timer_cap > 0 ? timer_cap * 2 : 64;
+        AsyncRequest **new_timers = (AsyncRequest **)realloc(timers, new_cap * sizeof(AsyncRequest *));
+        if (!new_timers)
+        {
+            perror("can't allocate timers");
+            return false;
+        }
+        timers = new_timers;
+        timer_cap = new_cap;
+    }
+
+    req->timer_index = timer_count;
+    timers[timer_count++] = req;
+    moveTimer(req->timer_index);
+    return true;
+}
+
+void Reactor::removeTimer(AsyncRequest *req)
+{
+    int index = req->timer_index;
+    req->timer_index = -1;
+
+    timer_count--;
+    if (index == timer_count)
+        return;
+
+    timers[index] = timers[timer_count];
+    timers[index]->timer_index = index;
+    moveTimer(index);
+}
+
+// restore the heap order around the entry
+void Reactor::moveTimer(int index)
+{
+    AsyncRequest *req = timers[index];
+
+    while (index > 0 && timers[(index - 1) / 2]->deadline > req->deadline)
+    {
+        timers[index] = timers[(index - 1) / 2];
+        timers[index]->timer_index = index;
+        index = (index - 1) / 2;
+    }
+
+    while (true)
+    {
+        int child = index * 2 + 1;
+        if (child >= timer_count)
+            break;
+        if (child + 1 < timer_count && timers[child + 1]->deadline < timers[child]->deadline)
+            child++;
+        if (timers[child]->deadline >= req->deadline)
+            break;
+
+        timers[index] = timers[child];
+        timers[index]->timer_index = index;
+        index = child;
+    }
+
+    timers[index] = req;
+    req->timer_index = index;
+}
+
+// epoll wait timeout till the nearest deadline, rounded up to milliseconds
+int Reactor::timerTimeout()
+{
+    if (timer_count == 0)
+        return -1;
+
+    uint64_t now = monotonicNs();
+    if (timers[0]->deadline <= now)
+        return 0;
+    return (timers[0]->deadline - now + 999'999) / 1'000'000;
+}
+
+void Reactor::runTimers()
+{
+    // the handlers sleeping again are due in the next round
+    uint64_t now = monotonicNs();
+    while (timer_count > 0 && timers[0]->deadline <= now)
+    {
+        AsyncRequest *req = timers[0];
+        removeTimer(req);
+        req->waiting = WAIT_NONE;
+        resumeRequest(req);
+    }
+}
+
+// called by the offload threads
+bool Reactor::pushReady(AsyncRequest *req)
+{
+    pthread_mutex_lock(&ready_lock);
+    bool wakeup = ready_head == NULL;
+    req->next_ready = NULL;
+    if (ready_tail)
+        ready_tail->next_ready = req;
+    else
+        ready_head = req;
+    ready_tail = req;
+    pthread_mutex_unlock(&ready_lock);
+
+    // one wakeup for the requests queued before the reactor takes them
+    uint64_t value = 1;
+    if (wakeup && write(wakeup_fd, &value, sizeof(value)) < 0)
+    {
+        perror("can't wake up reactor");
+        return false;
+    }
+    return true;
+}
+
+void Reactor::runReady()
+{
+    uint64_t value;
+    if (read(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        perror("can't read reactor wakeup");
+
+    pthread_mutex_lock(&ready_lock);
+    AsyncRequest *req = ready_head;
+    ready_head = ready_tail = NULL;
+    pthread_mutex_unlock(&ready_lock);
+
+    while (req)
+    {
+        AsyncRequest *next = req->next_ready;
+        req->waiting = WAIT_NONE;
+        resumeRequest(req);
+        req = next;
+    }
+}
+
+void Reactor::completePoll(AsyncRequest *req, uint32_t events)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, req->wait_fd, NULL);
+    req->revents = events;
+    req->waiting = WAIT_NONE;
+    resumeRequest(req);
+}
+
+// continue the handler after its wait, then send the replies it has unblocked
+void Reactor::resumeRequest(AsyncRequest *req)
+{
+    Connection *conn = req->conn;
+    bool paused = conn->read_paused;
+
+    req->handle.resume();
+    conn->completeRequests();
+
+    // the last offloaded work of a closing connection lets it close
+    if (conn->async_closing)
+    {
+        if (conn->async_count == 0)
+            closeConnection(conn);
+        return;
+    }
+
+    // the reading paused at the in-flight limit continues with the data left in the socket
+    if (paused && !conn->read_paused)
+        readConnection(conn, recv_buf);
+}
+
+// offload thread, runs the work and passes the request back to its reactor
+void *OffloadPool::offloadLoop(void *param)
+{
+    OffloadPool *pool = (OffloadPool*)param;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->queue_lock);
+        while (!pool->queue_head && pool->running)
+            pthread_cond_wait(&pool->queue_cond, &pool->queue_lock);
+
+        AsyncRequest *req = pool->queue_head;
+        if (req)
+        {
+            pool->queue_head = req->next_ready;
+            if (!pool->queue_head)
+                pool->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->queue_lock);
+
+        if (!req)
+            break;
+
+        req->work(req->work_arg);
+        pool->server->reactors[req->conn->reactor].pushReady(req);
+    }
+
+    return NULL;
+}
+
+bool OffloadPool::push(AsyncRequest *req)
+{
+    pthread_mutex_lock(&queue_lock);
+
+    if (!running)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        return false;
+    }
+
+    req->next_ready = NULL;
+    if (queue_tail)
+        queue_tail->next_ready = req;
+    else
+        queue_head = req;
+    queue_tail = req;
+
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+bool OffloadPool::start(int threads)
+{
+    this->threads = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    if (!this->threads)
+    {
+        perror("can't allocate offload pool");
+        return false;
+    }
+
+    running = true;
+    for (thread_count = 0; thread_count < threads; thread_count++)
+        if (!server->createThread(&this->threads[thread_count], offloadLoop, this))
+        {
+            perror("can't run offload thread");
+            return false;
+        }
+
+    return true;
+}
+
+// the threads finish the queued work before exiting
+void OffloadPool::stopAndWait()
+{
+    pthread_mutex_lock(&queue_lock);
+    running = false;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        void *retVal;
+        pthread_join(threads[i], &retVal);
+    }
+
+    free(threads);
+    threads = NULL;
+    thread_count = 0;
+}
+
+bool TCPServer::startOffload()
+{
+    offload = new OffloadPool();
+    offload->server = this;
+
+    if (!offload->start(offload_threads > 0 ? offload_threads : 1))
+    {
+        stopOffload();
+        return false;
+    }
+
+    return true;
+}
+
+void TCPServer::stopOffload()
+{
+    if (!offload)
+        return;
+
+    offload->stopAndWait();
+    delete offload;
+    offload = NULL;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "tcp_server.h"
+#include <coroutine>
+#include <exception>
+
+// asynchronous message handlers - C++20 coroutines run by the epoll reactors.
+// The handler is
+//     AsyncTask handler(AsyncRequest& req);
+// it runs on the reactor thread until its first co_await, and may await
+//     req.sleep(ms)               - a reactor timer
+//     req.poll(fd, events)        - readiness of another descriptor, the result events are in req.revents
+//     req.offload(work, arg)      - work(arg) called on an offload thread
+// without blocking the reactor. Each await returns false when the wait was cancelled by the
+// connection closing, the later awaits of a closing connection return false at once.
+// The reply is collected with req.send...() and sent when the handler completes, in the order
+// of the requests, so many handlers of one connection may be in flight at once
+
+enum AsyncWaitKind
+{
+    WAIT_NONE,
+    WAIT_TIMER,
+    WAIT_POLL,
+    WAIT_OFFLOAD,
+};
+
+struct AsyncRequest;
+
+// awaitable returned by the AsyncRequest wait methods
+struct AsyncAwait
+{
+    AsyncRequest* req;
+    AsyncWaitKind kind;
+
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume();
+};
+
+// coroutine type of the asynchronous handlers, the coroutine frame is owned by its request
+struct AsyncTask
+{
+    struct promise_type
+    {
+        AsyncRequest* req;
+
+        // the coroutine gets the request as its first parameter
+        promise_type(AsyncRequest& request);
+
+        AsyncTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept;
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// one message being handled, taken from the reactor and kept until its reply is sent
+struct AsyncRequest
+{
+    Connection* conn;
+    char* msg = NULL;           //null-terminated copy, valid until the handler completes
+    int msg_len = 0;
+    int msg_cap = 0;
+    uint32_t revents = 0;       //events of the last poll wait
+
+    //reply collection
+    bool send(const void* data, int size);
+    bool sendLine(const char* data, int size);
+    bool sendMessage(const char* format, ...);
+    inline void close() { close_after = true; }     //disconnect after this reply is sent
+
+    //waits
+    AsyncAwait sleep(int ms);
+    AsyncAwait poll(int fd, uint32_t events);
+    AsyncAwait offload(void (*work)(void*), void* arg);
+
+    //internal state
+    std::coroutine_handle<> handle;
+    OutBuffer reply;
+    AsyncRequest* next = NULL;          //connection order, then the reactor free list
+    AsyncRequest* next_ready = NULL;    //offload queue and reactor ready queue
+    uint64_t start = 0;                 //detection time for the latency histogram
+    uint64_t deadline = 0;
+    int timer_index = -1;
+    int wait_fd = -1;
+    uint32_t wait_events = 0;
+    void (*work)(void*) = NULL;
+    void* work_arg = NULL;
+    AsyncWaitKind waiting = WAIT_NONE;
+    bool started = false;               //the handler was called, the requests past the in-flight limit wait
+    bool cancelled = false;
+    bool done = false;
+    bool close_after = false;
+
+    bool suspend(AsyncWaitKind kind);
+};
+
+inline AsyncTask::promise_type::promise_type(AsyncRequest& request) : req(&request)
+{
+    request.handle = std::coroutine_handle<promise_type>::from_promise(*this);
+}
+
+// the completed handler stays suspended, the connection sends its reply and destroys the frame
+inline auto AsyncTask::promise_type::final_suspend() noexcept
+{
+    struct FinalAwait
+    {
+        AsyncRequest* req;
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>) noexcept { req->done = true; }
+        void await_resume() noexcept {}
+    };
+    return FinalAwait{req};
+}
+
+inline bool AsyncAwait::await_ready()
+{
+    req->cancelled = req->conn->async_closing;
+    return req->cancelled;
+}
+
+inline bool AsyncAwait::await_suspend(std::coroutine_handle<>)
+{
+    return req->suspend(kind);
+}
+
+inline bool AsyncAwait::await_resume()
+{
+    return !req->cancelled;
+}
+
+// threads running the offloaded work, the requests are passed back to their reactors
+struct OffloadPool
+{
+    pthread_t* threads = NULL;
+    int thread_count = 0;
+    bool running;
+
+    AsyncRequest* queue_head = NULL;
+    AsyncRequest* queue_tail = NULL;
+    pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+    TCPServer* server;
+
+    static void* offloadLoop(void*);
+    bool push(AsyncRequest* req);
+    bool start(int threads);
+    void stopAndWait();
+};
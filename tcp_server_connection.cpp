@@ -1,71 +1,275 @@
 #include "tcp_server.h"
+#include "tcp_server_framing.h"
 #include <stdarg.h>
+#include <stdlib.h>
 
 // client thread
 void *Connection::clientLoop(void *param)
 {
     Connection *conn = (Connection *)param;
-    unsigned char message[RECV_MESSAGE_SIZE];
-    int message_len = 0;
-    char last_term = '\0';
 
     while (conn->running)
     {
+        // the raw echo keeps the data in the kernel, the rest of a longer frame goes straight into its message buffer
         unsigned char recv_buf[RECV_BUF_SIZE];
-        int recv_sz = recv(conn->socket, recv_buf, RECV_BUF_SIZE, MSG_NOSIGNAL);
+        unsigned char *recv_to = NULL;
+        int recv_sz;
+        bool spliced = conn->framing == FRAMING_RAW_ECHO;
+        if (spliced)
+            recv_sz = conn->spliceEcho();
+        else
+        {
+            int recv_cap;
+            recv_to = conn->frameTarget(recv_cap);
+            if (!recv_to)
+            {
+                recv_to = recv_buf;
+                recv_cap = RECV_BUF_SIZE;
+            }
+
+            recv_sz = recv(conn->socket, recv_to, recv_cap, MSG_NOSIGNAL);
+        }
 
         if (recv_sz == 0)
         {
             // disconnected
+            char addr[INET6_ADDRSTRLEN];
             if (conn->server->debug_printing)
-                printf("%d] disconnected %s:%d\n", conn->pos, conn->remote_addr, conn->remote_port);
+                printf("%d] disconnected %s:%d\n", conn->pos, conn->remoteAddress(addr), conn->remote_port);
 
-            close(conn->socket);
+            conn->server->closeClientSocket(conn);
             break;
         }
 
         if (recv_sz < 0)
         {
-            perror("socket receive");
-            close(conn->socket);
+            if (errno == EINTR && spliced)
+                continue;
+
+            perror(spliced ? "socket splice" : "socket receive");
+            conn->server->closeClientSocket(conn);
             break;
         }
 
-        for (int i = 0; i < recv_sz; i++)
+        if (!spliced)
+            conn->processData(recv_to, recv_sz);
+    }
+
+    conn->server->connectionComplete(conn);
+    conn->running = false;
+
+    return NULL;
+}
+
+// the pipe of a thread serving the raw echo connections, empty between the spliceEcho calls
+struct SplicePipe
+{
+    int fds[2] = {-1, -1};
+
+    ~SplicePipe() { reset(); }
+
+    bool open()
+    {
+        if (fds[0] != -1)
+            return true;
+
+        if (pipe2(fds, O_CLOEXEC))
         {
-            if (recv_buf[i] == '\r' || recv_buf[i] == '\n')
-            {
-                //handle windows' line-endings
-                if (last_term == '\r' && recv_buf[i] == '\n')
-                {
-                    last_term = '\n';
-                    continue;
-                }
+            perror("can't create splice pipe");
+            fds[0] = fds[1] = -1;
+            return false;
+        }
 
-                // null-terminate the recieved message for easier processing
-                message[message_len] = 0;
+        // a larger pipe moves more with each call
+        fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+        return true;
+    }
 
-                if (conn->server->debug_printing)
-                    printf("%d> %s\n", conn->pos, message);
+    // the bytes left by a failed connection go with the pipe
+    void reset()
+    {
+        if (fds[0] == -1)
+            return;
 
-                // process the message with the external proc
-                if (conn->server->ProcessMessagePtr)
-                    conn->server->ProcessMessagePtr(conn, (char *)message, message_len);
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
+};
 
-                // reset the message counter
-                message_len = 0;
-            }
-            else if (message_len < RECV_MESSAGE_SIZE - 1)
-                message[message_len++] = recv_buf[i];
+static thread_local SplicePipe splice_pipe;
 
-            last_term = recv_buf[i];
+// raw echo through the pipe of the serving thread - the received bytes go to the pipe and from it
+// back to the socket without a copy to the user space;
+// returns the received size, 0 when disconnected, -1 with errno set
+int Connection::spliceEcho()
+{
+    if (!splice_pipe.open())
+        return -1;
+
+    unsigned flags = SPLICE_F_MOVE | (server->io_mode == IO_EPOLL ? SPLICE_F_NONBLOCK : 0);
+    ssize_t in = splice(socket, NULL, splice_pipe.fds[1], NULL, SPLICE_PIPE_SIZE, flags);
+    if (in <= 0)
+        return in;
+
+    server->bytes_in.Add(in);
+    read_tick = write_tick = server->timerNow();
+
+    ssize_t left = in;
+    while (left > 0)
+    {
+        ssize_t out = splice(splice_pipe.fds[0], NULL, socket, NULL, left, flags);
+        if (out > 0)
+        {
+            left -= out;
+            server->bytes_out.Add(out);
+            write_tick = server->timerNow();
+            continue;
         }
+
+        if (out < 0 && errno == EINTR)
+            continue;
+
+        // a reactor can't wait for a slow reader, the rest is queued and the input takes the copy path until it's sent
+        bool full = out < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (full && server->io_mode == IO_EPOLL && queueSpliced(left))
+            return in;
+
+        splice_pipe.reset();
+        errno = out == 0 || full ? EPIPE : errno;
+        return -1;
     }
 
-    conn->server->connectionComplete(conn);
-    conn->running = false;
+    write_tick = 0;
+    return in;
+}
 
-    return NULL;
+// move the bytes the socket didn't take from the pipe to the output queue, which is empty while splicing
+bool Connection::queueSpliced(int size)
+{
+    out_sending.len = out_sent = 0;
+    if (!server->buffer_pool.Grow(out_sending.data, out_sending.cap, size, 0))
+    {
+        fprintf(stderr, "can't allocate output buffer\n");
+        return false;
+    }
+
+    while (out_sending.len < size)
+    {
+        ssize_t sz = read(splice_pipe.fds[0], out_sending.data + out_sending.len, size - out_sending.len);
+        if (sz < 0 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            return false;
+        out_sending.len += sz;
+    }
+
+    if (queuedOutput() > server->output_high_watermark && !read_paused)
+    {
+        read_paused = true;
+        server->read_pauses.Add();
+    }
+
+    return true;
+}
+
+// the raw echo of the data received to the user space - by io_uring, or behind the output queued by a reactor
+void Connection::echoRaw(const unsigned char *data, int size)
+{
+    batch_data = data;
+    batch_size = size;
+    server->bytes_in.Add(size);
+    read_tick = server->timerNow();
+
+    sendBytes(data, size);
+    if (server->io_mode != IO_URING)
+        flush();
+
+    batch_data = NULL;
+    batch_size = 0;
+}
+
+// split the received data into messages and pass them for processing
+void Connection::processData(const unsigned char *data, int size)
+{
+    // a typed server has the framing loop compiled with its handler, the raw echo has none
+    if (framing == FRAMING_RAW_ECHO)
+        echoRaw(data, size);
+    else if (server->ProcessDataPtr)
+        server->ProcessDataPtr(this, data, size);
+    else if (server->ProcessMessageAsyncPtr)
+        processAsync(data, size);
+    else
+        processMessages<PointerHandler>(data, size);
+}
+
+// grow the message buffer to the size, keeping the collected part
+bool Connection::reserveMessage(int size)
+{
+    return server->buffer_pool.Grow(message, message_cap, size, message_len);
+}
+
+// the completed message null-terminated in the connection's own buffer, an empty one takes the smallest
+// buffer, so a handler writing to it never touches the memory of another connection; NULL without memory
+char *Connection::terminateMessage()
+{
+    if (!message && !reserveMessage(1))
+        return NULL;
+
+    char *msg = (char *)message;
+    msg[message_len] = 0;
+    return msg;
+}
+
+void Connection::releaseMessage()
+{
+    server->buffer_pool.Free(message, message_cap);
+}
+
+// the uncollected part of the current frame, when it's worth receiving without a copy
+unsigned char *Connection::frameTarget(int &size)
+{
+    if (frame_header_len != FRAME_PAYLOAD || input_closed)
+        return NULL;
+
+    int limit = server->max_message_size - 1;
+    int left = frame_left < (uint32_t)(limit - message_len) ? frame_left : limit - message_len;
+    if (left < FRAME_DIRECT_MIN || !reserveMessage(message_len + left + 1))
+        return NULL;
+
+    size = left;
+    return message + message_len;
+}
+
+// the error reply to an oversize message, framed like the other replies of the connection
+void Connection::rejectMessage()
+{
+    if (framing == FRAMING_LINES)
+        sendBytes(MESSAGE_TOO_LONG_REPLY, sizeof(MESSAGE_TOO_LONG_REPLY) - 1);
+    else
+        sendFrame(MESSAGE_TOO_LONG_REPLY, sizeof(MESSAGE_TOO_LONG_REPLY) - 2);
+}
+
+void Connection::addReplyTime(uint64_t time)
+{
+    if (!server->buffer_pool.Grow(reply_times, reply_cap, reply_count + 1, reply_count))
+        return;
+
+    reply_times[reply_count++] = time;
+}
+
+// the oldest replies are sent
+void Connection::completeReplies(int count)
+{
+    if (count <= 0)
+        return;
+
+    uint64_t now = monotonicNs();
+    for (int i = 0; i < count; i++)
+        server->response_latency.Record(now - reply_times[i]);
+
+    reply_count -= count;
+    memmove(reply_times, reply_times + count, reply_count * sizeof(uint64_t));
 }
 
 // send messages with va_args
@@ -73,17 +277,405 @@ bool Connection::sendMessage(const char *format, ...)
 {
     char send_buffer[RECV_MESSAGE_SIZE + 1];
 
-    va_list args;
+    va_list args, args_copy;
     va_start(args, format);
+    va_copy(args_copy, args);
     int length = vsnprintf(send_buffer, RECV_MESSAGE_SIZE + 1, format, args);
     va_end(args);
 
-    if (send(socket, send_buffer, length, MSG_NOSIGNAL) <= 0)
+    if (length < 0)
+    {
+        va_end(args_copy);
         return false;
+    }
+
+    // a longer message is formatted again into a buffer of its size
+    if (length > RECV_MESSAGE_SIZE)
+    {
+        char *long_buffer = (char *)malloc(length + 1);
+        if (!long_buffer)
+        {
+            va_end(args_copy);
+            perror("can't allocate message buffer");
+            return false;
+        }
+
+        vsnprintf(long_buffer, length + 1, format, args_copy);
+        va_end(args_copy);
+
+        bool result = sendBytes(long_buffer, length);
+        free(long_buffer);
+        return result;
+    }
+
+    va_end(args_copy);
+    return sendBytes(send_buffer, length);
+}
+
+// send raw bytes, without formatting
+bool Connection::sendBytes(const void *data, int size)
+{
+    iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+    return sendVector(&iov, 1);
+}
+
+// send the data followed by <LF>, in one call and without copying it
+bool Connection::sendLine(const char *data, int size)
+{
+    iovec iov[2];
+    iov[0].iov_base = (void *)data;
+    iov[0].iov_len = size;
+    iov[1].iov_base = (void *)"\n";
+    iov[1].iov_len = 1;
+    return sendVector(iov, 2);
+}
+
+// the line with <LF>, or the frame with its length prefix
+bool Connection::sendFrame(const char *data, int size)
+{
+    if (framing == FRAMING_LINES)
+        return sendLine(data, size);
+
+    unsigned char prefix[VARINT_MAX_BYTES];
+    int prefix_len = 0;
+    if (framing == FRAMING_LENGTH32)
+    {
+        uint32_t len = htonl(size);
+        memcpy(prefix, &len, sizeof(len));
+        prefix_len = sizeof(len);
+    }
+    else
+    {
+        uint32_t len = size;
+        do
+        {
+            prefix[prefix_len++] = (len & 0x7F) | (len > 0x7F ? 0x80 : 0);
+            len >>= 7;
+        } while (len);
+    }
+
+    iovec iov[2];
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = prefix_len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+    return sendVector(iov, 2);
+}
+
+bool Connection::sendVector(iovec *iov, int count)
+{
+    send_calls++;
+
+    // sent by the UDP thread after the datagram batch, one reply datagram per received one
+    if (datagram)
+    {
+        for (int i = 0; i < count; i++)
+            if (!out_pending.append(server->buffer_pool, (const char *)iov[i].iov_base, iov[i].iov_len))
+                return false;
+        return true;
+    }
+
+    // sent by the io_uring thread after the current completion batch
+    if (server->io_mode == IO_URING)
+    {
+        for (int i = 0; i < count; i++)
+            if (!queueOutput((const char *)iov[i].iov_base, iov[i].iov_len))
+                return false;
+        return true;
+    }
+
+    // not called from a handler, nothing to coalesce with
+    if (!batch_data)
+        return flush() && (server->io_mode == IO_EPOLL ? writeQueued(iov, count) : writeOutput(iov, count));
+
+    for (int i = 0; i < count; i++)
+        if (!collectOutput((const char *)iov[i].iov_base, iov[i].iov_len))
+            return false;
+
+    if (out_bytes >= server->output_flush_threshold)
+        return flush();
 
     return true;
 }
 
+// add the piece to the output of the current batch
+bool Connection::collectOutput(const char *data, int size)
+{
+    if (size <= 0)
+        return true;
+
+    // only the large views into the received data are worth an iovec of their own
+    bool borrow = size >= OUT_BORROW_MIN && (const unsigned char *)data >= batch_data &&
+                  (const unsigned char *)data + size <= batch_data + batch_size;
+
+    // the copied pieces following each other are sent as one
+    if (borrow || out_iov_count == 0 || out_iov[out_iov_count - 1].iov_base != NULL)
+    {
+        if (out_iov_count == OUT_IOV_MAX && !flush())
+            return false;
+
+        if (!server->buffer_pool.Grow(out_iov, out_iov_cap, out_iov_count + 1, out_iov_count))
+            return false;
+
+        out_iov[out_iov_count].iov_base = borrow ? (void *)data : NULL;
+        out_iov[out_iov_count].iov_len = 0;
+        out_iov_count++;
+    }
+
+    if (!borrow && !out_pending.append(server->buffer_pool, data, size))
+        return false;
+
+    out_iov[out_iov_count - 1].iov_len += size;
+    out_bytes += size;
+    return true;
+}
+
+// send the collected output now
+bool Connection::flush()
+{
+    if (datagram)
+        return true;
+
+    if (server->io_mode == IO_URING)
+    {
+        flushUring();
+        return true;
+    }
+
+    if (out_bytes == 0)
+        return true;
+
+    // the copied pieces are stored one after another, the buffer could move while collecting
+    int offset = 0;
+    for (int i = 0; i < out_iov_count; i++)
+        if (out_iov[i].iov_base == NULL)
+        {
+            out_iov[i].iov_base = out_pending.data + offset;
+            offset += out_iov[i].iov_len;
+        }
+
+    // the large output copied to the buffer skips the kernel copy, the buffer is held until the sends complete
+    bool zerocopy_send = zerocopyReady();
+    uint32_t first_seq = zerocopy_send ? zerocopy->next_seq : 0;
+
+    // a shared reactor thread can't wait for a slow reader, the rest is queued
+    bool result = server->io_mode == IO_EPOLL ? writeQueued(out_iov, out_iov_count, zerocopy_send) : writeOutput(out_iov, out_iov_count, zerocopy_send);
+    if (zerocopy_send)
+        holdZerocopy(first_seq);
+    // with the output queued the replies complete when the queue is drained
+    if (!result)
+        reply_count = 0;
+    else if (out_sent == out_sending.len)
+        completeReplies(reply_count);
+
+    out_pending.len = 0;
+    out_iov_count = 0;
+    out_bytes = 0;
+    return result;
+}
+
+bool Connection::writeOutput(iovec *iov, int count, bool zerocopy_send)
+{
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    // the socket is non-blocking in IO_EPOLL mode, so wait for the partial writes to complete
+    while (msg.msg_iovlen > 0)
+    {
+        write_tick = server->timerNow();
+
+        if (msg.msg_iov->iov_len == 0)
+        {
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+            continue;
+        }
+
+        bool zc = zerocopy_send && zerocopyRoom();
+        ssize_t sz = sendmsg(socket, &msg, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+
+        // no room for the notifications, the rest is sent with a copy
+        if (sz < 0 && zc && errno == ENOBUFS)
+        {
+            zerocopy_send = false;
+            continue;
+        }
+        if (sz > 0 && zc)
+        {
+            zerocopy->next_seq++;
+            server->zerocopy_sends.Add();
+        }
+
+        if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!TCPServer::pollForWrite(socket, POLL_TIMEOUT_MS))
+                return false;
+            continue;
+        }
+
+        if (sz <= 0)
+            return false;
+
+        server->bytes_out.Add(sz);
+
+        // skip the sent parts
+        while (sz > 0)
+        {
+            size_t part = (size_t)sz < msg.msg_iov->iov_len ? sz : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + part;
+            msg.msg_iov->iov_len -= part;
+            sz -= part;
+            if (msg.msg_iov->iov_len == 0)
+            {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+
+    write_tick = 0;
+    return true;
+}
+
+// non-blocking write, the part the socket doesn't take is queued behind the already queued output
+bool Connection::writeQueued(iovec *iov, int count, bool zerocopy_send)
+{
+    int i = 0;
+    if (out_sending.len == out_sent)
+    {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        bool zc = zerocopy_send && zerocopyRoom();
+        ssize_t sz = sendmsg(socket, &msg, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+        if (sz < 0 && zc && errno == ENOBUFS)
+            sz = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        else if (sz > 0 && zc)
+        {
+            zerocopy->next_seq++;
+            server->zerocopy_sends.Add();
+        }
+
+        if (sz < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+
+        if (sz > 0)
+            server->bytes_out.Add(sz);
+
+        // skip the sent parts
+        for (; sz > 0 && i < count; i++)
+        {
+            if ((size_t)sz < iov[i].iov_len)
+            {
+                iov[i].iov_base = (char *)iov[i].iov_base + sz;
+                iov[i].iov_len -= sz;
+                break;
+            }
+            sz -= iov[i].iov_len;
+        }
+
+        out_sending.len = out_sent = 0;
+    }
+
+    for (; i < count; i++)
+        if (!out_sending.append(server->buffer_pool, (const char *)iov[i].iov_base, iov[i].iov_len))
+            return false;
+
+    // the time the output started waiting for the socket
+    if (out_sending.len > out_sent && !write_tick)
+        write_tick = server->timerNow();
+
+    if (queuedOutput() > server->output_high_watermark && !read_paused)
+    {
+        read_paused = true;
+        server->read_pauses.Add();
+    }
+
+    return true;
+}
+
+// send the queued output when the socket is writable, false if the connection has failed
+bool Connection::drainOutput()
+{
+    while (out_sent < out_sending.len)
+    {
+        ssize_t sz = send(socket, out_sending.data + out_sent, out_sending.len - out_sent, MSG_NOSIGNAL);
+        if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sz < 0 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            return false;
+
+        out_sent += sz;
+        server->bytes_out.Add(sz);
+        write_tick = server->timerNow();
+    }
+
+    if (out_sent == out_sending.len)
+    {
+        out_sending.len = out_sent = 0;
+        write_tick = 0;
+        completeReplies(reply_count);
+        releaseIdle();
+
+        if (disconnect_pending)
+            shutdown(socket, SHUT_RDWR);
+    }
+
+    if (read_paused && queuedOutput() <= server->output_low_watermark && !asyncFull())
+        read_paused = false;
+
+    return true;
+}
+
+void Connection::releaseOutput()
+{
+    out_pending.release(server->buffer_pool);
+    out_sending.release(server->buffer_pool);
+    out_sent = 0;
+    server->buffer_pool.Free(out_iov, out_iov_cap);
+    out_iov_count = out_bytes = 0;
+    server->buffer_pool.Free(reply_times, reply_cap);
+    reply_count = reply_sending = 0;
+}
+
+// return the buffers to the pool while no data is in flight, so an idle connection holds none
+void Connection::releaseIdle()
+{
+    if (message_len == 0)
+        releaseMessage();
+
+    if (queuedOutput() == 0 && out_bytes == 0 && reply_count == 0)
+        releaseOutput();
+}
+
+// close the connection after the already queued output is sent
+void Connection::disconnect()
+{
+    // a datagram peer has no connection to close
+    if (datagram)
+        return;
+
+    if (server->io_mode == IO_EPOLL)
+        flush();
+
+    if ((server->io_mode == IO_URING || server->io_mode == IO_EPOLL) && queuedOutput() > 0)
+    {
+        disconnect_pending = true;
+        return;
+    }
+
+    flush();
+    shutdown(socket, SHUT_RDWR);
+}
+
 // start the connection thread
 bool Connection::start()
 {
@@ -91,9 +683,41 @@ bool Connection::start()
         return false;
     running = true;
 
-    if (pthread_create(&client_thread, NULL, Connection::clientLoop, this))
+    // the listener accepts the sockets of the reactors non-blocking
+    if (server->io_mode == IO_EPOLL)
+    {
+        // with CPU steering the connection stays on the core of its listener
+        if (server->cpu_steering != STEER_NONE)
+            reactor = listener->cpu % server->reactor_count;
+        else
+            reactor = __atomic_fetch_add(&server->next_reactor, 1, __ATOMIC_RELAXED) % server->reactor_count;
+        if (!server->reactors[reactor].addConnection(this))
+        {
+            running = false;
+            return false;
+        }
+
+        return true;
+    }
+
+    if (server->io_mode == IO_URING)
+        return startUring();
+
+    // a free worker picks the connection up from the queue
+    if (server->io_mode == IO_POOL)
+    {
+        if (!server->pool->push(this))
+        {
+            running = false;
+            return false;
+        }
+        return true;
+    }
+
+    if (!server->createThread(&client_thread, Connection::clientLoop, this))
     {
         perror("can't run client thread");
+        running = false;
         return false;
     }
 
@@ -110,6 +734,62 @@ void Connection::closeAndWaitConnection()
         printf("%d] closing...\n", pos);
 
     shutdown(socket, SHUT_RDWR);
+
+    // the reactor (io_uring thread or worker) closes the connection when it gets the shutdown event
+    if (server->io_mode != IO_THREADED)
+    {
+        while (running.load(std::memory_order_acquire))
+            usleep(1'000);
+        return;
+    }
+
     void *retVal;
     pthread_join(client_thread, &retVal);
 }
+
+// the IPv4 address is mapped into the IPv6 one, a Unix socket peer has none
+void Connection::setRemote(const sockaddr *addr)
+{
+    memset(&remote_ip, 0, sizeof(remote_ip));
+    remote_port = 0;
+    if (addr->sa_family == AF_INET)
+    {
+        remote_ip.s6_addr[10] = remote_ip.s6_addr[11] = 0xff;
+        memcpy(&remote_ip.s6_addr[12], &((sockaddr_in *)addr)->sin_addr, 4);
+        remote_port = ntohs(((sockaddr_in *)addr)->sin_port);
+    }
+    else if (addr->sa_family == AF_INET6)
+    {
+        remote_ip = ((sockaddr_in6 *)addr)->sin6_addr;
+        remote_port = ntohs(((sockaddr_in6 *)addr)->sin6_port);
+    }
+}
+
+// the IPv4 clients of the dual-stack and IPv4 listeners are printed in the dotted form
+const char *Connection::remoteAddress(char *buf)
+{
+    if (IN6_IS_ADDR_V4MAPPED(&remote_ip))
+        return inet_ntop(AF_INET, &remote_ip.s6_addr[12], buf, INET6_ADDRSTRLEN);
+    if (IN6_IS_ADDR_UNSPECIFIED(&remote_ip))
+        return strcpy(buf, "unix");
+    return inet_ntop(AF_INET6, &remote_ip, buf, INET6_ADDRSTRLEN);
+}
+
+bool OutBuffer::append(BufferPool &pool, const char *buf, int size)
+{
+    if (!pool.Grow(data, cap, len + size, len))
+    {
+        fprintf(stderr, "can't allocate output buffer\n");
+        return false;
+    }
+
+    memcpy(data + len, buf, size);
+    len += size;
+    return true;
+}
+
+void OutBuffer::release(BufferPool &pool)
+{
+    pool.Free(data, cap);
+    len = 0;
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "tcp_server.h"
+#include "line_scanner.h"
+
+// the framing loop is a template on the handler, so a typed server gets the handler call inlined
+// and the function pointers are only one of its instantiations
+
+// the message processing function pointers of TCPServer
+struct PointerHandler
+{
+    static inline bool TakesViews(TCPServer* server) { return server->ProcessMessageViewPtr != NULL; }
+
+    // the view is valid only during the call and is not null-terminated
+    static inline void Process(Connection* conn, const char* msg, int msg_len)
+    {
+        if (conn->server->ProcessMessageViewPtr)
+            conn->server->ProcessMessageViewPtr(conn, msg, msg_len);
+        else if (conn->server->ProcessMessagePtr)
+            conn->server->ProcessMessagePtr(conn, (char*)msg, msg_len);
+    }
+};
+
+// split the received data into messages and pass them to the handler
+template <class Handler>
+void Connection::processMessages(const unsigned char* data, int size)
+{
+    // the client is being disconnected for an oversize message
+    if (input_closed)
+        return;
+
+    // the replies may refer to the received data until the batch is flushed
+    batch_data = data;
+    batch_size = size;
+    server->bytes_in.Add(size);
+    read_tick = server->timerNow();
+
+    if (framing == FRAMING_LINES)
+        processLines<Handler>(data, size);
+    else
+        processFrames<Handler>(data, size);
+
+    // one send for all the replies of this receive, io_uring sends after the completion batch
+    if (server->io_mode != IO_URING)
+        flush();
+
+    // a partial line or frame is timed from its first bytes
+    if (message_len == 0 && frame_header_len == 0)
+        line_tick = 0;
+    else if (!line_tick)
+        line_tick = read_tick;
+
+    releaseIdle();
+
+    batch_data = NULL;
+    batch_size = 0;
+}
+
+// the terminators are searched in the data, the <CR><LF> pair may be split between two receives
+template <class Handler>
+void Connection::processLines(const unsigned char* data, int size)
+{
+    int limit = server->max_message_size - 1;
+    int i = 0;
+    while (i < size)
+    {
+        //handle windows' line-endings, the <CR> may be the last byte of the previous receive
+        if (last_term == '\r' && data[i] == '\n')
+        {
+            last_term = '\n';
+            i++;
+            continue;
+        }
+
+        int end = i + findTerminator(data + i, size - i);
+        int run = end - i;
+        uint64_t found_at = end < size ? foundTime() : 0;
+        if (run > limit - message_len)
+        {
+            run = limit - message_len;
+            message_truncated = true;
+
+            if (server->overflow_policy == OVERFLOW_DISCONNECT)
+            {
+                server->truncated_messages.Add();
+                rejectMessage();
+                input_closed = true;
+                disconnect();
+                return;
+            }
+        }
+
+        // a whole line inside the received data is passed without copying
+        if (end < size && message_len == 0 && Handler::TakesViews(server))
+        {
+            completeMessage<Handler>((char*)data + i, run, found_at);
+            last_term = data[end];
+            i = end + 1;
+            continue;
+        }
+
+        // copy the whole run up to the next terminator, skipping the bytes that don't fit
+        if (end > i)
+        {
+            if (run > 0 && reserveMessage(message_len + run + 1))
+            {
+                memcpy(message + message_len, data + i, run);
+                message_len += run;
+            }
+            else if (run > 0)
+                message_truncated = true;
+            last_term = data[end - 1];
+        }
+
+        if (end == size)
+            break;
+
+        // null-terminate the recieved message for easier processing
+        char* msg = terminateMessage();
+        if (msg)
+            completeMessage<Handler>(msg, message_len, found_at);
+
+        // reset the message counter
+        message_len = 0;
+        last_term = data[end];
+        i = end + 1;
+    }
+}
+
+// the length prefix gives the frame size, so the payload is not scanned - a frame inside the data
+// is passed as a view, a split one is copied into a message buffer of its whole size
+template <class Handler>
+void Connection::processFrames(const unsigned char* data, int size)
+{
+    int limit = server->max_message_size - 1;
+    int i = 0;
+    while (i < size)
+    {
+        // the prefix may be split between two receives, its value is collected in frame_left
+        if (frame_header_len != FRAME_PAYLOAD)
+        {
+            unsigned char byte = data[i++];
+            if (framing == FRAMING_LENGTH32)
+            {
+                frame_left = frame_left << 8 | byte;
+                if (++frame_header_len < 4)
+                    continue;
+            }
+            else
+            {
+                // a varint longer than 32 bits is not a length of this protocol
+                if (frame_header_len == VARINT_MAX_BYTES - 1 && (byte & 0xF0))
+                {
+                    if (server->debug_printing)
+                        printf("%d] invalid frame length\n", pos);
+                    input_closed = true;
+                    disconnect();
+                    return;
+                }
+
+                frame_left |= (uint32_t)(byte & 0x7F) << (7 * frame_header_len++);
+                if (byte & 0x80)
+                    continue;
+            }
+
+            frame_header_len = FRAME_PAYLOAD;
+            if (frame_left > (uint32_t)limit)
+            {
+                message_truncated = true;
+
+                if (server->overflow_policy == OVERFLOW_DISCONNECT)
+                {
+                    server->truncated_messages.Add();
+                    rejectMessage();
+                    input_closed = true;
+                    disconnect();
+                    return;
+                }
+            }
+
+            // a whole frame in the data goes to the handler without copying
+            if (frame_left <= (uint32_t)(size - i) && !message_truncated && Handler::TakesViews(server))
+            {
+                completeMessage<Handler>((char*)data + i, frame_left, foundTime());
+                i += frame_left;
+                frame_left = 0;
+                frame_header_len = 0;
+                continue;
+            }
+        }
+
+        // the collected part is limited, the rest of a longer frame is skipped
+        int run = frame_left < (uint32_t)(size - i) ? frame_left : size - i;
+        int left = frame_left < (uint32_t)(limit - message_len) ? frame_left : limit - message_len;
+        int take = run < left ? run : left;
+        if (take > 0 && reserveMessage(message_len + left + 1))
+        {
+            // the data received by frameTarget is already in place
+            if (data + i != message + message_len)
+                memcpy(message + message_len, data + i, take);
+            message_len += take;
+        }
+        else if (take > 0)
+            message_truncated = true;
+
+        i += run;
+        frame_left -= run;
+        if (frame_left > 0)
+            break;
+
+        char* msg = terminateMessage();
+        if (msg)
+            completeMessage<Handler>(msg, message_len, foundTime());
+
+        message_len = 0;
+        frame_header_len = 0;
+    }
+}
+
+// the response latency is measured from the end of the message found in the received data
+inline uint64_t Connection::foundTime()
+{
+    return server->track_latency ? monotonicNs() : 0;
+}
+
+// pass a complete message for processing, unless the overflow policy rejects it
+template <class Handler>
+void Connection::completeMessage(char* msg, int msg_len, uint64_t found_at)
+{
+    if (message_truncated)
+    {
+        server->truncated_messages.Add();
+        message_truncated = false;
+
+        if (server->overflow_policy == OVERFLOW_REJECT)
+        {
+            rejectMessage();
+            return;
+        }
+    }
+
+    deliverMessage<Handler>(msg, msg_len, found_at);
+}
+
+// pass a complete message to the handler
+template <class Handler>
+void Connection::deliverMessage(const char* msg, int msg_len, uint64_t found_at)
+{
+    if (server->debug_printing)
+        printf("%d> %.*s\n", pos, msg_len, msg);
+
+    // the detection time is added before the call, so an explicit flush from the handler includes it
+    uint64_t start = 0;
+    unsigned calls = send_calls;
+    if (server->track_latency)
+    {
+        addReplyTime(found_at);
+        start = monotonicNs();
+    }
+
+    Handler::Process(this, msg, msg_len);
+
+    if (server->track_latency)
+    {
+        server->handler_latency.Record(monotonicNs() - start);
+
+        // no reply to measure
+        if (send_calls == calls && reply_count > reply_sending && reply_times[reply_count - 1] == found_at)
+            reply_count--;
+    }
+}
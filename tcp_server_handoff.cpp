@@ -0,0 +1,670 @@
+#include "tcp_server.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+
+// hot upgrade - the next process connects to the Unix socket of the running one and gets its
+// listening sockets as SCM_RIGHTS, so the pending connections stay in the shared backlog while the
+// processes swap. The live connections follow one record each with their partial message (IO_EPOLL),
+// or stay with the old process until they finish or the drain timeout passes
+
+#define HANDOFF_MAGIC 0x33484345    //"ECH3"
+#define HANDOFF_MAX_FDS 64
+
+enum HandoffRecordType
+{
+    HANDOFF_LISTENERS,      //up to HANDOFF_MAX_FDS listening sockets attached, their framings follow the record
+    HANDOFF_CONNECTION,     //a client socket attached, its partial message follows the record
+    HANDOFF_READY,          //from the next process once its engines run, whether it takes the connections
+    HANDOFF_END,
+};
+
+struct HandoffRecord
+{
+    uint32_t magic;
+    int type;
+    int fd_count;
+    int admin_index;        //the admin listener among the listening sockets, -1 - not passed
+    in6_addr remote_ip;
+    uint16_t remote_port;
+    char last_term;
+    bool message_truncated;
+    bool more;              //more listening sockets follow in the next record
+    bool takes_connections; //the next process serves with the reactors, which can take them while running
+    uint8_t framing;
+    uint8_t frame_header_len;
+    uint32_t frame_left;
+    uint32_t zerocopy_seq;
+    uint64_t message_count;
+    int message_len;
+};
+
+static bool unixAddress(const char *path, sockaddr_un &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "handoff path too long\n");
+        return false;
+    }
+
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+// the blocking calls on the other process are limited, so a stuck peer doesn't stop the upgrade
+static void setHandoffTimeouts(int sock)
+{
+    timeval tv;
+    tv.tv_sec = HANDOFF_TIMEOUT_MS / 1000;
+    tv.tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) || setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+        perror("can't set handoff socket timeouts");
+}
+
+static bool setBlockingMode(int sock, bool non_blocking)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, non_blocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK))
+    {
+        perror("can't set socket flag O_NONBLOCK");
+        return false;
+    }
+    return true;
+}
+
+static bool sendAll(int sock, const char *data, int size)
+{
+    while (size > 0)
+    {
+        ssize_t sz = send(sock, data, size, MSG_NOSIGNAL);
+        if (sz < 0 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            return false;
+
+        data += sz;
+        size -= sz;
+    }
+    return true;
+}
+
+static bool recvAll(int sock, char *data, int size)
+{
+    while (size > 0)
+    {
+        ssize_t sz = recv(sock, data, size, 0);
+        if (sz < 0 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            return false;
+
+        data += sz;
+        size -= sz;
+    }
+    return true;
+}
+
+// the descriptors travel with the first byte of the record
+static bool sendRecord(int sock, HandoffRecord &rec, const int *fds, int fd_count, const void *data, int size)
+{
+    rec.magic = HANDOFF_MAGIC;
+    rec.fd_count = fd_count;
+
+    iovec iov[2];
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size > 0 ? 2 : 1;
+    if (fd_count > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    ssize_t sz;
+    do
+        sz = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    while (sz < 0 && errno == EINTR);
+    if (sz <= 0)
+    {
+        perror("can't send handoff record");
+        return false;
+    }
+
+    // the rest of a partial send goes without the descriptors
+    int header_left = sz < (ssize_t)sizeof(rec) ? sizeof(rec) - sz : 0;
+    int data_sent = sz > (ssize_t)sizeof(rec) ? sz - sizeof(rec) : 0;
+    if (!sendAll(sock, (const char *)&rec + sizeof(rec) - header_left, header_left) ||
+        !sendAll(sock, (const char *)data + data_sent, size - data_sent))
+    {
+        perror("can't send handoff record");
+        return false;
+    }
+
+    return true;
+}
+
+// the received descriptors, -1 if the record is not there
+static int recvRecord(int sock, HandoffRecord &rec, int *fds, int max_fds)
+{
+    iovec iov;
+    iov.iov_base = &rec;
+    iov.iov_len = sizeof(rec);
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t sz;
+    do
+        sz = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    while (sz < 0 && errno == EINTR);
+    if (sz <= 0)
+        return -1;
+
+    int fd_count = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++)
+        {
+            if (fd_count < max_fds)
+                fds[fd_count++] = received[i];
+            else
+                close(received[i]);
+        }
+    }
+
+    if (!recvAll(sock, (char *)&rec + sz, sizeof(rec) - sz) || rec.magic != HANDOFF_MAGIC)
+    {
+        fprintf(stderr, "invalid handoff record\n");
+        for (int i = 0; i < fd_count; i++)
+            close(fds[i]);
+        return -1;
+    }
+
+    return fd_count;
+}
+
+static bool sameEndpoint(int sock, const sockaddr_storage &endpoint, socklen_t len)
+{
+    sockaddr_storage other;
+    socklen_t other_len = sizeof(other);
+    return !getsockname(sock, (sockaddr *)&other, &other_len) && other_len == len && !memcmp(&other, &endpoint, len);
+}
+
+// take over the endpoints of the process waiting at handoff_path, without such process
+// the endpoints are left as they are and the caller sets them up
+bool TCPServer::SetupHandoff()
+{
+    if (running || !handoff_path)
+        return false;
+
+    sockaddr_un un_addr;
+    if (!unixAddress(handoff_path, un_addr))
+        return false;
+
+    int peer = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (peer == -1)
+    {
+        perror("can't create handoff socket");
+        return false;
+    }
+
+    // no previous process, a cold start
+    if (connect(peer, (sockaddr *)&un_addr, sizeof(un_addr)))
+    {
+        if (debug_printing)
+            printf("no process to take over at %s\n", handoff_path);
+        close(peer);
+        return true;
+    }
+    setHandoffTimeouts(peer);
+
+    // the listening sockets come in records of HANDOFF_MAX_FDS with their framings
+    int *fds = NULL;
+    uint8_t *framings = NULL;
+    int fd_count = 0;
+    int admin_index = -1;
+    HandoffRecord rec;
+    do
+    {
+        int *new_fds = (int *)realloc(fds, (fd_count + HANDOFF_MAX_FDS) * sizeof(int));
+        if (new_fds)
+            fds = new_fds;
+        uint8_t *new_framings = new_fds ? (uint8_t *)realloc(framings, fd_count + HANDOFF_MAX_FDS) : NULL;
+        if (new_framings)
+            framings = new_framings;
+
+        int count = new_framings ? recvRecord(peer, rec, fds + fd_count, HANDOFF_MAX_FDS) : -1;
+        if (count < 0 || rec.type != HANDOFF_LISTENERS || !recvAll(peer, (char *)framings + fd_count, count))
+        {
+            fprintf(stderr, "can't receive the listening sockets\n");
+            for (int i = 0; i < fd_count + (count > 0 ? count : 0); i++)
+                close(fds[i]);
+            free(fds);
+            free(framings);
+            close(peer);
+            return false;
+        }
+
+        if (rec.admin_index >= 0 && rec.admin_index < count)
+            admin_index = fd_count + rec.admin_index;
+        fd_count += count;
+    } while (rec.more);
+
+    if (handoff_peer != -1)
+        close(handoff_peer);
+    handoff_peer = peer;
+
+    bool taken = takeListeners(fds, framings, fd_count, admin_index);
+    free(fds);
+    free(framings);
+    return taken;
+}
+
+// the received sockets replace the endpoints set up by the caller
+bool TCPServer::takeListeners(int *fds, uint8_t *framings, int fd_count, int admin_index)
+{
+    // the admin socket is kept for startAdmin if this server serves the same port
+    if (admin_index >= 0)
+    {
+        int admin_sock = fds[admin_index];
+        fds[admin_index] = fds[--fd_count];
+        framings[admin_index] = framings[fd_count];
+
+        sockaddr_storage endpoint;
+        socklen_t len = sizeof(endpoint);
+        admin_listener.closeSocket();
+        if (!getsockname(admin_sock, (sockaddr *)&endpoint, &len) && admin_listener.setEndpoint((sockaddr *)&endpoint, len) &&
+            admin_listener.family != AF_UNIX && admin_listener.port == admin_port)
+            admin_listener.sock = admin_sock;
+        else
+            close(admin_sock);
+    }
+
+    // the previous process had all its listeners closed at the connection limit
+    if (fd_count == 0)
+        return true;
+
+    // the sockets keep the endpoints, shards and steering program of the previous process,
+    // the shards of an endpoint come one after another
+    closeListeners();
+    int first = 0;
+    while (first < fd_count)
+    {
+        sockaddr_storage endpoint;
+        socklen_t len = sizeof(endpoint);
+        if (getsockname(fds[first], (sockaddr *)&endpoint, &len))
+        {
+            perror("can't get the listening socket address");
+            break;
+        }
+
+        int count = 1;
+        while (first + count < fd_count && sameEndpoint(fds[first + count], endpoint, len))
+            count++;
+
+        Listener *group = addListeners(count, (sockaddr *)&endpoint, len);
+        if (!group)
+            break;
+
+        for (int i = 0; i < count; i++)
+        {
+            int optval = 0;
+            socklen_t optlen = sizeof(optval);
+            if (group[i].family == AF_INET6 && !getsockopt(fds[first + i], IPPROTO_IPV6, IPV6_V6ONLY, &optval, &optlen))
+                group[i].v6only = optval != 0;
+            group[i].sock = fds[first + i];
+            group[i].framing = (Framing)framings[first + i];
+        }
+        first += count;
+    }
+
+    if (first < fd_count)
+    {
+        for (int i = first; i < fd_count; i++)
+            close(fds[i]);
+        return false;
+    }
+
+    if (debug_printing)
+        printf("took over %d listening sockets\n", fd_count);
+
+    return true;
+}
+
+// Unix socket waiting for the next process, its path is taken over from the previous one
+bool TCPServer::startHandoff()
+{
+    sockaddr_un un_addr;
+    if (!unixAddress(handoff_path, un_addr))
+        return false;
+
+    handoff_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_sock == -1)
+    {
+        perror("can't create handoff socket");
+        return false;
+    }
+
+    unlink(handoff_path);
+    if (bind(handoff_sock, (sockaddr *)&un_addr, sizeof(un_addr)) || listen(handoff_sock, 1))
+    {
+        perror("can't listen on the handoff socket");
+        close(handoff_sock);
+        handoff_sock = -1;
+        return false;
+    }
+
+    if (pthread_create(&handoff_thread, NULL, handoffLoop, this))
+    {
+        perror("can't run handoff thread");
+        close(handoff_sock);
+        handoff_sock = -1;
+        handoff_thread = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// handoff thread, passes the listening sockets to the first process taking them
+void *TCPServer::handoffLoop(void *param)
+{
+    auto server = (TCPServer *)param;
+
+    while (server->running && !server->handing_off)
+    {
+        if (!pollForRead(server->handoff_sock, POLL_TIMEOUT_MS))
+            continue;
+
+        int peer = accept4(server->handoff_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (peer < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("can't accept handoff");
+            continue;
+        }
+
+        // a failed handoff leaves this process serving
+        setHandoffTimeouts(peer);
+        if (!server->sendListeners(peer))
+            close(peer);
+    }
+
+    close(server->handoff_sock);
+    server->handoff_sock = -1;
+
+    // the next process has bound the path again
+    if (!server->handing_off)
+        unlink(server->handoff_path);
+
+    return NULL;
+}
+
+// the listeners stop accepting once their sockets are passed, the sockets closed at
+// the connection limit are not passed and not reopened
+bool TCPServer::sendListeners(int peer)
+{
+    int *fds = (int *)malloc((listener_count + 1) * (sizeof(int) + 1));
+    if (!fds)
+    {
+        perror("can't allocate the handoff descriptors");
+        return false;
+    }
+    uint8_t *framings = (uint8_t *)(fds + listener_count + 1);
+    int fd_count = 0;
+
+    pthread_mutex_lock(&handoff_lock);
+    for (int i = 0; i < listener_count; i++)
+        if (!listeners[i].isSocketClosed())
+        {
+            framings[fd_count] = listeners[i].framing;
+            fds[fd_count++] = listeners[i].sock;
+        }
+
+    int admin_index = -1;
+    if (!admin_listener.isSocketClosed())
+    {
+        admin_index = fd_count;
+        framings[fd_count] = FRAMING_LINES;
+        fds[fd_count++] = admin_listener.sock;
+    }
+
+    // the descriptors of one record are limited, the rest follow in the next ones
+    bool sent = true;
+    for (int first = 0; sent && (first == 0 || first < fd_count); first += HANDOFF_MAX_FDS)
+    {
+        int count = fd_count - first < HANDOFF_MAX_FDS ? fd_count - first : HANDOFF_MAX_FDS;
+
+        HandoffRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = HANDOFF_LISTENERS;
+        rec.admin_index = admin_index >= first && admin_index < first + count ? admin_index - first : -1;
+        rec.more = first + count < fd_count;
+        sent = sendRecord(peer, rec, fds + first, count, framings + first, count);
+    }
+    if (sent)
+    {
+        handoff_peer = peer;
+        handing_off = true;
+    }
+    pthread_mutex_unlock(&handoff_lock);
+    free(fds);
+
+    if (!sent)
+        return false;
+
+    for (int i = 0; i < listener_count; i++)
+        listeners[i].wakeup();
+
+    if (debug_printing)
+        printf("passed %d listening sockets\n", fd_count);
+
+    return true;
+}
+
+// called by the server thread after the listeners have stopped - the reactors are stopped, so their
+// connections keep the state to pass. The blocking threads, io_uring operations and the handlers
+// in flight can't be taken over, those connections are drained by this process
+void TCPServer::handOffConnections()
+{
+    // the next process tells its engine once it has started, the connections are drained when it
+    // can't take them or doesn't answer in time
+    bool passing = handoff_connections && io_mode == IO_EPOLL && !ProcessMessageAsyncPtr;
+    if (passing)
+    {
+        HandoffRecord ready;
+        passing = recvRecord(handoff_peer, ready, NULL, 0) == 0 && ready.type == HANDOFF_READY && ready.takes_connections;
+        if (!passing && debug_printing)
+            printf("the next process doesn't take the connections\n");
+    }
+
+    if (passing)
+    {
+        stopReactors();
+
+        // one wait for all the output, a slow peer takes it from the connections after it
+        uint64_t deadline = monotonicNs() + HANDOFF_TIMEOUT_MS * 1'000'000ULL;
+        int pos = connections_list.Head();
+        while (pos != -1)
+        {
+            int next = connections_list.Next(pos);
+            Connection *conn = connections.At(pos);
+
+            if (handOffConnection(conn, deadline))
+                handoffs_out.Add();
+
+            closeClientSocket(conn);
+            connectionComplete(conn);
+            conn->running = false;
+            pos = next;
+        }
+    }
+
+    HandoffRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_END;
+    sendRecord(handoff_peer, rec, NULL, 0, NULL, 0);
+
+    close(handoff_peer);
+    handoff_peer = -1;
+}
+
+// the unsent output is flushed first, the next process continues with the partial message -
+// a connection with output left at the deadline is closed
+bool TCPServer::handOffConnection(Connection *conn, uint64_t deadline)
+{
+    // the timeout thread must not shut the passed socket down
+    timeouts.Cancel(conn->pos);
+
+    while (conn->out_sent < conn->out_sending.len)
+    {
+        if (!conn->drainOutput())
+            return false;
+        if (conn->out_sent == conn->out_sending.len)
+            break;
+
+        uint64_t now = monotonicNs();
+        if (now >= deadline || !pollForWrite(conn->socket, (deadline - now + 999'999) / 1'000'000))
+            return false;
+    }
+
+    // closing by the overflow policy or the close command
+    if (conn->input_closed || conn->disconnect_pending)
+        return false;
+
+    HandoffRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_CONNECTION;
+    rec.remote_ip = conn->remote_ip;
+    rec.remote_port = conn->remote_port;
+    rec.last_term = conn->last_term;
+    rec.message_truncated = conn->message_truncated;
+    rec.framing = conn->framing;
+    rec.frame_header_len = conn->frame_header_len;
+    rec.frame_left = conn->frame_left;
+    rec.message_count = conn->message_count;
+    rec.message_len = conn->message_len;
+
+    // the next process continues the numbering of the zero-copy sends and reads their notifications
+    rec.zerocopy_seq = conn->zerocopy ? conn->zerocopy->next_seq : 0;
+    conn->finishZerocopy(true);
+
+    if (!sendRecord(handoff_peer, rec, &conn->socket, 1, conn->message, conn->message_len))
+        return false;
+
+    if (debug_printing)
+        printf("%d] handed off\n", conn->pos);
+
+    return true;
+}
+
+// called by Start with the engines running, the listeners accept meanwhile - only the reactors
+// take a connection from another thread, the io_uring thread owns its submission queue
+void TCPServer::receiveConnections()
+{
+    unsigned char *data = NULL;
+    int data_cap = 0;
+    int next_listener = 0;
+
+    HandoffRecord ready;
+    memset(&ready, 0, sizeof(ready));
+    ready.type = HANDOFF_READY;
+    ready.takes_connections = io_mode == IO_EPOLL;
+    sendRecord(handoff_peer, ready, NULL, 0, NULL, 0);
+
+    while (true)
+    {
+        HandoffRecord rec;
+        int fd = -1;
+        int fd_count = recvRecord(handoff_peer, rec, &fd, 1);
+        if (fd_count < 0 || rec.type == HANDOFF_END)
+            break;
+
+        if (rec.type != HANDOFF_CONNECTION || fd_count != 1 || rec.message_len < 0 || rec.message_len > POOL_MAX_SIZE)
+        {
+            fprintf(stderr, "invalid handoff record\n");
+            if (fd_count > 0)
+                close(fd);
+            break;
+        }
+
+        if (rec.message_len > 0 &&
+            (!buffer_pool.Grow(data, data_cap, rec.message_len, 0) || !recvAll(handoff_peer, (char *)data, rec.message_len)))
+        {
+            fprintf(stderr, "can't receive the partial message\n");
+            close(fd);
+            break;
+        }
+
+        // the listener with a free slot takes the connection
+        Listener *listener = NULL;
+        for (int i = 0; i < listener_count && !listener; i++)
+        {
+            Listener *candidate = &listeners[(next_listener + i) % listener_count];
+            if (!candidate->atCapacity())
+                listener = candidate;
+        }
+        next_listener++;
+
+        // the reactors need non-blocking sockets
+        if (!listener || !ready.takes_connections || !setBlockingMode(fd, true))
+        {
+            close(fd);
+            continue;
+        }
+
+        // the address is kept as it was, mapped IPv4 or unspecified for a Unix socket peer
+        sockaddr_in6 client_addr;
+        memset(&client_addr, 0, sizeof(client_addr));
+        client_addr.sin6_family = AF_INET6;
+        client_addr.sin6_addr = rec.remote_ip;
+        client_addr.sin6_port = htons(rec.remote_port);
+
+        // a message over the limit of this process continues truncated
+        HandoffState state;
+        state.message_count = rec.message_count;
+        state.message = data;
+        state.message_len = rec.message_len < max_message_size ? rec.message_len : max_message_size - 1;
+        state.last_term = rec.last_term;
+        state.message_truncated = rec.message_truncated || state.message_len < rec.message_len;
+        state.framing = (Framing)rec.framing;
+        state.frame_header_len = rec.frame_header_len;
+        state.frame_left = rec.frame_left;
+        state.zerocopy_seq = rec.zerocopy_seq;
+        setupClient(listener, fd, (sockaddr *)&client_addr, &state);
+    }
+
+    buffer_pool.Free(data, data_cap);
+    close(handoff_peer);
+    handoff_peer = -1;
+}
+
+bool TCPServer::drainExpired(uint64_t deadline)
+{
+    return !running || connections_list.Count() == 0 || monotonicNs() >= deadline;
+}
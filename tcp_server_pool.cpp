@@ -0,0 +1,149 @@
+#include "tcp_server.h"
+#include <limits.h>
+
+// worker thread, serves the queued connections one after another
+void *WorkerPool::workerLoop(void *param)
+{
+    WorkerPool *pool = (WorkerPool *)param;
+
+    Connection *conn;
+    while ((conn = pool->pop()) != NULL)
+        Connection::clientLoop(conn);
+
+    return NULL;
+}
+
+// the queue has room for all connection slots, so the push fails only when stopping
+bool WorkerPool::push(Connection *conn)
+{
+    pthread_mutex_lock(&queue_lock);
+
+    if (!running || queue_len == queue_cap)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        return false;
+    }
+
+    queue[(queue_head + queue_len) % queue_cap] = conn;
+    queue_len++;
+    __atomic_store_n(&server->worker_queue_depth, queue_len, __ATOMIC_RELAXED);
+
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+// wait for the next connection, NULL when the pool is stopped
+Connection *WorkerPool::pop()
+{
+    pthread_mutex_lock(&queue_lock);
+
+    while (queue_len == 0 && running)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+
+    Connection *conn = NULL;
+    if (queue_len > 0)
+    {
+        conn = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_cap;
+        queue_len--;
+        __atomic_store_n(&server->worker_queue_depth, queue_len, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+    return conn;
+}
+
+bool WorkerPool::start(int threads, int queue_size)
+{
+    queue = (Connection **)malloc(queue_size * sizeof(Connection *));
+    this->threads = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    if (!queue || !this->threads)
+    {
+        perror("can't allocate worker pool");
+        return false;
+    }
+
+    queue_cap = queue_size;
+    queue_head = queue_len = 0;
+    running = true;
+
+    for (thread_count = 0; thread_count < threads; thread_count++)
+        if (!server->createThread(&this->threads[thread_count], workerLoop, this))
+        {
+            perror("can't run worker thread");
+            return false;
+        }
+
+    return true;
+}
+
+// the workers finish the queued connections before exiting
+void WorkerPool::stopAndWait()
+{
+    pthread_mutex_lock(&queue_lock);
+    running = false;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        void *retVal;
+        pthread_join(threads[i], &retVal);
+    }
+
+    free(threads);
+    free(queue);
+    threads = NULL;
+    queue = NULL;
+    thread_count = queue_cap = 0;
+}
+
+int TCPServer::poolThreads()
+{
+    int threads = pool_threads > 0 ? pool_threads : POOL_THREADS_PER_CPU * sysconf(_SC_NPROCESSORS_ONLN);
+    return threads > 0 ? threads : 1;
+}
+
+// the connections are admitted up to the worker count (splitCapacity), so the queue holds only
+// the ones accepted before their worker took the next one
+bool TCPServer::startPool()
+{
+    int threads = poolThreads();
+
+    pool = new WorkerPool();
+    pool->server = this;
+
+    if (!pool->start(threads, max_connections))
+    {
+        stopPool();
+        return false;
+    }
+
+    if (debug_printing)
+        printf("started %d worker threads\n", threads);
+
+    return true;
+}
+
+void TCPServer::stopPool()
+{
+    pool->stopAndWait();
+    delete pool;
+    pool = NULL;
+    __atomic_store_n(&worker_queue_depth, 0, __ATOMIC_RELAXED);
+}
+
+// thread with the configured stack size
+bool TCPServer::createThread(pthread_t *thread, void *(*proc)(void *), void *param)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (thread_stack_size > 0)
+        pthread_attr_setstacksize(&attr, thread_stack_size > (size_t)PTHREAD_STACK_MIN ? thread_stack_size : (size_t)PTHREAD_STACK_MIN);
+
+    int result = pthread_create(thread, &attr, proc, param);
+    pthread_attr_destroy(&attr);
+    return result == 0;
+}
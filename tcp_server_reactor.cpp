@@ -0,0 +1,297 @@
+#include "tcp_server.h"
+#include "tcp_server_async.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// reactor thread, serving all connections registered in its epoll instance
+void *Reactor::reactorLoop(void *param)
+{
+    Reactor *reactor = (Reactor *)param;
+    epoll_event events[REACTOR_MAX_EVENTS];
+    unsigned char *recv_buf = reactor->recv_buf;
+
+    while (reactor->running)
+    {
+        // the sleeping handlers limit the wait
+        int count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, reactor->timerTimeout());
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("epoll wait");
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            // the wakeup event has no connection attached, it comes with the work returned by the offload threads
+            if (events[i].data.ptr == NULL)
+            {
+                reactor->runReady();
+                continue;
+            }
+
+            // a descriptor awaited by a handler, the request may have been cancelled in this batch
+            if ((uintptr_t)events[i].data.ptr & 1)
+            {
+                AsyncRequest *req = (AsyncRequest *)((uintptr_t)events[i].data.ptr & ~(uintptr_t)1);
+                if (req->waiting == WAIT_POLL)
+                    reactor->completePoll(req, events[i].events);
+                continue;
+            }
+
+            Connection *conn = (Connection *)events[i].data.ptr;
+
+            // the zero-copy completions come to the error queue, raising EPOLLERR
+            if ((events[i].events & EPOLLERR) && conn->zerocopy)
+                conn->reapZerocopy();
+
+            if ((events[i].events & EPOLLOUT) && conn->queuedOutput() > 0)
+            {
+                if (!conn->drainOutput())
+                {
+                    reactor->closeConnection(conn);
+                    continue;
+                }
+
+                // the data that arrived while paused doesn't raise a new edge, so it is read now
+                if (!conn->read_paused)
+                {
+                    reactor->readConnection(conn, recv_buf);
+                    continue;
+                }
+            }
+
+            // a paused connection is read only to notice the hang-up
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) || ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && !conn->read_paused))
+                reactor->readConnection(conn, recv_buf);
+        }
+
+        reactor->runTimers();
+        reactor->releaseRequests();
+    }
+
+    return NULL;
+}
+
+// edge-triggered mode - read everything available until the socket would block
+void Reactor::readConnection(Connection *conn, unsigned char *recv_buf)
+{
+    while (true)
+    {
+        // the raw echo keeps the data in the kernel while no output is queued,
+        // the rest of a longer frame goes straight into its message buffer
+        unsigned char *recv_to = NULL;
+        int recv_sz;
+        bool spliced = conn->framing == FRAMING_RAW_ECHO && conn->queuedOutput() == 0;
+        if (spliced)
+            recv_sz = conn->spliceEcho();
+        else
+        {
+            int recv_cap;
+            recv_to = conn->frameTarget(recv_cap);
+            if (!recv_to)
+            {
+                recv_to = recv_buf;
+                recv_cap = RECV_BUF_SIZE;
+            }
+
+            recv_sz = recv(conn->socket, recv_to, recv_cap, MSG_NOSIGNAL);
+        }
+
+        if (recv_sz == 0)
+        {
+            // disconnected
+            char addr[INET6_ADDRSTRLEN];
+            if (server->debug_printing)
+                printf("%d] disconnected %s:%d\n", conn->pos, conn->remoteAddress(addr), conn->remote_port);
+
+            closeConnection(conn);
+            return;
+        }
+
+        if (recv_sz < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+
+            perror(spliced ? "socket splice" : "socket receive");
+            closeConnection(conn);
+            return;
+        }
+
+        if (!spliced)
+            conn->processData(recv_to, recv_sz);
+
+        // the rest stays in the socket until the output queue drains
+        if (conn->read_paused)
+            return;
+    }
+}
+
+void Reactor::closeConnection(Connection *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+
+    // the socket is kept while handlers are in flight, so its descriptor isn't reused for another client
+    if (conn->async_count > 0)
+    {
+        if (!conn->async_closing)
+            conn->cancelRequests();
+        if (conn->async_count > 0)
+            return;
+    }
+    conn->async_closing = false;
+
+    server->closeClientSocket(conn);
+
+    server->connectionComplete(conn);
+    conn->running = false;
+}
+
+bool Reactor::addConnection(Connection *conn)
+{
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev))
+    {
+        perror("can't add connection to epoll");
+        return false;
+    }
+
+    return true;
+}
+
+bool Reactor::start()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        perror("can't create epoll instance");
+        return false;
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1)
+    {
+        perror("can't create eventfd");
+        close(epoll_fd);
+        epoll_fd = -1;
+        return false;
+    }
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev))
+    {
+        perror("can't add eventfd to epoll");
+        close(wakeup_fd);
+        close(epoll_fd);
+        wakeup_fd = epoll_fd = -1;
+        return false;
+    }
+
+    running = true;
+    if (pthread_create(&reactor_thread, NULL, reactorLoop, this))
+    {
+        perror("can't run reactor thread");
+        running = false;
+        close(wakeup_fd);
+        close(epoll_fd);
+        wakeup_fd = epoll_fd = -1;
+        return false;
+    }
+
+    // reactor N serves the connections of the listener steered to CPU N
+    if (server->cpu_steering != STEER_NONE)
+    {
+        int cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % (cpu_count > 0 ? cpu_count : 1), &cpus);
+        pthread_setaffinity_np(reactor_thread, sizeof(cpus), &cpus);
+    }
+
+    return true;
+}
+
+void Reactor::stopAndWait()
+{
+    if (!running)
+        return;
+
+    running = false;
+    uint64_t value = 1;
+    if (write(wakeup_fd, &value, sizeof(value)) < 0)
+        perror("can't wake up reactor");
+
+    void *retVal;
+    pthread_join(reactor_thread, &retVal);
+
+    close(wakeup_fd);
+    close(epoll_fd);
+    wakeup_fd = epoll_fd = -1;
+
+    releaseRequests();
+    while (free_requests)
+    {
+        AsyncRequest *req = free_requests;
+        free_requests = req->next;
+        delete req;
+    }
+    free(timers);
+    timers = NULL;
+    timer_count = timer_cap = 0;
+}
+
+bool TCPServer::startReactors()
+{
+    reactor_count = reactor_threads > 0 ? reactor_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (reactor_count < 1)
+        reactor_count = 1;
+
+    reactors = new Reactor[reactor_count];
+    next_reactor = 0;
+
+    for (int i = 0; i < reactor_count; i++)
+    {
+        reactors[i].index = i;
+        reactors[i].server = this;
+        if (!reactors[i].start())
+        {
+            reactor_count = i;
+            stopReactors();
+            return false;
+        }
+    }
+
+    if (ProcessMessageAsyncPtr && !startOffload())
+    {
+        stopReactors();
+        return false;
+    }
+
+    if (debug_printing)
+        printf("started %d reactor threads\n", reactor_count);
+
+    return true;
+}
+
+void TCPServer::stopReactors()
+{
+    // the connections are closed, so no offloaded work is left
+    stopOffload();
+
+    for (int i = 0; i < reactor_count; i++)
+        reactors[i].stopAndWait();
+
+    delete[] reactors;
+    reactors = NULL;
+    reactor_count = 0;
+}
@@ -1,11 +1,14 @@
 #include <gtest/gtest.h>
-#include "tcp_server.h"
+#include "typed_server.h"
+#include "command_table.h"
+#include "echo_handler.h"
+#include "tcp_server_async.h"
 
 #define TEST_TCP_PORT 2122
 
 TCPServer server;
 
-void simpleEchoMessage(Connection *conn, char *message, int message_len)
+void simpleEchoMessage(Connection *conn, char *message, int)
 {
     conn->sendMessage("%s\n", message);
 }
@@ -121,11 +124,6 @@ TEST(TCPServer, ConcurrentConnections)
 
     usleep(100'000);
 
-    // set socket timeout
-    timeval timeout;
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
-
     sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(TEST_TCP_PORT);
@@ -338,4 +336,1992 @@ TEST(TCPServer, ConnectionsOpenClose)
 
     server.Stop();
     server.WaitServer();
-}
\ No newline at end of file
+}
+
+int connectTestClient()
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    // set socket timeout
+    timeval timeout;
+    timeout.tv_sec = 2;
+    timeout.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(TEST_TCP_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+
+    if (connect(sockfd, (sockaddr *)&server_addr, sizeof(server_addr)))
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// receive exactly len bytes, or fail on timeout
+bool recvExact(int sockfd, char *buf, int len)
+{
+    int recv_bytes = 0;
+    while (recv_bytes < len)
+    {
+        int bytes = recv(sockfd, buf + recv_bytes, len - recv_bytes, 0);
+        if (bytes <= 0)
+            return false;
+        recv_bytes += bytes;
+    }
+    buf[recv_bytes] = 0;
+    return true;
+}
+
+TEST(TCPServer, EpollEchoTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.reactor_threads = 2;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    const int count = 20;
+    int sockfd[count];
+    for (int i = 0; i < count; i++)
+        ASSERT_NE(sockfd[i] = connectTestClient(), -1);
+
+    char message[200];
+    char recv_buf[200];
+    for (int i = 0; i < count; i++)
+    {
+        // several lines in one segment, with a <CR><LF> split between two sends
+        sprintf(message, "first #%d\r\nsecond #%d\r", i, i);
+        ASSERT_EQ(send(sockfd[i], message, strlen(message), 0), strlen(message));
+        ASSERT_EQ(send(sockfd[i], "\nthird\n", 7, 0), 7);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(message, "first #%d\nsecond #%d\nthird\n", i, i);
+        ASSERT_TRUE(recvExact(sockfd[i], recv_buf, strlen(message)));
+        EXPECT_STREQ(recv_buf, message);
+    }
+
+    EXPECT_EQ(server.getConnectionCount(), count);
+    for (int i = 0; i < count; i++)
+        close(sockfd[i]);
+
+    usleep(100'000);
+    EXPECT_EQ(server.getConnectionCount(), 0);
+
+    server.Stop();
+    server.WaitServer();
+    server.io_mode = IO_THREADED;
+}
+
+TEST(TCPServer, EpollServerStopClosesConnections)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.reactor_threads = 0;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+    ASSERT_EQ(send(sockfd, "hello\n", 6, 0), 6);
+
+    char recv_buf[200];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 6));
+    EXPECT_STREQ(recv_buf, "hello\n");
+
+    server.Stop();
+    server.WaitServer();
+    server.io_mode = IO_THREADED;
+
+    EXPECT_EQ(recv(sockfd, recv_buf, sizeof(recv_buf), 0), 0);
+    close(sockfd);
+}
+
+TEST(TCPServer, UringEchoTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_URING;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    const int count = 20;
+    int sockfd[count];
+    for (int i = 0; i < count; i++)
+        ASSERT_NE(sockfd[i] = connectTestClient(), -1);
+
+    char message[200];
+    char recv_buf[200];
+    for (int i = 0; i < count; i++)
+    {
+        // several lines in one segment, with a <CR><LF> split between two sends
+        sprintf(message, "first #%d\r\nsecond #%d\r", i, i);
+        ASSERT_EQ(send(sockfd[i], message, strlen(message), 0), strlen(message));
+        ASSERT_EQ(send(sockfd[i], "\nthird\n", 7, 0), 7);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(message, "first #%d\nsecond #%d\nthird\n", i, i);
+        ASSERT_TRUE(recvExact(sockfd[i], recv_buf, strlen(message)));
+        EXPECT_STREQ(recv_buf, message);
+    }
+
+    EXPECT_EQ(server.getConnectionCount(), count);
+    close(sockfd[0]);
+    usleep(100'000);
+    EXPECT_EQ(server.getConnectionCount(), count - 1);
+
+    server.Stop();
+    server.WaitServer();
+    server.io_mode = IO_THREADED;
+
+    //ensure all connections are closed
+    for (int i = 1; i < count; i++)
+    {
+        EXPECT_EQ(recv(sockfd[i], recv_buf, sizeof(recv_buf), 0), 0);
+        close(sockfd[i]);
+    }
+}
+
+TEST(TCPServer, ShardedListenersTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.listener_shards = 4;
+    server.cpu_steering = STEER_BPF;
+    ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    const int count = 20;
+    int sockfd[count];
+    for (int i = 0; i < count; i++)
+        ASSERT_NE(sockfd[i] = connectTestClient(), -1);
+
+    char message[200];
+    char recv_buf[200];
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(message, "test message #%d\n", i);
+        ASSERT_EQ(send(sockfd[i], message, strlen(message), 0), strlen(message));
+        ASSERT_TRUE(recvExact(sockfd[i], recv_buf, strlen(message)));
+        EXPECT_STREQ(recv_buf, message);
+    }
+
+    EXPECT_EQ(server.getConnectionCount(), count);
+
+    server.Stop();
+    server.WaitServer();
+    server.io_mode = IO_THREADED;
+    server.listener_shards = 1;
+    server.cpu_steering = STEER_NONE;
+
+    //ensure all connections are closed
+    for (int i = 0; i < count; i++)
+    {
+        EXPECT_EQ(recv(sockfd[i], recv_buf, sizeof(recv_buf), 0), 0);
+        close(sockfd[i]);
+    }
+}
+
+TEST(TCPServer, RuntimeConnectionLimit)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.max_connections = 3;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd[3];
+    for (int i = 0; i < 3; i++)
+        ASSERT_NE(sockfd[i] = connectTestClient(), -1);
+
+    // the listening socket is closed at the limit
+    usleep(200'000);
+    EXPECT_EQ(server.getConnectionCount(), 3);
+    EXPECT_EQ(connectTestClient(), -1);
+
+    // and reopened as soon as a slot is free
+    close(sockfd[0]);
+    usleep(100'000);
+    sockfd[0] = connectTestClient();
+    ASSERT_NE(sockfd[0], -1);
+
+    char recv_buf[200];
+    ASSERT_EQ(send(sockfd[0], "hello\n", 6, 0), 6);
+    ASSERT_TRUE(recvExact(sockfd[0], recv_buf, 6));
+    EXPECT_STREQ(recv_buf, "hello\n");
+
+    for (int i = 0; i < 3; i++)
+        close(sockfd[i]);
+
+    server.Stop();
+    server.WaitServer();
+    server.max_connections = MAX_ACTIVE_CONNECTIONS;
+}
+
+// a steered shard at its limit stays open and closes the clients it gets, so the steering program
+// keeps indexing the reuseport group in the shard order
+TEST(TCPServer, SteeredShardLimitTest)
+{
+    // the loopback connections of a thread on CPU 0 are received on CPU 0, so they all go to shard 0
+    cpu_set_t saved_cpus;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    pthread_getaffinity_np(pthread_self(), sizeof(saved_cpus), &saved_cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    IOMode modes[] = {IO_THREADED, IO_EPOLL};
+    for (IOMode mode : modes)
+    {
+        server.ProcessMessagePtr = &simpleEchoMessage;
+        server.io_mode = mode;
+        server.listener_shards = 2;
+        server.cpu_steering = STEER_BPF;
+        server.max_connections = 4;
+        ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        char recv_buf[200];
+        int sockfd[2];
+        for (int i = 0; i < 2; i++)
+        {
+            ASSERT_NE(sockfd[i] = connectTestClient(), -1);
+            ASSERT_EQ(send(sockfd[i], "hello\n", 6, 0), 6);
+            ASSERT_TRUE(recvExact(sockfd[i], recv_buf, 6));
+        }
+
+        // shard 0 is full while shard 1 has room, the next client is closed without closing the shard
+        int rejected = connectTestClient();
+        ASSERT_NE(rejected, -1);
+        EXPECT_EQ(recv(rejected, recv_buf, sizeof(recv_buf), 0), 0);
+        close(rejected);
+        EXPECT_EQ(server.getRejectedCount(), 1u);
+        EXPECT_EQ(server.getListenerCloseCount(), 0u);
+
+        // a freed slot takes the next client on the same shard, the one after it is rejected again
+        close(sockfd[0]);
+        usleep(100'000);
+        ASSERT_NE(sockfd[0] = connectTestClient(), -1);
+        ASSERT_EQ(send(sockfd[0], "hello\n", 6, 0), 6);
+        ASSERT_TRUE(recvExact(sockfd[0], recv_buf, 6));
+        EXPECT_STREQ(recv_buf, "hello\n");
+
+        ASSERT_NE(rejected = connectTestClient(), -1);
+        EXPECT_EQ(recv(rejected, recv_buf, sizeof(recv_buf), 0), 0);
+        close(rejected);
+        EXPECT_EQ(server.getRejectedCount(), 2u);
+        EXPECT_EQ(server.getConnectionCount(), 2);
+
+        for (int i = 0; i < 2; i++)
+            close(sockfd[i]);
+
+        server.Stop();
+        server.WaitServer();
+    }
+
+    pthread_setaffinity_np(pthread_self(), sizeof(saved_cpus), &saved_cpus);
+    server.max_connections = MAX_ACTIVE_CONNECTIONS;
+    server.cpu_steering = STEER_NONE;
+    server.listener_shards = 1;
+    server.io_mode = IO_THREADED;
+    server.SetupListening(TEST_TCP_PORT);
+}
+
+TEST(LineScanner, MatchesScalarSearch)
+{
+    unsigned char data[300];
+    srand(1);
+
+    for (int round = 0; round < 2000; round++)
+    {
+        // sparse terminators, at random positions relative to the SIMD blocks
+        int size = rand() % sizeof(data);
+        for (int i = 0; i < size; i++)
+        {
+            int r = rand() % 200;
+            data[i] = r == 0 ? '\r' : r == 1 ? '\n' : 'a' + r % 26;
+        }
+
+        int expected = findTerminatorScalar(data, size);
+        EXPECT_EQ(findTerminatorSSE2(data, size), expected);
+        if (__builtin_cpu_supports("avx2"))
+        {
+            EXPECT_EQ(findTerminatorAVX2(data, size), expected);
+        }
+        EXPECT_EQ(findTerminator(data, size), expected);
+    }
+}
+
+TEST(TCPServer, LineEndingsAcrossReceives)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    // <CR>, <LF> and <CR><LF> terminators, with the pair split between two receives
+    ASSERT_EQ(send(sockfd, "a\r", 2, 0), 2);
+    usleep(50'000);
+    ASSERT_EQ(send(sockfd, "\nb\r\r\nc\n\n", 9, 0), 9);
+
+    const char *expected = "a\nb\n\nc\n\n";
+    char recv_buf[200];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, strlen(expected)));
+    EXPECT_STREQ(recv_buf, expected);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+}
+
+void viewEchoMessage(Connection *conn, const char *message, int message_len)
+{
+    conn->sendLine(message, message_len);
+}
+
+TEST(TCPServer, MessageViewEchoTest)
+{
+    server.ProcessMessagePtr = NULL;
+    server.ProcessMessageViewPtr = &viewEchoMessage;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    // whole lines are passed as views, the line split between the sends is copied
+    ASSERT_EQ(send(sockfd, "first\r\nsecond\nthi", 17, 0), 17);
+    usleep(50'000);
+    ASSERT_EQ(send(sockfd, "rd\n\n", 4, 0), 4);
+
+    const char *expected = "first\nsecond\nthird\n\n";
+    char recv_buf[200];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, strlen(expected)));
+    EXPECT_STREQ(recv_buf, expected);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+    server.ProcessMessageViewPtr = NULL;
+}
+
+int max_collected_output = 0;
+int collected_after_flush = -1;
+
+void coalescingEchoMessage(Connection *conn, const char *message, int message_len)
+{
+    conn->sendMessage("%.*s\n", message_len, message);
+    if (conn->out_bytes > max_collected_output)
+        max_collected_output = conn->out_bytes;
+
+    if (message_len == 5 && !strncmp(message, "flush", 5))
+    {
+        conn->flush();
+        collected_after_flush = conn->out_bytes;
+        conn->sendMessage("flushed\n");
+    }
+}
+
+TEST(TCPServer, CoalescedRepliesTest)
+{
+    server.ProcessMessagePtr = NULL;
+    server.ProcessMessageViewPtr = &coalescingEchoMessage;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    // the replies of the pipelined lines are collected and sent after the receive batch
+    char lines[1000];
+    int lines_len = 0;
+    for (int i = 0; i < 100; i++)
+        lines_len += sprintf(lines + lines_len, "l%02d\n", i);
+    ASSERT_EQ(send(sockfd, lines, lines_len, 0), lines_len);
+
+    char recv_buf[1000];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, lines_len));
+    EXPECT_STREQ(recv_buf, lines);
+    EXPECT_GT(max_collected_output, 4);
+
+    // explicit flush sends the collected output immediately
+    ASSERT_EQ(send(sockfd, "a\nflush\n", 8, 0), 8);
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 16));
+    EXPECT_STREQ(recv_buf, "a\nflush\nflushed\n");
+    EXPECT_EQ(collected_after_flush, 0);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+    server.ProcessMessageViewPtr = NULL;
+}
+
+ShardedCounter shared_counter;
+
+void *countingThread(void *)
+{
+    for (int i = 0; i < 100'000; i++)
+        shared_counter.Add();
+    return NULL;
+}
+
+TEST(ShardedCounter, SumsAllThreads)
+{
+    // more threads than slots, so some of the slots are shared
+    const int thread_count = COUNTER_SHARDS + 8;
+    pthread_t threads[thread_count];
+    for (int i = 0; i < thread_count; i++)
+        ASSERT_EQ(pthread_create(&threads[i], NULL, countingThread, NULL), 0);
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    EXPECT_EQ(shared_counter.Sum(), (uint64_t)thread_count * 100'000);
+
+    shared_counter.Reset();
+    EXPECT_EQ(shared_counter.Sum(), 0u);
+}
+
+TEST(TCPServer, WorkerPoolTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_POOL;
+    server.pool_threads = 1;
+    server.thread_stack_size = 64 * 1024;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int first = connectTestClient();
+    ASSERT_NE(first, -1);
+
+    char recv_buf[200];
+    ASSERT_EQ(send(first, "first\n", 6, 0), 6);
+    ASSERT_TRUE(recvExact(first, recv_buf, 6));
+    EXPECT_STREQ(recv_buf, "first\n");
+
+    // the only worker is busy, so the next client is refused instead of queued behind a long-lived one
+    int refused = connectTestClient();
+    EXPECT_EQ(refused, -1);
+    if (refused != -1)
+        close(refused);
+    EXPECT_EQ(server.getConnectionCount(), 1);
+
+    // the worker takes a client again after the first one is closed
+    close(first);
+    int second = -1;
+    for (int i = 0; i < 100 && second == -1; i++)
+    {
+        usleep(10'000);
+        second = connectTestClient();
+    }
+    ASSERT_NE(second, -1);
+    ASSERT_EQ(send(second, "second\n", 7, 0), 7);
+    ASSERT_TRUE(recvExact(second, recv_buf, 7));
+    EXPECT_STREQ(recv_buf, "second\n");
+    EXPECT_EQ(server.getConnectionCount(), 1);
+
+    // the served connection is closed on stop
+    server.Stop();
+    server.WaitServer();
+    EXPECT_EQ(recv(second, recv_buf, sizeof(recv_buf), 0), 0);
+
+    close(second);
+    server.io_mode = IO_THREADED;
+    server.pool_threads = 0;
+    server.thread_stack_size = 0;
+}
+
+TEST(LatencyHistogram, PercentilesWithinPrecision)
+{
+    LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 100'000; value++)
+        histogram.Record(value * 1000);
+
+    LatencyPercentiles latency = histogram.Percentiles();
+    EXPECT_EQ(latency.count, 100'000u);
+    EXPECT_NEAR((double)latency.p50, 50'000'000.0, 50'000'000.0 / 64);
+    EXPECT_NEAR((double)latency.p99, 99'000'000.0, 99'000'000.0 / 64);
+    EXPECT_NEAR((double)latency.p999, 99'900'000.0, 99'900'000.0 / 64);
+    EXPECT_EQ(latency.max, 100'000'000u);
+}
+
+TEST(TCPServer, LatencyStatsTest)
+{
+    server.ProcessMessagePtr = NULL;
+    server.ProcessMessageViewPtr = &viewEchoMessage;
+    server.track_latency = true;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    char recv_buf[200];
+    for (int i = 0; i < 10; i++)
+    {
+        ASSERT_EQ(send(sockfd, "ping\n", 5, 0), 5);
+        ASSERT_TRUE(recvExact(sockfd, recv_buf, 5));
+    }
+
+    // every message is measured once, after its reply is sent
+    usleep(50'000);
+    LatencyPercentiles response = server.getResponseLatency();
+    LatencyPercentiles handler = server.getHandlerLatency();
+    EXPECT_EQ(response.count, 10u);
+    EXPECT_EQ(handler.count, 10u);
+    EXPECT_GT(response.max, 0u);
+    EXPECT_LE(response.p50, response.max);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+    server.ProcessMessageViewPtr = NULL;
+    server.track_latency = false;
+}
+
+TEST(TCPServer, AdminMetricsTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.admin_port = TEST_TCP_PORT + 1;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    // a message longer than the buffer is truncated
+    char message[RECV_MESSAGE_SIZE + 2];
+    memset(message, 'x', RECV_MESSAGE_SIZE);
+    message[RECV_MESSAGE_SIZE] = '\n';
+    ASSERT_EQ(send(sockfd, "hello\n", 6, 0), 6);
+    ASSERT_EQ(send(sockfd, message, RECV_MESSAGE_SIZE + 1, 0), RECV_MESSAGE_SIZE + 1);
+
+    char recv_buf[RECV_MESSAGE_SIZE + 10];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 6 + RECV_MESSAGE_SIZE));
+
+    // the metrics are served on the admin port, not taking a connection slot;
+    // the sent bytes are counted after the send returns, so the reply can arrive first
+    BufferPool pool;
+    OutBuffer response;
+    for (int i = 0; i < 100 && !(response.len && strstr(response.data, "\necho_sent_bytes_total 4102\n")); i++)
+    {
+        if (response.len)
+            usleep(10'000);
+        response.len = 0;
+
+        int admin = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(TEST_TCP_PORT + 1);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT_EQ(connect(admin, (sockaddr *)&addr, sizeof(addr)), 0);
+        ASSERT_EQ(send(admin, "GET /metrics HTTP/1.0\r\n\r\n", 25, 0), 25);
+
+        int bytes;
+        while ((bytes = recv(admin, recv_buf, sizeof(recv_buf), 0)) > 0)
+            response.append(pool, recv_buf, bytes);
+        response.append(pool, "", 1);
+        close(admin);
+    }
+
+    EXPECT_TRUE(strstr(response.data, "HTTP/1.0 200 OK\r\n") == response.data);
+
+    // the whole body is sent, however the sends are split
+    const char *length = strstr(response.data, "Content-Length: ");
+    const char *body = strstr(response.data, "\r\n\r\n");
+    ASSERT_TRUE(length && body);
+    EXPECT_EQ(atoi(length + 16), (int)(response.data + response.len - 1 - (body + 4)));
+    EXPECT_TRUE(strstr(response.data, "\necho_active_connections 1\n"));
+    EXPECT_TRUE(strstr(response.data, "\necho_accepts_total 1\n"));
+    EXPECT_TRUE(strstr(response.data, "\necho_received_bytes_total 4103\n"));
+    EXPECT_TRUE(strstr(response.data, "\necho_sent_bytes_total 4102\n"));
+    EXPECT_TRUE(strstr(response.data, "\necho_truncated_messages_total 1\n"));
+    response.release(pool);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+    server.admin_port = 0;
+}
+
+// fill the connection with lines until the server stops reading them, returns the sent bytes
+int sendUntilBlocked(int sockfd, const char *line, int line_len)
+{
+    setNonBlockingMode(sockfd);
+
+    int sent = 0;
+    int pos = 0;
+    while (sent < 64 * 1024 * 1024)
+    {
+        int bytes = send(sockfd, line + pos, line_len - pos, 0);
+        if (bytes < 0)
+        {
+            if (errno != EAGAIN || !poll(sockfd, POLLOUT, 300))
+                break;
+            continue;
+        }
+
+        sent += bytes;
+        pos = (pos + bytes) % line_len;
+    }
+
+    // the last line is completed
+    while (pos != 0)
+    {
+        int bytes = send(sockfd, line + pos, line_len - pos, 0);
+        if (bytes > 0)
+            pos = (pos + bytes) % line_len, sent += bytes;
+        else
+            poll(sockfd, POLLOUT, 300);
+    }
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK);
+    return sent;
+}
+
+TEST(TCPServer, OutputBackpressureTest)
+{
+    IOMode modes[] = {IO_EPOLL, IO_URING};
+    for (IOMode mode : modes)
+    {
+        server.ProcessMessagePtr = NULL;
+        server.ProcessMessageViewPtr = &viewEchoMessage;
+        server.io_mode = mode;
+        server.output_high_watermark = 64 * 1024;
+        server.output_low_watermark = 16 * 1024;
+        server.SetupListening(TEST_TCP_PORT);
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        int sockfd = connectTestClient();
+        ASSERT_NE(sockfd, -1);
+
+        // the client doesn't read its echoes, so the server stops reading its lines
+        const char *line = "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456\n";
+        int line_len = strlen(line);
+        int sent = sendUntilBlocked(sockfd, line, line_len);
+        EXPECT_LT(sent, 64 * 1024 * 1024);
+
+        // and every echo arrives, in order, once the client reads
+        char recv_buf[100];
+        int lines = sent / line_len;
+        int mismatches = 0;
+        for (int i = 0; i < lines; i++)
+        {
+            ASSERT_TRUE(recvExact(sockfd, recv_buf, line_len));
+            if (strcmp(recv_buf, line))
+                mismatches++;
+        }
+        EXPECT_EQ(mismatches, 0);
+
+        // the drained queue goes back to the pool
+        usleep(50'000);
+        EXPECT_EQ(server.getBufferBytes(), 0);
+
+        close(sockfd);
+
+        server.Stop();
+        server.WaitServer();
+    }
+
+    server.io_mode = IO_THREADED;
+    server.output_high_watermark = OUTPUT_HIGH_WATERMARK;
+    server.output_low_watermark = OUTPUT_LOW_WATERMARK;
+    server.ProcessMessageViewPtr = NULL;
+}
+
+TEST(TCPServer, LongMessageTest)
+{
+    const int line_len = 100'000;
+    char *line = (char *)malloc(line_len + 1);
+    char *recv_buf = (char *)malloc(line_len + 1);
+    for (int i = 0; i < line_len; i++)
+        line[i] = 'a' + i % 26;
+    line[line_len - 1] = '\n';
+
+    // the message buffer grows from the pool up to the limit, with both processing functions
+    IOMode modes[] = {IO_THREADED, IO_EPOLL};
+    for (IOMode mode : modes)
+        for (int view = 0; view < 2; view++)
+        {
+            server.ProcessMessagePtr = view ? NULL : &simpleEchoMessage;
+            server.ProcessMessageViewPtr = view ? &viewEchoMessage : NULL;
+            server.io_mode = mode;
+            server.max_message_size = 128 * 1024;
+            server.SetupListening(TEST_TCP_PORT);
+            ASSERT_TRUE(server.Start());
+
+            usleep(100'000);
+
+            int sockfd = connectTestClient();
+            ASSERT_NE(sockfd, -1);
+
+            // the line is split between the sends
+            ASSERT_EQ(send(sockfd, line, 1000, 0), 1000);
+            usleep(50'000);
+            ASSERT_EQ(send(sockfd, line + 1000, line_len - 1000, 0), line_len - 1000);
+
+            ASSERT_TRUE(recvExact(sockfd, recv_buf, line_len));
+            EXPECT_EQ(memcmp(recv_buf, line, line_len), 0);
+
+            // the idle connection holds no pooled buffer, they are returned after the echo is sent
+            usleep(50'000);
+            EXPECT_EQ(server.getBufferBytes(), 0);
+
+            close(sockfd);
+
+            server.Stop();
+            server.WaitServer();
+        }
+
+    free(line);
+    free(recv_buf);
+    server.io_mode = IO_THREADED;
+    server.max_message_size = RECV_MESSAGE_SIZE;
+    server.ProcessMessagePtr = NULL;
+    server.ProcessMessageViewPtr = NULL;
+}
+
+TEST(TCPServer, OverflowPolicyTest)
+{
+    server.ProcessMessagePtr = NULL;
+    server.ProcessMessageViewPtr = &viewEchoMessage;
+    server.max_message_size = 16;
+
+    // the oversize line gets an error reply instead of the echo
+    server.overflow_policy = OVERFLOW_REJECT;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    ASSERT_EQ(send(sockfd, "short\n0123456789", 16, 0), 16);
+    usleep(50'000);
+    ASSERT_EQ(send(sockfd, "abcdefghij\nnext\n", 16, 0), 16);
+
+    const char *expected = "short\n" MESSAGE_TOO_LONG_REPLY "next\n";
+    char recv_buf[200];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, strlen(expected)));
+    EXPECT_STREQ(recv_buf, expected);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+
+    // the oversize line closes the connection after the error reply, the rest is not processed
+    server.overflow_policy = OVERFLOW_DISCONNECT;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    ASSERT_EQ(send(sockfd, "short\n0123456789abcdefghij\nnext\n", 32, 0), 32);
+
+    expected = "short\n" MESSAGE_TOO_LONG_REPLY;
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, strlen(expected)));
+    EXPECT_STREQ(recv_buf, expected);
+    EXPECT_EQ(recv(sockfd, recv_buf, sizeof(recv_buf), 0), 0);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+
+    server.overflow_policy = OVERFLOW_TRUNCATE;
+    server.max_message_size = RECV_MESSAGE_SIZE;
+    server.ProcessMessageViewPtr = NULL;
+}
+
+static constexpr const char *test_command_names[] = {"stats", "stats latency", "close", "shutdown"};
+static constexpr CommandTable<4> test_commands(test_command_names);
+static_assert(test_commands.Valid(), "no perfect hash for the test commands");
+
+TEST(CommandTable, FindsRegisteredCommands)
+{
+    for (int i = 0; i < 4; i++)
+        EXPECT_EQ(test_commands.Find(test_command_names[i], strlen(test_command_names[i])), i);
+
+    // case-insensitive, and the message is a view - only its length is compared
+    EXPECT_EQ(test_commands.Find("STATS Latency", 13), 1);
+    EXPECT_EQ(test_commands.Find("close\n", 5), 2);
+
+    // the same lengths, prefixes and the other messages
+    const char *others[] = {"stats", "statx", "clone", "shutdowm", "stats latenc", "stats latencyy", "", "x", "hello world"};
+    EXPECT_EQ(test_commands.Find(others[0], 4), -1);
+    for (int i = 1; i < 9; i++)
+        EXPECT_EQ(test_commands.Find(others[i], strlen(others[i])), -1) << others[i];
+}
+
+int typed_messages = 0;
+
+struct CountingEchoHandler
+{
+    static inline void Process(Connection *conn, const char *message, int message_len)
+    {
+        if (test_commands.Find(message, message_len) == 2)
+        {
+            conn->disconnect();
+            return;
+        }
+
+        typed_messages++;
+        conn->sendLine(message, message_len);
+    }
+};
+
+TEST(TCPServer, TypedServerTest)
+{
+    TypedServer<CountingEchoHandler> typed_server;
+    typed_server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(typed_server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    // the handler gets views, including the line split between the sends, and its commands
+    ASSERT_EQ(send(sockfd, "first\r\nsecond\nthi", 17, 0), 17);
+    usleep(50'000);
+    ASSERT_EQ(send(sockfd, "rd\nCLOSE\n", 9, 0), 9);
+
+    const char *expected = "first\nsecond\nthird\n";
+    char recv_buf[200];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, strlen(expected)));
+    EXPECT_STREQ(recv_buf, expected);
+    EXPECT_EQ(recv(sockfd, recv_buf, sizeof(recv_buf), 0), 0);
+    EXPECT_EQ(typed_messages, 3);
+
+    close(sockfd);
+
+    typed_server.Stop();
+    typed_server.WaitServer();
+}
+
+// uppercase the text on an offload thread
+void upperWork(void *arg)
+{
+    AsyncRequest *req = (AsyncRequest *)arg;
+    for (int i = 0; i < req->msg_len; i++)
+        req->msg[i] = toupper(req->msg[i]);
+}
+
+// handlers of the test in flight, the most seen at once
+int async_running = 0, async_running_max = 0;
+
+struct AsyncRunning
+{
+    AsyncRunning()
+    {
+        if (++async_running > async_running_max)
+            __atomic_store_n(&async_running_max, async_running, __ATOMIC_RELAXED);
+    }
+    ~AsyncRunning() { async_running--; }
+};
+
+// "<ms> <text>" - the text after a sleep, "up <text>" - the offloaded uppercase text
+AsyncTask asyncEchoMessage(AsyncRequest &req)
+{
+    AsyncRunning running;
+
+    if (!strncmp(req.msg, "up ", 3))
+    {
+        if (co_await req.offload(upperWork, &req))
+            req.sendLine(req.msg + 3, req.msg_len - 3);
+        co_return;
+    }
+
+    char *text = strchr(req.msg, ' ');
+    if (!text)
+        co_return;
+
+    if (co_await req.sleep(atoi(req.msg)))
+        req.sendLine(text + 1, req.msg + req.msg_len - text - 1);
+}
+
+TEST(TCPServer, AsyncHandlerTest)
+{
+    TCPServer async_server;
+    async_server.ProcessMessageAsyncPtr = &asyncEchoMessage;
+    async_server.io_mode = IO_EPOLL;
+    async_server.reactor_threads = 1;
+    async_server.async_max_inflight = 4;
+    async_server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(async_server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+
+    // the handlers sleep at once, the shorter ones finish first but the replies keep the request order
+    const char *requests = "200 a\n150 b\nup c\n100 d\n0 e\n";
+    uint64_t start = monotonicNs();
+    ASSERT_EQ(send(sockfd, requests, strlen(requests), 0), (ssize_t)strlen(requests));
+
+    const char *expected = "a\nb\nC\nd\ne\n";
+    char recv_buf[200];
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, strlen(expected)));
+    EXPECT_STREQ(recv_buf, expected);
+    EXPECT_LT(monotonicNs() - start, 400'000'000ULL);
+
+    // more requests than the in-flight limit in one receive, the handlers past it wait to start
+    async_running_max = 0;
+    std::string many, many_expected;
+    for (int i = 0; i < 50; i++)
+    {
+        many += std::to_string(i % 3) + " line" + std::to_string(i) + "\n";
+        many_expected += "line" + std::to_string(i) + "\n";
+    }
+    ASSERT_EQ(send(sockfd, many.data(), many.size(), 0), (ssize_t)many.size());
+    char many_buf[1000];
+    ASSERT_TRUE(recvExact(sockfd, many_buf, many_expected.size()));
+    EXPECT_EQ(many_expected, many_buf);
+    EXPECT_EQ(__atomic_load_n(&async_running_max, __ATOMIC_RELAXED), 4);
+
+    // a client leaving with a sleeping handler is closed without waiting for it
+    ASSERT_EQ(send(sockfd, "10000 late\n", 11, 0), 11);
+    usleep(50'000);
+    close(sockfd);
+    usleep(100'000);
+    EXPECT_EQ(async_server.getConnectionCount(), 0);
+    EXPECT_EQ(async_server.getBufferBytes(), 0);
+
+    async_server.Stop();
+    async_server.WaitServer();
+}
+
+TEST(TimerWheel, ExpiresOnTheirTicks)
+{
+    TimerWheel wheel;
+    ASSERT_TRUE(wheel.Reset(8, 1000));
+
+    // the root level, the second and the third level, and past the wraps of the lower levels
+    uint32_t expires[] = {1001, 1255, 1256, 1300, 1000 + 5000, 1000 + 20000, 1000 + 70000, 1010};
+    for (int i = 0; i < 8; i++)
+        ASSERT_TRUE(wheel.Schedule(i, expires[i]));
+    EXPECT_EQ(wheel.Count(), 8);
+
+    // a cancelled timer and a rescheduled one
+    wheel.Cancel(7);
+    ASSERT_TRUE(wheel.Schedule(3, 1400));
+    expires[3] = 1400;
+    EXPECT_EQ(wheel.Count(), 7);
+
+    // the first expiry of the id 0 schedules it again
+    uint32_t fired[8] = {};
+    int again = 0;
+    for (uint32_t tick = 1001; tick <= 1000 + 70000; tick++)
+        wheel.Advance(tick, [&](int id) -> uint32_t
+        {
+            EXPECT_EQ(fired[id], 0u) << id;
+            fired[id] = tick;
+            if (id == 0 && !again++)
+            {
+                fired[id] = 0;
+                return tick + 600;
+            }
+            return 0;
+        });
+
+    expires[0] = 1601;
+    for (int i = 0; i < 7; i++)
+        EXPECT_EQ(fired[i], expires[i]) << i;
+    EXPECT_EQ(fired[7], 0u);
+    EXPECT_EQ(wheel.Count(), 0);
+}
+
+TEST(TCPServer, ConnectionTimeoutsTest)
+{
+    IOMode modes[] = {IO_THREADED, IO_EPOLL, IO_URING};
+    char recv_buf[200];
+    for (IOMode mode : modes)
+    {
+        server.ProcessMessagePtr = &simpleEchoMessage;
+        server.io_mode = mode;
+        server.idle_timeout_ms = 400;
+        server.read_timeout_ms = 300;
+        server.SetupListening(TEST_TCP_PORT);
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        // an idle client, a client stuck in the middle of a line and an active one
+        int idle = connectTestClient();
+        int partial = connectTestClient();
+        int active = connectTestClient();
+        ASSERT_NE(idle, -1);
+        ASSERT_NE(partial, -1);
+        ASSERT_NE(active, -1);
+        ASSERT_EQ(send(partial, "abc", 3, 0), 3);
+
+        for (int i = 0; i < 8; i++)
+        {
+            ASSERT_EQ(send(active, "ping\n", 5, 0), 5);
+            ASSERT_TRUE(recvExact(active, recv_buf, 5));
+            usleep(100'000);
+        }
+
+        // the expired ones are closed and their slots freed, the active one is served
+        EXPECT_EQ(recv(idle, recv_buf, sizeof(recv_buf), MSG_DONTWAIT), 0) << mode;
+        EXPECT_EQ(recv(partial, recv_buf, sizeof(recv_buf), MSG_DONTWAIT), 0) << mode;
+        EXPECT_EQ(server.getConnectionCount(), 1) << mode;
+        EXPECT_EQ(server.getTimeoutCount(), 2u) << mode;
+
+        close(idle);
+        close(partial);
+        close(active);
+
+        server.Stop();
+        server.WaitServer();
+    }
+
+    // a client not reading its echoes is closed when the queued output stops progressing
+    server.ProcessMessagePtr = NULL;
+    server.ProcessMessageViewPtr = &viewEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.idle_timeout_ms = 0;
+    server.read_timeout_ms = 0;
+    server.write_timeout_ms = 800;
+    server.output_high_watermark = 64 * 1024;
+    server.output_low_watermark = 16 * 1024;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+    const char *line = "0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456\n";
+    sendUntilBlocked(sockfd, line, strlen(line));
+    usleep(1'200'000);
+    EXPECT_EQ(server.getConnectionCount(), 0);
+    EXPECT_EQ(server.getTimeoutCount(), 1u);
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+
+    server.io_mode = IO_THREADED;
+    server.write_timeout_ms = 0;
+    server.output_high_watermark = OUTPUT_HIGH_WATERMARK;
+    server.output_low_watermark = OUTPUT_LOW_WATERMARK;
+    server.ProcessMessageViewPtr = NULL;
+}
+
+TEST(TCPServer, AcceptBurstTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    // all the clients connect at once, the listener drains them from the backlog in bursts
+    const int clients = 150;
+    int sockfd[clients];
+    for (int i = 0; i < clients; i++)
+        ASSERT_NE(sockfd[i] = connectTestClient(), -1) << i;
+
+    char recv_buf[200];
+    for (int i = 0; i < clients; i++)
+    {
+        ASSERT_EQ(send(sockfd[i], "hello\n", 6, 0), 6);
+        ASSERT_TRUE(recvExact(sockfd[i], recv_buf, 6)) << i;
+    }
+    EXPECT_EQ(server.getConnectionCount(), clients);
+
+    for (int i = 0; i < clients; i++)
+        close(sockfd[i]);
+
+    server.Stop();
+    server.WaitServer();
+    server.io_mode = IO_THREADED;
+}
+
+TEST(TCPServer, DeferAcceptTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.defer_accept_sec = 1;
+    server.SetupListening(TEST_TCP_PORT);
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    // the connection is handed to the server only with its first data
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+    usleep(200'000);
+    EXPECT_EQ(server.getConnectionCount(), 0);
+
+    char recv_buf[200];
+    ASSERT_EQ(send(sockfd, "hello\n", 6, 0), 6);
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 6));
+    EXPECT_STREQ(recv_buf, "hello\n");
+    EXPECT_EQ(server.getConnectionCount(), 1);
+
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+    server.defer_accept_sec = 0;
+}
+
+#define TEST_HANDOFF_PATH "/tmp/tcp_server_testing.sock"
+
+TEST(TCPServer, HandoffTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.handoff_path = TEST_HANDOFF_PATH;
+    server.handoff_connections = true;
+    ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    char recv_buf[200];
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+    ASSERT_EQ(send(sockfd, "hello\n", 6, 0), 6);
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 6));
+    ASSERT_EQ(send(sockfd, "par", 3, 0), 3);
+    usleep(100'000);
+
+    // the next server gets the listening socket and the connection with its partial line
+    TCPServer next;
+    next.ProcessMessagePtr = &simpleEchoMessage;
+    next.io_mode = IO_EPOLL;
+    next.handoff_path = TEST_HANDOFF_PATH;
+    ASSERT_TRUE(next.SetupHandoff());
+    ASSERT_EQ(next.getListenerCount(), 1);
+    ASSERT_TRUE(next.Start());
+
+    server.WaitServer();
+    EXPECT_TRUE(server.isHandedOff());
+    EXPECT_EQ(next.getHandoffCount(), 1);
+    EXPECT_EQ(next.getConnectionCount(), 1);
+
+    ASSERT_EQ(send(sockfd, "tial\n", 5, 0), 5);
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 8));
+    EXPECT_STREQ(recv_buf, "partial\n");
+
+    int new_sockfd = connectTestClient();
+    ASSERT_NE(new_sockfd, -1);
+    ASSERT_EQ(send(new_sockfd, "hello\n", 6, 0), 6);
+    ASSERT_TRUE(recvExact(new_sockfd, recv_buf, 6));
+    EXPECT_EQ(next.getConnectionCount(), 2);
+
+    close(sockfd);
+    close(new_sockfd);
+
+    next.Stop();
+    next.WaitServer();
+    server.io_mode = IO_THREADED;
+    server.handoff_path = NULL;
+    server.handoff_connections = false;
+}
+
+TEST(TCPServer, HandoffDrainTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.handoff_path = TEST_HANDOFF_PATH;
+    ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    char recv_buf[200];
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+    usleep(100'000);
+
+    TCPServer next;
+    next.ProcessMessagePtr = &simpleEchoMessage;
+    next.handoff_path = TEST_HANDOFF_PATH;
+    ASSERT_TRUE(next.SetupHandoff());
+    ASSERT_EQ(next.getListenerCount(), 1);
+    ASSERT_TRUE(next.Start());
+
+    // the threaded connection stays with the old server until it closes, the new ones go to the next
+    int new_sockfd = connectTestClient();
+    ASSERT_NE(new_sockfd, -1);
+    ASSERT_EQ(send(new_sockfd, "hello\n", 6, 0), 6);
+    ASSERT_TRUE(recvExact(new_sockfd, recv_buf, 6));
+    EXPECT_EQ(next.getConnectionCount(), 1);
+    EXPECT_EQ(next.getHandoffCount(), 0);
+
+    ASSERT_EQ(send(sockfd, "drained\n", 8, 0), 8);
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 8));
+    EXPECT_STREQ(recv_buf, "drained\n");
+    EXPECT_TRUE(server.isHandedOff());
+
+    close(sockfd);
+    server.WaitServer();
+    EXPECT_EQ(server.getConnectionCount(), 0);
+
+    close(new_sockfd);
+
+    next.Stop();
+    next.WaitServer();
+    server.handoff_path = NULL;
+}
+
+TEST(TCPServer, HandoffToThreadedTest)
+{
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.handoff_path = TEST_HANDOFF_PATH;
+    server.handoff_connections = true;
+    ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    char recv_buf[200];
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+    ASSERT_EQ(send(sockfd, "par", 3, 0), 3);
+    usleep(100'000);
+
+    // the threaded engine can't take the connections while serving, they are drained by the first server
+    TCPServer next;
+    next.ProcessMessagePtr = &simpleEchoMessage;
+    next.handoff_path = TEST_HANDOFF_PATH;
+    ASSERT_TRUE(next.SetupHandoff());
+    ASSERT_TRUE(next.Start());
+
+    usleep(100'000);
+    EXPECT_TRUE(server.isHandedOff());
+    EXPECT_EQ(next.getHandoffCount(), 0);
+    EXPECT_EQ(server.getConnectionCount(), 1);
+
+    ASSERT_EQ(send(sockfd, "tial\n", 5, 0), 5);
+    ASSERT_TRUE(recvExact(sockfd, recv_buf, 8));
+    EXPECT_STREQ(recv_buf, "partial\n");
+
+    close(sockfd);
+    server.WaitServer();
+    EXPECT_EQ(server.getConnectionCount(), 0);
+
+    next.Stop();
+    next.WaitServer();
+    server.io_mode = IO_THREADED;
+    server.handoff_path = NULL;
+    server.handoff_connections = false;
+}
+
+TEST(TCPServer, HandoffManyListenersTest)
+{
+    // more listening sockets than one record carries
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.handoff_path = TEST_HANDOFF_PATH;
+    server.listener_shards = 70;
+    ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    TCPServer next;
+    next.ProcessMessagePtr = &simpleEchoMessage;
+    next.handoff_path = TEST_HANDOFF_PATH;
+    ASSERT_TRUE(next.SetupHandoff());
+    EXPECT_EQ(next.getListenerCount(), 70);
+    ASSERT_TRUE(next.Start());
+    server.WaitServer();
+    EXPECT_TRUE(server.isHandedOff());
+
+    // the passed shards accept in the next server
+    for (int i = 0; i < 20; i++)
+    {
+        char recv_buf[200];
+        int sockfd = connectTestClient();
+        ASSERT_NE(sockfd, -1);
+        ASSERT_EQ(send(sockfd, "hello\n", 6, 0), 6);
+        ASSERT_TRUE(recvExact(sockfd, recv_buf, 6));
+        close(sockfd);
+    }
+
+    next.Stop();
+    next.WaitServer();
+    server.handoff_path = NULL;
+    server.listener_shards = 1;
+}
+
+#define TEST_UNIX_PATH "/tmp/tcp_server_testing_ep.sock"
+
+int connectTestEndpoint(int family, const sockaddr *addr, socklen_t addr_len)
+{
+    int sockfd = socket(family, SOCK_STREAM, 0);
+
+    timeval timeout;
+    timeout.tv_sec = 2;
+    timeout.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(sockfd, addr, addr_len) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+TEST(TCPServer, MultipleEndpointsTest)
+{
+    IOMode modes[] = {IO_THREADED, IO_EPOLL, IO_URING};
+    for (IOMode mode : modes)
+    {
+        server.ProcessMessagePtr = &simpleEchoMessage;
+        server.io_mode = mode;
+        ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+        ASSERT_TRUE(server.AddListening6(TEST_TCP_PORT + 1));
+        ASSERT_TRUE(server.AddListeningUnix(TEST_UNIX_PATH));
+
+        // an endpoint that can't be bound is not added, the others are kept
+        int listener_count = server.getListenerCount();
+        EXPECT_FALSE(server.AddListeningUnix("/nonexistent/tcp_server_testing.sock"));
+        EXPECT_EQ(server.getListenerCount(), listener_count);
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        sockaddr_in v4_addr = {};
+        v4_addr.sin_family = AF_INET;
+        v4_addr.sin_port = htons(TEST_TCP_PORT + 1);
+        inet_pton(AF_INET, "127.0.0.1", &v4_addr.sin_addr);
+
+        sockaddr_in6 v6_addr = {};
+        v6_addr.sin6_family = AF_INET6;
+        v6_addr.sin6_port = htons(TEST_TCP_PORT + 1);
+        v6_addr.sin6_addr = in6addr_loopback;
+
+        sockaddr_un unix_addr = {};
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, TEST_UNIX_PATH);
+
+        // the IPv4 endpoint, the dual-stack one over both families and the unix path
+        int sockfd[4];
+        ASSERT_NE(sockfd[0] = connectTestClient(), -1);
+        ASSERT_NE(sockfd[1] = connectTestEndpoint(AF_INET, (sockaddr *)&v4_addr, sizeof(v4_addr)), -1);
+        ASSERT_NE(sockfd[2] = connectTestEndpoint(AF_INET6, (sockaddr *)&v6_addr, sizeof(v6_addr)), -1);
+        ASSERT_NE(sockfd[3] = connectTestEndpoint(AF_UNIX, (sockaddr *)&unix_addr, sizeof(unix_addr)), -1);
+
+        char recv_buf[200];
+        for (int i = 0; i < 4; i++)
+        {
+            ASSERT_EQ(send(sockfd[i], "hello\n", 6, 0), 6);
+            ASSERT_TRUE(recvExact(sockfd[i], recv_buf, 6));
+            EXPECT_STREQ(recv_buf, "hello\n");
+        }
+
+        // all the endpoints share the one connection table
+        EXPECT_EQ(server.getConnectionCount(), 4);
+
+        for (int i = 0; i < 4; i++)
+            close(sockfd[i]);
+
+        server.Stop();
+        server.WaitServer();
+    }
+
+    server.io_mode = IO_THREADED;
+    server.SetupListening(TEST_TCP_PORT);
+}
+
+// the endpoints share the connection limit, a full table closes all of them and a free slot reopens them together
+TEST(TCPServer, EndpointsConnectionLimitTest)
+{
+    IOMode modes[] = {IO_THREADED, IO_EPOLL, IO_URING};
+    for (IOMode mode : modes)
+    {
+        server.ProcessMessagePtr = &simpleEchoMessage;
+        server.io_mode = mode;
+        server.max_connections = 2;
+        ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+        ASSERT_TRUE(server.AddListeningUnix(TEST_UNIX_PATH));
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        sockaddr_un unix_addr = {};
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, TEST_UNIX_PATH);
+
+        int sockfd[2];
+        ASSERT_NE(sockfd[0] = connectTestClient(), -1);
+        ASSERT_NE(sockfd[1] = connectTestEndpoint(AF_UNIX, (sockaddr *)&unix_addr, sizeof(unix_addr)), -1);
+
+        // neither endpoint takes a third client
+        usleep(200'000);
+        EXPECT_EQ(server.getConnectionCount(), 2);
+        EXPECT_EQ(connectTestClient(), -1);
+        EXPECT_EQ(connectTestEndpoint(AF_UNIX, (sockaddr *)&unix_addr, sizeof(unix_addr)), -1);
+        EXPECT_EQ(server.getConnectionCount(), 2);
+
+        // the TCP client leaving reopens the Unix endpoint as well
+        close(sockfd[0]);
+        usleep(100'000);
+        ASSERT_NE(sockfd[0] = connectTestEndpoint(AF_UNIX, (sockaddr *)&unix_addr, sizeof(unix_addr)), -1);
+
+        char recv_buf[200];
+        for (int i = 0; i < 2; i++)
+        {
+            ASSERT_EQ(send(sockfd[i], "hello\n", 6, 0), 6);
+            ASSERT_TRUE(recvExact(sockfd[i], recv_buf, 6));
+            EXPECT_STREQ(recv_buf, "hello\n");
+        }
+
+        for (int i = 0; i < 2; i++)
+            close(sockfd[i]);
+
+        server.Stop();
+        server.WaitServer();
+    }
+
+    server.max_connections = MAX_ACTIVE_CONNECTIONS;
+    server.io_mode = IO_THREADED;
+    server.SetupListening(TEST_TCP_PORT);
+}
+
+TEST(TCPServer, UdpEchoTest)
+{
+    for (int offload = 0; offload < 2; offload++)
+    {
+        server.ProcessMessagePtr = &simpleEchoMessage;
+        server.udp_port = TEST_TCP_PORT + 2;
+        server.udp_threads = 2;
+        server.udp_offload = offload;
+        ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        ASSERT_NE(sockfd, -1);
+        timeval timeout;
+        timeout.tv_sec = 2;
+        timeout.tv_usec = 0;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        sockaddr_in server_addr = {};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(TEST_TCP_PORT + 2);
+        inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+        ASSERT_EQ(connect(sockfd, (sockaddr *)&server_addr, sizeof(server_addr)), 0);
+
+        // a datagram is a whole message without its terminator, the lines of one datagram get one reply
+        char recv_buf[200];
+        ASSERT_EQ(send(sockfd, "hello", 5, 0), 5);
+        ASSERT_EQ(recv(sockfd, recv_buf, sizeof(recv_buf), 0), 6);
+        EXPECT_EQ(memcmp(recv_buf, "hello\n", 6), 0);
+        ASSERT_EQ(send(sockfd, "one\ntwo\n", 8, 0), 8);
+        ASSERT_EQ(recv(sockfd, recv_buf, sizeof(recv_buf), 0), 8);
+        EXPECT_EQ(memcmp(recv_buf, "one\ntwo\n", 8), 0);
+
+        // a burst larger than the batch is all echoed in order
+        const int count = 100;
+        for (int i = 0; i < count; i++)
+        {
+            int len = snprintf(recv_buf, sizeof(recv_buf), "%03d\n", i);
+            ASSERT_EQ(send(sockfd, recv_buf, len, 0), len);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            char expected[8];
+            snprintf(expected, sizeof(expected), "%03d\n", i);
+            ASSERT_EQ(recv(sockfd, recv_buf, sizeof(recv_buf), 0), 4);
+            EXPECT_EQ(memcmp(recv_buf, expected, 4), 0);
+        }
+
+        EXPECT_EQ(server.getDatagramCount(), 2 + count);
+        EXPECT_EQ(server.getConnectionCount(), 0);
+
+        close(sockfd);
+
+        server.Stop();
+        server.WaitServer();
+    }
+
+    server.udp_port = 0;
+    server.udp_threads = 0;
+    server.udp_offload = false;
+}
+
+TEST(TCPServer, UdpEchoCommandsTest)
+{
+    TypedServer<EchoHandler> echo_server;
+    echo_server.udp_port = TEST_TCP_PORT + 2;
+    echo_server.udp_threads = 1;
+    ASSERT_TRUE(echo_server.SetupListening(TEST_TCP_PORT));
+    ASSERT_TRUE(echo_server.Start());
+
+    usleep(100'000);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_NE(sockfd, -1);
+    timeval timeout;
+    timeout.tv_sec = 2;
+    timeout.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in server_addr = {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(TEST_TCP_PORT + 2);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    ASSERT_EQ(connect(sockfd, (sockaddr *)&server_addr, sizeof(server_addr)), 0);
+
+    // the datagram connection is not counted, the memory stats are sent without the per-connection share
+    char recv_buf[500];
+    ASSERT_EQ(send(sockfd, "stats memory", 12, 0), 12);
+    ssize_t len = recv(sockfd, recv_buf, sizeof(recv_buf) - 1, 0);
+    ASSERT_GT(len, 0);
+    recv_buf[len] = 0;
+    EXPECT_NE(strstr(recv_buf, "bytes per connection: n/a\n"), nullptr) << recv_buf;
+
+    // and the server still echoes
+    ASSERT_EQ(send(sockfd, "hello", 5, 0), 5);
+    ASSERT_EQ(recv(sockfd, recv_buf, sizeof(recv_buf), 0), 6);
+    EXPECT_EQ(memcmp(recv_buf, "hello\n", 6), 0);
+
+    close(sockfd);
+
+    echo_server.Stop();
+    echo_server.WaitServer();
+}
+
+void frameEchoView(Connection *conn, const char *message, int message_len)
+{
+    conn->sendFrame(message, message_len);
+}
+
+void frameEchoCopy(Connection *conn, char *message, int message_len)
+{
+    conn->sendFrame(message, message_len);
+}
+
+int encodeFrame(Framing framing, char *buf, const char *payload, uint32_t len)
+{
+    int prefix_len = 0;
+    if (framing == FRAMING_LENGTH32)
+    {
+        uint32_t be_len = htonl(len);
+        memcpy(buf, &be_len, 4);
+        prefix_len = 4;
+    }
+    else
+        for (uint32_t left = len;; left >>= 7)
+        {
+            buf[prefix_len++] = (left & 0x7F) | (left > 0x7F ? 0x80 : 0);
+            if (left <= 0x7F)
+                break;
+        }
+
+    memcpy(buf + prefix_len, payload, len);
+    return prefix_len;
+}
+
+bool recvFrame(int sockfd, Framing framing, char *buf, uint32_t &len)
+{
+    len = 0;
+    unsigned char byte;
+    for (int i = 0; framing == FRAMING_LENGTH32 ? i < 4 : i == 0 || (byte & 0x80); i++)
+    {
+        if (recv(sockfd, &byte, 1, MSG_WAITALL) != 1)
+            return false;
+        len = framing == FRAMING_LENGTH32 ? len << 8 | byte : len | (uint32_t)(byte & 0x7F) << (7 * i);
+    }
+
+    uint32_t got = 0;
+    while (got < len)
+    {
+        int bytes = recv(sockfd, buf + got, len - got, 0);
+        if (bytes <= 0)
+            return false;
+        got += bytes;
+    }
+    return true;
+}
+
+TEST(TCPServer, LengthPrefixedFramingTest)
+{
+    const int large_size = 100'000;
+    char *large = (char *)malloc(large_size);
+    char *frame = (char *)malloc(large_size + 16);
+    char *reply = (char *)malloc(large_size + 16);
+    for (int i = 0; i < large_size; i++)
+        large[i] = i * 7;
+
+    const char binary[] = "bin\n\r\0ary";
+    IOMode modes[] = {IO_THREADED, IO_EPOLL, IO_URING};
+    for (IOMode mode : modes)
+        for (int view = 0; view < 2; view++)
+        {
+            server.ProcessMessagePtr = view ? NULL : &frameEchoCopy;
+            server.ProcessMessageViewPtr = view ? &frameEchoView : NULL;
+            server.io_mode = mode;
+            server.max_message_size = 128 * 1024;
+            ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+            server.framing = FRAMING_LENGTH32;
+            ASSERT_TRUE(server.AddListening(TEST_TCP_PORT + 1));
+            server.framing = FRAMING_VARINT;
+            ASSERT_TRUE(server.AddListening(TEST_TCP_PORT + 2));
+            server.framing = FRAMING_LINES;
+            ASSERT_TRUE(server.Start());
+
+            usleep(100'000);
+
+            for (Framing framing : {FRAMING_LENGTH32, FRAMING_VARINT})
+            {
+                int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+                timeval timeout = {2, 0};
+                setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                sockaddr_in server_addr = {};
+                server_addr.sin_family = AF_INET;
+                server_addr.sin_port = htons(framing == FRAMING_LENGTH32 ? TEST_TCP_PORT + 1 : TEST_TCP_PORT + 2);
+                inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+                ASSERT_EQ(connect(sockfd, (sockaddr *)&server_addr, sizeof(server_addr)), 0);
+
+                // binary payloads with the line terminators, an empty frame and two frames in one send
+                uint32_t len;
+                int prefix_len = encodeFrame(framing, frame, binary, sizeof(binary));
+                int frame_len = prefix_len + sizeof(binary);
+                frame_len += encodeFrame(framing, frame + frame_len, "", 0);
+                ASSERT_EQ(send(sockfd, frame, frame_len, 0), frame_len);
+                ASSERT_TRUE(recvFrame(sockfd, framing, reply, len));
+                ASSERT_EQ(len, sizeof(binary));
+                EXPECT_EQ(memcmp(reply, binary, len), 0);
+                ASSERT_TRUE(recvFrame(sockfd, framing, reply, len));
+                EXPECT_EQ(len, 0u);
+
+                // a frame split in the prefix and in the payload, and a large one received into its buffer
+                prefix_len = encodeFrame(framing, frame, large, large_size);
+                for (int sent = 0; sent < prefix_len + large_size;)
+                {
+                    int part = sent < prefix_len ? 1 : 30'000;
+                    if (part > prefix_len + large_size - sent)
+                        part = prefix_len + large_size - sent;
+                    ASSERT_EQ(send(sockfd, frame + sent, part, 0), part);
+                    sent += part;
+                    usleep(sent < prefix_len ? 10'000 : 1'000);
+                }
+                ASSERT_TRUE(recvFrame(sockfd, framing, reply, len));
+                ASSERT_EQ(len, (uint32_t)large_size);
+                EXPECT_EQ(memcmp(reply, large, large_size), 0);
+
+                close(sockfd);
+            }
+
+            // the line endpoint is served by the same server
+            int sockfd = connectTestClient();
+            ASSERT_NE(sockfd, -1);
+            char recv_buf[16];
+            ASSERT_EQ(send(sockfd, "hello\n", 6, 0), 6);
+            ASSERT_TRUE(recvExact(sockfd, recv_buf, 6));
+            EXPECT_STREQ(recv_buf, "hello\n");
+            close(sockfd);
+
+            server.Stop();
+            server.WaitServer();
+        }
+
+    // an oversize frame gets the error frame, the next one is echoed
+    server.ProcessMessagePtr = NULL;
+    server.ProcessMessageViewPtr = &frameEchoView;
+    server.io_mode = IO_THREADED;
+    server.max_message_size = 16;
+    server.overflow_policy = OVERFLOW_REJECT;
+    server.framing = FRAMING_LENGTH32;
+    ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+    server.framing = FRAMING_LINES;
+    ASSERT_TRUE(server.Start());
+    usleep(100'000);
+
+    int sockfd = connectTestClient();
+    ASSERT_NE(sockfd, -1);
+    int frame_len = encodeFrame(FRAMING_LENGTH32, frame, large, 100) + 100;
+    frame_len += encodeFrame(FRAMING_LENGTH32, frame + frame_len, "short", 5) + 5;
+    ASSERT_EQ(send(sockfd, frame, frame_len, 0), frame_len);
+
+    uint32_t len;
+    ASSERT_TRUE(recvFrame(sockfd, FRAMING_LENGTH32, reply, len));
+    ASSERT_EQ(len, sizeof(MESSAGE_TOO_LONG_REPLY) - 2);
+    EXPECT_EQ(memcmp(reply, MESSAGE_TOO_LONG_REPLY, len), 0);
+    ASSERT_TRUE(recvFrame(sockfd, FRAMING_LENGTH32, reply, len));
+    ASSERT_EQ(len, 5u);
+    EXPECT_EQ(memcmp(reply, "short", 5), 0);
+    close(sockfd);
+
+    server.Stop();
+    server.WaitServer();
+
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.ProcessMessageViewPtr = NULL;
+    server.max_message_size = RECV_MESSAGE_SIZE;
+    server.overflow_policy = OVERFLOW_TRUNCATE;
+    server.SetupListening(TEST_TCP_PORT);
+    free(large);
+    free(frame);
+    free(reply);
+}
+
+struct RawReader
+{
+    int sockfd;
+    char *buf;
+    int len;
+    bool received;
+};
+
+// the replies are read late, so the echo waits for the client while the stream is sent
+void *rawReaderThread(void *param)
+{
+    RawReader *reader = (RawReader *)param;
+    usleep(200'000);
+    reader->received = recvExact(reader->sockfd, reader->buf, reader->len);
+    return NULL;
+}
+
+TEST(TCPServer, RawEchoTest)
+{
+    const int stream_size = 4 * 1024 * 1024;
+    char *stream = (char *)malloc(stream_size);
+    char *reply = (char *)malloc(stream_size + 1);
+    for (int i = 0; i < stream_size; i++)
+        stream[i] = i * 13;
+
+    // the line terminators in the stream would be reformatted by the handler
+    IOMode modes[] = {IO_THREADED, IO_POOL, IO_EPOLL, IO_URING};
+    for (IOMode mode : modes)
+    {
+        server.ProcessMessagePtr = &simpleEchoMessage;
+        server.io_mode = mode;
+        server.framing = FRAMING_RAW_ECHO;
+        ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+        server.framing = FRAMING_LINES;
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        int sockfd = connectTestClient();
+        ASSERT_NE(sockfd, -1);
+
+        RawReader reader = {sockfd, reply, stream_size, false};
+        pthread_t reader_thread;
+        ASSERT_EQ(pthread_create(&reader_thread, NULL, rawReaderThread, &reader), 0);
+        for (int sent = 0; sent < stream_size;)
+        {
+            int sz = send(sockfd, stream + sent, stream_size - sent, 0);
+            ASSERT_GT(sz, 0);
+            sent += sz;
+        }
+        pthread_join(reader_thread, NULL);
+
+        ASSERT_TRUE(reader.received);
+        EXPECT_EQ(memcmp(reply, stream, stream_size), 0);
+        EXPECT_EQ(server.getMessageCount(), 0u);
+        close(sockfd);
+
+        server.Stop();
+        server.WaitServer();
+    }
+
+    server.io_mode = IO_THREADED;
+    server.SetupListening(TEST_TCP_PORT);
+    free(stream);
+    free(reply);
+}
+
+TEST(TCPServer, ZerocopyFallbackTest)
+{
+    const int line_size = 40'000;
+    char *line = (char *)malloc(line_size);
+    char *reply = (char *)malloc(line_size + 1);
+    for (int i = 0; i < line_size - 1; i++)
+        line[i] = 'a' + i % 26;
+    line[line_size - 1] = '\n';
+
+    // the loopback delivery copies the data, so the first zero-copy sends are reported as copied
+    // and the connection falls back to the copy path
+    IOMode modes[] = {IO_THREADED, IO_EPOLL};
+    for (IOMode mode : modes)
+    {
+        server.ProcessMessagePtr = &simpleEchoMessage;
+        server.io_mode = mode;
+        server.max_message_size = 64 * 1024;
+        server.zerocopy_min_size = 16 * 1024;
+        ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+        ASSERT_TRUE(server.AddListeningUnix(TEST_UNIX_PATH));
+        ASSERT_TRUE(server.Start());
+
+        usleep(100'000);
+
+        sockaddr_un unix_addr = {};
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, TEST_UNIX_PATH);
+
+        // a Unix socket peer can't get zero-copy sends, its replies are copied from the start
+        int sockfd[2];
+        ASSERT_NE(sockfd[0] = connectTestClient(), -1);
+        ASSERT_NE(sockfd[1] = connectTestEndpoint(AF_UNIX, (sockaddr *)&unix_addr, sizeof(unix_addr)), -1);
+        for (int i = 0; i < 10; i++)
+            for (int s = 0; s < 2; s++)
+            {
+                ASSERT_EQ(send(sockfd[s], line, line_size, 0), line_size);
+                ASSERT_TRUE(recvExact(sockfd[s], reply, line_size));
+                EXPECT_EQ(memcmp(reply, line, line_size), 0);
+            }
+        close(sockfd[0]);
+        close(sockfd[1]);
+
+        // the notifications are read before the sockets are closed
+        server.Stop();
+        server.WaitServer();
+
+        EXPECT_GT(server.getZerocopySendCount(), 0u);
+        EXPECT_LT(server.getZerocopySendCount(), 10u);
+        EXPECT_EQ(server.getZerocopyCopiedCount() + server.getZerocopyDoneCount(), server.getZerocopySendCount());
+        EXPECT_EQ(server.getBufferBytes(), 0);
+    }
+
+    server.zerocopy_min_size = 0;
+    server.max_message_size = RECV_MESSAGE_SIZE;
+    server.io_mode = IO_THREADED;
+    server.SetupListening(TEST_TCP_PORT);
+    free(line);
+    free(reply);
+}
+
+// a zero-copy send still in flight when its connection closes keeps the output buffer out of the pool,
+// the buffer returns only with the completion, after the peer reads the reply; while the held bytes are at the limit
+// the large replies are copied
+TEST(TCPServer, ZerocopyDeferredReleaseTest)
+{
+    const int line_size = 600'000;
+    char *line = (char *)malloc(line_size);
+    char *reply = (char *)malloc(line_size + 1);
+    for (int i = 0; i < line_size - 1; i++)
+        line[i] = 'a' + i % 26;
+    line[line_size - 1] = '\n';
+
+    server.ProcessMessagePtr = &simpleEchoMessage;
+    server.io_mode = IO_EPOLL;
+    server.max_message_size = 1024 * 1024;
+    server.zerocopy_min_size = 16 * 1024;
+    ASSERT_TRUE(server.SetupListening(TEST_TCP_PORT));
+    ASSERT_TRUE(server.Start());
+
+    usleep(100'000);
+
+    // the reply is larger than the receive buffer of the client, which doesn't read yet,
+    // so the end of the zero-copy send stays in the server's send queue
+    int sockfd;
+    ASSERT_NE(sockfd = connectTestClient(), -1);
+    ASSERT_EQ(send(sockfd, line, line_size, 0), line_size);
+    usleep(200'000);
+    ASSERT_EQ(server.getZerocopySendCount(), 1u);
+
+    // the hang-up closes the connection with its reply unread
+    int bytes;
+    shutdown(sockfd, SHUT_WR);
+    usleep(200'000);
+    EXPECT_EQ(server.getConnectionCount(), 0);
+    EXPECT_EQ(server.getZerocopyDeferredCount(), 1);
+    EXPECT_EQ(server.getZerocopyDoneCount() + server.getZerocopyCopiedCount(), 0u);
+    EXPECT_GT(server.getBufferBytes(), 0);
+    EXPECT_GT(server.getZerocopyHeldBytes(), 0);
+
+    // with the held bytes at the limit the next large reply is copied
+    server.zerocopy_max_held = server.getZerocopyHeldBytes();
+    int copied_fd;
+    ASSERT_NE(copied_fd = connectTestClient(), -1);
+    ASSERT_EQ(send(copied_fd, line, line_size, 0), line_size);
+    int copied_received = 0;
+    while (copied_received < line_size && (bytes = recv(copied_fd, reply, line_size, 0)) > 0)
+        copied_received += bytes;
+    EXPECT_EQ(copied_received, line_size);
+    EXPECT_EQ(server.getZerocopySendCount(), 1u);
+    close(copied_fd);
+    server.zerocopy_max_held = ZEROCOPY_HELD_MAX;
+    usleep(100'000);
+    EXPECT_EQ(server.getZerocopyDeferredCount(), 1);
+
+    // the sent part still arrives, followed by the end of stream
+    int received = 0;
+    while ((bytes = recv(sockfd, reply, line_size, 0)) > 0)
+        received += bytes;
+    EXPECT_EQ(bytes, 0);
+    EXPECT_GT(received, 0);
+    close(sockfd);
+    usleep(100'000);
+
+    // the next closed connection reaps the completion
+    ASSERT_NE(sockfd = connectTestClient(), -1);
+    close(sockfd);
+    usleep(100'000);
+    EXPECT_EQ(server.getZerocopyDeferredCount(), 0);
+    EXPECT_EQ(server.getZerocopyHeldBytes(), 0);
+    EXPECT_EQ(server.getZerocopyDoneCount() + server.getZerocopyCopiedCount(), 1u);
+
+    server.Stop();
+    server.WaitServer();
+
+    EXPECT_EQ(server.getZerocopyLeakedCount(), 0u);
+    EXPECT_EQ(server.getBufferBytes(), 0);
+
+    server.zerocopy_min_size = 0;
+    server.max_message_size = RECV_MESSAGE_SIZE;
+    server.io_mode = IO_THREADED;
+    server.SetupListening(TEST_TCP_PORT);
+    free(line);
+    free(reply);
+}
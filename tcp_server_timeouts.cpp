@@ -0,0 +1,135 @@
+#include "tcp_server.h"
+
+static inline uint32_t msToTicks(int ms)
+{
+    return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+static inline uint32_t minTicks(uint32_t ticks, int ms)
+{
+    return ms > 0 && msToTicks(ms) < ticks ? msToTicks(ms) : ticks;
+}
+
+// ticks since the start, counted from 1 so the tick 0 marks the unset connection state
+uint32_t TCPServer::currentTick()
+{
+    return (monotonicNs() - timer_base) / (TIMER_TICK_MS * 1'000'000ULL) + 1;
+}
+
+// no timeout of a connection can expire sooner than this after its check
+uint32_t TCPServer::shortestTimeout()
+{
+    uint32_t ticks = minTicks(minTicks(minTicks(UINT32_MAX, idle_timeout_ms), read_timeout_ms), write_timeout_ms);
+    return ticks > 0 ? ticks : 1;
+}
+
+// the first check of a new connection, before it is served
+void TCPServer::armTimeouts(Connection *conn)
+{
+    conn->read_tick = timerNow();
+    conn->line_tick = conn->write_tick = 0;
+
+    if (timeoutsEnabled())
+        timeouts.Schedule(conn->pos, conn->read_tick + shortestTimeout());
+}
+
+// the timer is removed before the descriptor is closed, so the timeout thread never
+// shuts down a descriptor already reused for another client; the zero-copy sends still in flight
+// keep the socket open past the descriptor
+void TCPServer::closeClientSocket(Connection *conn)
+{
+    timeouts.Cancel(conn->pos);
+    conn->finishZerocopy();
+    close(conn->socket);
+    reapDeferredZerocopy(false);
+}
+
+// the timer of a connection fires at its earliest possible deadline - the real deadlines come from
+// the state kept by the serving thread, and the timer moves to the nearest one if none has passed
+uint32_t TCPServer::checkTimeouts(int pos, uint32_t now)
+{
+    Connection *conn = connections.At(pos);
+    uint32_t read_at = __atomic_load_n(&conn->read_tick, __ATOMIC_RELAXED);
+    uint32_t line_at = __atomic_load_n(&conn->line_tick, __ATOMIC_RELAXED);
+    uint32_t write_at = __atomic_load_n(&conn->write_tick, __ATOMIC_RELAXED);
+
+    uint32_t next = now + shortestTimeout();
+    ShardedCounter *expired = NULL;
+    const char *reason = NULL;
+
+    // the output waiting for a slow reader and the handlers in flight are not idle
+    if (idle_timeout_ms > 0 && !write_at && !__atomic_load_n(&conn->async_count, __ATOMIC_RELAXED))
+    {
+        uint32_t deadline = read_at + msToTicks(idle_timeout_ms);
+        if ((int32_t)(deadline - now) <= 0)
+        {
+            expired = &idle_timeouts;
+            reason = "idle";
+        }
+        else if ((int32_t)(deadline - next) < 0)
+            next = deadline;
+    }
+
+    if (read_timeout_ms > 0 && line_at && !expired)
+    {
+        uint32_t deadline = line_at + msToTicks(read_timeout_ms);
+        if ((int32_t)(deadline - now) <= 0)
+        {
+            expired = &read_timeouts;
+            reason = "read";
+        }
+        else if ((int32_t)(deadline - next) < 0)
+            next = deadline;
+    }
+
+    if (write_timeout_ms > 0 && write_at && !expired)
+    {
+        uint32_t deadline = write_at + msToTicks(write_timeout_ms);
+        if ((int32_t)(deadline - now) <= 0)
+        {
+            expired = &write_timeouts;
+            reason = "write";
+        }
+        else if ((int32_t)(deadline - next) < 0)
+            next = deadline;
+    }
+
+    if (!expired)
+        return next;
+
+    // the serving thread sees the shutdown and closes the connection, freeing its slot
+    if (debug_printing)
+        printf("%d] %s timeout\n", pos, reason);
+    expired->Add();
+    shutdown(conn->socket, SHUT_RDWR);
+    return 0;
+}
+
+// timeout thread, advances the wheel every tick
+void *TCPServer::timeoutLoop(void *param)
+{
+    auto server = (TCPServer *)param;
+
+    while (server->running)
+    {
+        usleep(TIMER_TICK_MS * 1000);
+
+        uint32_t tick = server->currentTick();
+        __atomic_store_n(&server->timer_now, tick, __ATOMIC_RELAXED);
+        server->timeouts.Advance(tick, [server, tick](int pos) { return server->checkTimeouts(pos, tick); });
+    }
+
+    return NULL;
+}
+
+bool TCPServer::startTimeouts()
+{
+    if (pthread_create(&timeout_thread, NULL, timeoutLoop, this))
+    {
+        perror("can't run timeout thread");
+        timeout_thread = 0;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,369 @@
+#include "tcp_server.h"
+#include <stdlib.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define UDP_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+// UDP thread, reads the datagrams in batches until the server stops or hands off
+void *UdpWorker::workerLoop(void *param)
+{
+    UdpWorker *worker = (UdpWorker *)param;
+    TCPServer *server = worker->server;
+
+    uint64_t last_count = server->datagrams_in.Sum();
+    uint64_t last_sample = monotonicNs();
+
+    // the next process binds its own sockets to the port, the datagrams queued here are not passed
+    while (server->running && !server->handing_off)
+    {
+        // the first thread samples the datagram rate for the stats
+        if (worker->index == 0)
+        {
+            uint64_t now = monotonicNs();
+            if (now - last_sample >= 1'000'000'000ULL)
+            {
+                uint64_t count = server->datagrams_in.Sum();
+                __atomic_store_n(&server->datagram_rate, (count - last_count) * 1'000'000'000ULL / (now - last_sample), __ATOMIC_RELAXED);
+                last_count = count;
+                last_sample = now;
+            }
+        }
+
+        if (TCPServer::pollForRead(worker->sock, POLL_TIMEOUT_MS))
+            worker->receiveBatch();
+    }
+
+    close(worker->sock);
+    worker->sock = -1;
+    return NULL;
+}
+
+// one recvmmsg for the waiting datagrams, one sendmmsg for their replies
+void UdpWorker::receiveBatch()
+{
+    for (int i = 0; i < batch; i++)
+    {
+        msghdr &hdr = recv_msgs[i].msg_hdr;
+        recv_iov[i].iov_base = recv_buf + (size_t)i * buf_size;
+        recv_iov[i].iov_len = buf_size;
+        hdr.msg_name = &peers[i];
+        hdr.msg_namelen = sizeof(sockaddr_storage);
+        hdr.msg_iov = &recv_iov[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = offload ? recv_control + i * UDP_CONTROL_SIZE : NULL;
+        hdr.msg_controllen = offload ? UDP_CONTROL_SIZE : 0;
+        hdr.msg_flags = 0;
+    }
+
+    int count = recvmmsg(sock, recv_msgs, batch, MSG_DONTWAIT, NULL);
+    if (count < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            perror("udp receive");
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        msghdr &hdr = recv_msgs[i].msg_hdr;
+        const unsigned char *data = (const unsigned char *)recv_iov[i].iov_base;
+        int size = recv_msgs[i].msg_len;
+        bool truncated = hdr.msg_flags & MSG_TRUNC;
+
+        // GRO coalesces the datagrams of one flow, all of the segment size but the last one
+        int segment = size;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); offload && cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(int));
+
+        int offset = 0;
+        do
+        {
+            int len = size - offset < segment ? size - offset : segment;
+            processDatagram(i, data + offset, len, truncated);
+            offset += len;
+        } while (offset < size);
+    }
+
+    sendReplies();
+}
+
+// each datagram is framed on its own, its replies make one reply datagram
+void UdpWorker::processDatagram(int peer, const unsigned char *data, int size, bool truncated)
+{
+    if (reply_count == UDP_BATCH)
+        sendReplies();
+
+    server->datagrams_in.Add();
+    conn.setRemote((sockaddr *)&peers[peer]);
+    conn.message_len = 0;
+    conn.last_term = '\0';
+    conn.message_truncated = false;
+    conn.input_closed = false;
+
+    int offset = conn.out_pending.len;
+    conn.processData(data, size);
+
+    // the last line needs no terminator, and a datagram cut by the receive buffer is over the limit
+    if (truncated)
+        conn.message_truncated = true;
+    if (conn.message_len > 0 || conn.message_truncated || size == 0)
+    {
+        conn.processData((const unsigned char *)"\n", 1);
+        server->bytes_in.Add(-1);
+    }
+
+    addReply(peer, offset, conn.out_pending.len - offset);
+}
+
+void UdpWorker::addReply(int peer, int offset, int len)
+{
+    if (len == 0)
+        return;
+
+    // a reply of the segment size or shorter, to the same peer, joins the previous GSO send
+    if (offload && reply_count > 0)
+    {
+        UdpReply &last = replies[reply_count - 1];
+        socklen_t name_len = recv_msgs[peer].msg_hdr.msg_namelen;
+        bool same_peer = last.peer == peer || (recv_msgs[last.peer].msg_hdr.msg_namelen == name_len &&
+                                               !memcmp(&peers[last.peer], &peers[peer], name_len));
+
+        if (same_peer && last.segment <= UDP_GSO_MAX_SEGMENT && last.len % last.segment == 0 && len <= last.segment &&
+            last.len / last.segment < UDP_GSO_MAX_SEGMENTS && last.len + len <= UDP_GSO_MAX_BYTES)
+        {
+            last.len += len;
+            return;
+        }
+    }
+
+    UdpReply &reply = replies[reply_count++];
+    reply.peer = peer;
+    reply.offset = offset;
+    reply.len = len;
+    reply.segment = len;
+}
+
+void UdpWorker::sendReplies()
+{
+    if (reply_count == 0)
+        return;
+
+    mmsghdr msgs[UDP_BATCH];
+    iovec iov[UDP_BATCH];
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    memset(msgs, 0, sizeof(mmsghdr) * reply_count);
+
+    // the output doesn't move while the replies are sent
+    for (int i = 0; i < reply_count; i++)
+    {
+        UdpReply &reply = replies[i];
+        msghdr &hdr = msgs[i].msg_hdr;
+        iov[i].iov_base = conn.out_pending.data + reply.offset;
+        iov[i].iov_len = reply.len;
+        hdr.msg_name = &peers[reply.peer];
+        hdr.msg_namelen = recv_msgs[reply.peer].msg_hdr.msg_namelen;
+        hdr.msg_iov = &iov[i];
+        hdr.msg_iovlen = 1;
+
+        // the kernel (or the NIC) splits the send into the segments
+        if (reply.len > reply.segment)
+        {
+            hdr.msg_control = control[i];
+            hdr.msg_controllen = sizeof(control[i]);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = reply.segment;
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+    }
+
+    int sent = 0;
+    while (sent < reply_count)
+    {
+        int count = sendmmsg(sock, msgs + sent, reply_count - sent, 0);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // only the first datagram failed, it is dropped and the rest is sent
+            perror("udp send");
+            sent++;
+            continue;
+        }
+
+        for (int i = sent; i < sent + count; i++)
+        {
+            server->datagrams_out.Add((replies[i].len + replies[i].segment - 1) / replies[i].segment);
+            server->bytes_out.Add(replies[i].len);
+        }
+        sent += count;
+    }
+
+    conn.completeReplies(conn.reply_count);
+    conn.out_pending.len = 0;
+    reply_count = 0;
+    conn.releaseIdle();
+}
+
+bool UdpWorker::start(const sockaddr *endpoint, socklen_t len, bool v6only)
+{
+    sock = socket(endpoint->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        perror("can't create udp socket");
+        return false;
+    }
+
+    // every thread has its own socket on the port, the kernel spreads the peers between them
+    int optval = server->reuse_address ? 1 : 0;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)))
+        perror("Error setting SO_REUSEADDR");
+
+    optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)))
+    {
+        perror("Error setting SO_REUSEPORT");
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    optval = v6only ? 1 : 0;
+    if (endpoint->sa_family == AF_INET6 && setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval)))
+        perror("Error setting IPV6_V6ONLY");
+
+    if (bind(sock, endpoint, len))
+    {
+        perror("can't bind udp socket");
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    // without GRO (before Linux 5.0) the datagrams are read and sent one by one
+    optval = 1;
+    offload = server->udp_offload && !setsockopt(sock, SOL_UDP, UDP_GRO, &optval, sizeof(optval));
+    if (server->udp_offload && !offload)
+        perror("Error setting UDP_GRO");
+
+    // a coalesced GRO read may take the whole datagram size, a plain datagram up to the message size limit
+    buf_size = offload || server->max_message_size > UDP_MAX_DATAGRAM ? UDP_MAX_DATAGRAM : server->max_message_size;
+    batch = UDP_BATCH_BYTES / buf_size;
+    if (batch > UDP_BATCH)
+        batch = UDP_BATCH;
+    if (batch < 1)
+        batch = 1;
+
+    recv_buf = (unsigned char *)malloc((size_t)batch * buf_size);
+    recv_msgs = (mmsghdr *)calloc(batch, sizeof(mmsghdr));
+    recv_iov = (iovec *)calloc(batch, sizeof(iovec));
+    peers = (sockaddr_storage *)calloc(batch, sizeof(sockaddr_storage));
+    recv_control = (char *)calloc(batch, UDP_CONTROL_SIZE);
+    if (!recv_buf || !recv_msgs || !recv_iov || !peers || !recv_control)
+    {
+        perror("can't allocate udp buffers");
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    conn.server = server;
+    conn.pos = -1;
+    conn.socket = sock;
+    conn.datagram = true;
+
+    if (pthread_create(&worker_thread, NULL, workerLoop, this))
+    {
+        perror("can't run udp thread");
+        close(sock);
+        sock = -1;
+        worker_thread = 0;
+        return false;
+    }
+
+    return true;
+}
+
+void UdpWorker::stopAndWait()
+{
+    if (worker_thread)
+    {
+        void *retVal;
+        pthread_join(worker_thread, &retVal);
+        worker_thread = 0;
+    }
+
+    if (sock != -1)
+        close(sock);
+    sock = -1;
+
+    conn.releaseOutput();
+    conn.releaseMessage();
+    free(recv_buf);
+    free(recv_msgs);
+    free(recv_iov);
+    free(peers);
+    free(recv_control);
+    recv_buf = NULL;
+    recv_msgs = NULL;
+    recv_iov = NULL;
+    peers = NULL;
+    recv_control = NULL;
+}
+
+bool TCPServer::startUdp()
+{
+    if (ProcessMessageAsyncPtr)
+    {
+        fprintf(stderr, "asynchronous handlers can't reply to datagrams\n");
+        return false;
+    }
+
+    udp_worker_count = udp_threads > 0 ? udp_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (udp_worker_count < 1)
+        udp_worker_count = 1;
+
+    // bound to the address of the first TCP endpoint
+    sockaddr_storage endpoint;
+    bool v6only;
+    socklen_t endpoint_len = ipEndpoint(udp_port, endpoint, v6only);
+
+    udp_workers = new UdpWorker[udp_worker_count];
+    for (int i = 0; i < udp_worker_count; i++)
+    {
+        udp_workers[i].index = i;
+        udp_workers[i].server = this;
+        if (!udp_workers[i].start((sockaddr *)&endpoint, endpoint_len, v6only))
+        {
+            udp_worker_count = i + 1;
+            return false;
+        }
+    }
+
+    if (debug_printing)
+        printf("started %d udp threads\n", udp_worker_count);
+
+    return true;
+}
+
+// the threads exit when they see the running flag cleared
+void TCPServer::stopUdp()
+{
+    for (int i = 0; i < udp_worker_count; i++)
+        udp_workers[i].stopAndWait();
+
+    delete[] udp_workers;
+    udp_workers = NULL;
+    udp_worker_count = 0;
+}
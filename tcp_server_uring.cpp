@@ -0,0 +1,686 @@
+#include "tcp_server.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <stdlib.h>
+
+// user_data layout - operation type in the low byte, connection position (or listener index and accept generation) above it
+enum UringOp
+{
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_CANCEL,
+};
+
+#define URING_DATA(op, pos) (((uint64_t)(pos) << 8) | (op))
+#define URING_OP(data) ((int)((data) & 0xFF))
+#define URING_POS(data) ((int)((data) >> 8))
+#define URING_ACCEPT_POS(listener) ((((listener)->accept_gen & 0x7FFF) << 16) | (listener)->index)
+#define URING_BUF_GROUP 0
+
+static int uringSetup(unsigned entries, io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uringRegister(int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+struct UringEngine
+{
+    TCPServer *server;
+    int ring_fd = -1;
+
+    // submission queue
+    void *sq_ptr = MAP_FAILED;
+    size_t sq_size = 0;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned sq_local_tail = 0;
+    unsigned sq_submitted = 0;
+
+    // completion queue
+    void *cq_ptr = MAP_FAILED;
+    size_t cq_size = 0;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+    // provided receive buffers
+    io_uring_buf_ring *buf_ring = (io_uring_buf_ring *)MAP_FAILED;
+    size_t buf_ring_size = 0;
+    unsigned char *buffers = NULL;
+    unsigned short buf_tail = 0;
+
+    // connections with output waiting for a send
+    int *send_queue = NULL;
+    int send_queue_len = 0;
+
+    bool setup();
+    void teardown();
+
+    io_uring_sqe *getSqe();
+    int submit(unsigned min_complete, int timeout_ms);
+    void recycleBuffer(int bid);
+
+    void armAccept(Listener *listener);
+    void cancelAccept(Listener *listener);
+    void armRecv(Connection *conn);
+    void armSend(Connection *conn);
+    void queueSend(Connection *conn);
+    bool startSend(Connection *conn);
+    void flushSends();
+    void sendNow(Connection *conn);
+
+    void closeConnection(Connection *conn);
+    void finishConnection(Connection *conn);
+    void handleCompletion(io_uring_cqe *cqe);
+    void processCompletions();
+};
+
+bool UringEngine::setup()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+
+    ring_fd = uringSetup(URING_ENTRIES, &params);
+    if (ring_fd < 0)
+    {
+        perror("can't setup io_uring");
+        return false;
+    }
+
+    // the wait timeout is passed with the extended enter argument
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        fprintf(stderr, "io_uring: extended arguments are not supported\n");
+        return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+    {
+        perror("can't map io_uring submission queue");
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else
+    {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+            perror("can't map io_uring completion queue");
+            return false;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        perror("can't map io_uring submission entries");
+        return false;
+    }
+
+    sq_head = (unsigned *)((char *)sq_ptr + params.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_ptr + params.sq_off.tail);
+    sq_mask = *(unsigned *)((char *)sq_ptr + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_array = (unsigned *)((char *)sq_ptr + params.sq_off.array);
+    sq_local_tail = sq_submitted = *sq_tail;
+
+    // submission entries are always used in ring order
+    for (unsigned i = 0; i < sq_entries; i++)
+        sq_array[i] = i;
+
+    cq_head = (unsigned *)((char *)cq_ptr + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ptr + params.cq_off.tail);
+    cq_mask = *(unsigned *)((char *)cq_ptr + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)((char *)cq_ptr + params.cq_off.cqes);
+
+    // provided buffer ring for the receives (kernel 5.19+, also required for the multishot accept)
+    buf_ring_size = URING_RECV_BUFFERS * sizeof(io_uring_buf);
+    buf_ring = (io_uring_buf_ring *)mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED)
+    {
+        perror("can't allocate io_uring buffer ring");
+        return false;
+    }
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)buf_ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUF_GROUP;
+    if (uringRegister(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+        perror("can't register io_uring buffer ring");
+        return false;
+    }
+
+    buffers = (unsigned char *)malloc(URING_RECV_BUFFERS * RECV_BUF_SIZE);
+    if (!buffers)
+    {
+        perror("can't allocate receive buffers");
+        return false;
+    }
+
+    buf_tail = 0;
+    for (int i = 0; i < URING_RECV_BUFFERS; i++)
+        recycleBuffer(i);
+
+    // each connection is queued at most once
+    send_queue = (int *)malloc(server->max_connections * sizeof(int));
+    if (!send_queue)
+    {
+        perror("can't allocate send queue");
+        return false;
+    }
+
+    return true;
+}
+
+void UringEngine::teardown()
+{
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_size);
+
+    // the buffer ring is unregistered with the ring itself
+    if (ring_fd != -1)
+        close(ring_fd);
+    if (buf_ring != MAP_FAILED)
+        munmap(buf_ring, buf_ring_size);
+    free(buffers);
+    free(send_queue);
+
+    sqes = (io_uring_sqe *)MAP_FAILED;
+    sq_ptr = cq_ptr = MAP_FAILED;
+    buf_ring = (io_uring_buf_ring *)MAP_FAILED;
+    buffers = NULL;
+    send_queue = NULL;
+    ring_fd = -1;
+}
+
+io_uring_sqe *UringEngine::getSqe()
+{
+    // the queue is full - pass the pending entries to the kernel first
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        submit(0, 0);
+
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        return NULL;
+
+    io_uring_sqe *sqe = &sqes[sq_local_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_local_tail++;
+    return sqe;
+}
+
+// submit all prepared entries in one call, and optionally wait for completions
+int UringEngine::submit(unsigned min_complete, int timeout_ms)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail - sq_submitted;
+
+    unsigned flags = 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    if (min_complete)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1'000'000LL;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+
+    int ret = uringEnter(ring_fd, to_submit, min_complete, flags, min_complete ? &arg : NULL, min_complete ? sizeof(arg) : 0);
+    if (ret < 0)
+    {
+        if (errno != ETIME && errno != EINTR && errno != EBUSY)
+            perror("io_uring enter");
+        return -1;
+    }
+
+    sq_submitted += ret;
+    return ret;
+}
+
+void UringEngine::recycleBuffer(int bid)
+{
+    // the flexible bufs[] member gets a padded offset in C++, so the ring is indexed directly
+    io_uring_buf *buf = (io_uring_buf *)buf_ring + (buf_tail & (URING_RECV_BUFFERS - 1));
+    buf->addr = (uint64_t)(buffers + bid * RECV_BUF_SIZE);
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bid;
+
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+// one multishot accept per endpoint
+void UringEngine::armAccept(Listener *listener)
+{
+    io_uring_sqe *sqe = getSqe();
+    if (!sqe)
+        return;
+
+    listener->accept_gen++;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(OP_ACCEPT, URING_ACCEPT_POS(listener));
+    listener->accepting = true;
+}
+
+void UringEngine::cancelAccept(Listener *listener)
+{
+    io_uring_sqe *sqe = getSqe();
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_DATA(OP_ACCEPT, URING_ACCEPT_POS(listener));
+    sqe->user_data = URING_DATA(OP_CANCEL, 0);
+    listener->accepting = false;
+}
+
+void UringEngine::armRecv(Connection *conn)
+{
+    io_uring_sqe *sqe = getSqe();
+    if (!sqe)
+    {
+        closeConnection(conn);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->len = RECV_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_DATA(OP_RECV, conn->pos);
+    conn->uring_ops++;
+}
+
+void UringEngine::armSend(Connection *conn)
+{
+    io_uring_sqe *sqe = getSqe();
+    if (!sqe)
+    {
+        closeConnection(conn);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->socket;
+    sqe->addr = (uint64_t)(conn->out_sending.data + conn->out_sent);
+    sqe->len = conn->out_sending.len - conn->out_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATA(OP_SEND, conn->pos);
+    conn->uring_ops++;
+    conn->write_tick = server->timerNow();
+}
+
+void UringEngine::queueSend(Connection *conn)
+{
+    if (conn->send_queued)
+        return;
+
+    conn->send_queued = true;
+    send_queue[send_queue_len++] = conn->pos;
+    __atomic_store_n(&server->uring_send_queue_depth, send_queue_len, __ATOMIC_RELAXED);
+}
+
+// move the collected output to the sending buffer and arm its send
+bool UringEngine::startSend(Connection *conn)
+{
+    // the previous send is still in flight, its completion queues the connection again
+    if (conn->closing || conn->out_sending.len > 0 || conn->out_pending.len == 0)
+        return false;
+
+    OutBuffer sending = conn->out_sending;
+    conn->out_sending = conn->out_pending;
+    conn->out_pending = sending;
+    conn->out_sent = 0;
+    conn->reply_sending = conn->reply_count;
+    armSend(conn);
+    return true;
+}
+
+// pass the output collected during the last completion batch to the kernel
+void UringEngine::flushSends()
+{
+    for (int i = 0; i < send_queue_len; i++)
+    {
+        Connection *conn = server->connections.At(send_queue[i]);
+        conn->send_queued = false;
+        startSend(conn);
+    }
+
+    send_queue_len = 0;
+    __atomic_store_n(&server->uring_send_queue_depth, 0, __ATOMIC_RELAXED);
+}
+
+// explicit flush from the handler - submit the send without waiting for the batch end
+void UringEngine::sendNow(Connection *conn)
+{
+    if (startSend(conn))
+        submit(0, 0);
+}
+
+void UringEngine::closeConnection(Connection *conn)
+{
+    if (conn->closing)
+        return;
+    conn->closing = true;
+
+    // complete the pending operations first, the slot can't be reused while the kernel refers to it
+    if (conn->uring_ops > 0)
+        shutdown(conn->socket, SHUT_RDWR);
+    else
+        finishConnection(conn);
+}
+
+void UringEngine::finishConnection(Connection *conn)
+{
+    server->closeClientSocket(conn);
+
+    server->connectionComplete(conn);
+    conn->running = false;
+}
+
+void UringEngine::handleCompletion(io_uring_cqe *cqe)
+{
+    int op = URING_OP(cqe->user_data);
+    int pos = URING_POS(cqe->user_data);
+
+    if (op == OP_ACCEPT)
+    {
+        Listener *listener = &server->listeners[pos & 0xFFFF];
+        if (!(cqe->flags & IORING_CQE_F_MORE) && pos == URING_ACCEPT_POS(listener))
+            listener->accepting = false;
+
+        if (cqe->res < 0)
+        {
+            if (cqe->res != -ECANCELED)
+                fprintf(stderr, "can't accept client: %s\n", strerror(-cqe->res));
+            return;
+        }
+
+        if (!server->running || listener->atCapacity())
+        {
+            close(cqe->res);
+            return;
+        }
+
+        sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        memset(&client_addr, 0, sizeof(client_addr));
+        getpeername(cqe->res, (sockaddr *)&client_addr, &client_len);
+        server->setupClient(listener, cqe->res, (sockaddr *)&client_addr);
+        return;
+    }
+
+    if (op == OP_CANCEL)
+        return;
+
+    Connection *conn = server->connections.At(pos);
+    conn->uring_ops--;
+
+    if (op == OP_RECV)
+    {
+        if (cqe->res > 0)
+        {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (!conn->closing)
+                conn->processData(buffers + bid * RECV_BUF_SIZE, cqe->res);
+            recycleBuffer(bid);
+
+            // the client doesn't read its replies, stop receiving until the output drains
+            if (!conn->closing && conn->queuedOutput() > server->output_high_watermark)
+            {
+                conn->read_paused = true;
+                server->read_pauses.Add();
+            }
+            else if (!conn->closing)
+                armRecv(conn);
+        }
+        else if (cqe->res == -ENOBUFS && !conn->closing)
+            armRecv(conn);
+        else
+        {
+            char addr[INET6_ADDRSTRLEN];
+            if (cqe->res == 0 && server->debug_printing)
+                printf("%d] disconnected %s:%d\n", conn->pos, conn->remoteAddress(addr), conn->remote_port);
+            if (cqe->res < 0 && !conn->closing)
+                fprintf(stderr, "socket receive: %s\n", strerror(-cqe->res));
+
+            closeConnection(conn);
+        }
+    }
+    else if (op == OP_SEND)
+    {
+        if (cqe->res < 0)
+        {
+            if (!conn->closing)
+                fprintf(stderr, "socket send: %s\n", strerror(-cqe->res));
+            closeConnection(conn);
+        }
+        else if (!conn->closing)
+        {
+            conn->out_sent += cqe->res;
+            server->bytes_out.Add(cqe->res);
+            if (conn->out_sent < conn->out_sending.len)
+                armSend(conn);
+            else
+            {
+                conn->out_sending.len = 0;
+                conn->out_sent = 0;
+                conn->write_tick = 0;
+                conn->completeReplies(conn->reply_sending);
+                conn->reply_sending = 0;
+                if (conn->out_pending.len > 0)
+                    queueSend(conn);
+                else if (conn->disconnect_pending)
+                    closeConnection(conn);
+                else
+                    conn->releaseIdle();
+
+                if (conn->read_paused && !conn->closing && conn->queuedOutput() <= server->output_low_watermark)
+                {
+                    conn->read_paused = false;
+                    armRecv(conn);
+                }
+            }
+        }
+    }
+
+    if (conn->closing && conn->uring_ops == 0 && conn->running)
+        finishConnection(conn);
+}
+
+void UringEngine::processCompletions()
+{
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    {
+        handleCompletion(&cqes[head & cq_mask]);
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// io_uring thread, replaces serverLoop and the per-connection threads
+void *TCPServer::uringLoop(void *param)
+{
+    auto server = (TCPServer *)param;
+    UringEngine *uring = server->uring;
+
+    // after a handoff the next process accepts on the same sockets
+    while (server->running && !server->handing_off)
+    {
+        bool failed = false;
+        for (int i = 0; i < server->listener_count; i++)
+        {
+            Listener *listener = &server->listeners[i];
+            if (listener->atCapacity())
+            {
+                if (listener->accepting)
+                    uring->cancelAccept(listener);
+
+                if (!listener->isSocketClosed() && server->closeOnMaxConnections)
+                {
+                    if (server->debug_printing)
+                        fprintf(stderr, "too many active connections\n");
+                    server->closeListenerSocket(listener);
+                    server->listener_closes.Add();
+                }
+            }
+            else
+            {
+                if (listener->isSocketClosed() && !server->reopenListenerSocket(listener))
+                {
+                    failed = true;
+                    break;
+                }
+
+                if (!listener->accepting && !listener->isSocketClosed())
+                    uring->armAccept(listener);
+            }
+        }
+
+        // a listening socket that can't be reopened stops the engine
+        if (failed)
+            break;
+
+        uring->flushSends();
+        uring->submit(1, POLL_TIMEOUT_MS);
+        uring->processCompletions();
+    }
+
+    // closing the listening sockets, the pending accepts hold them open until the cancels are submitted
+    for (int i = 0; i < server->listener_count; i++)
+        if (server->listeners[i].accepting)
+            uring->cancelAccept(&server->listeners[i]);
+    uring->submit(0, 0);
+    for (int i = 0; i < server->listener_count; i++)
+        server->closeListenerSocket(&server->listeners[i]);
+
+    // the operations in flight can't be passed to the next process, so the connections are drained
+    if (server->handing_off)
+    {
+        server->handOffConnections();
+
+        uint64_t deadline = monotonicNs() + server->drain_timeout_ms * 1'000'000ULL;
+        while (!server->drainExpired(deadline))
+        {
+            uring->flushSends();
+            uring->submit(1, POLL_TIMEOUT_MS);
+            uring->processCompletions();
+        }
+        server->running = false;
+    }
+
+    // close all connections and wait their pending operations
+    int pos = server->connections_list.Head();
+    while (pos != -1)
+    {
+        int next = server->connections_list.Next(pos);
+        uring->closeConnection(server->connections.At(pos));
+        pos = next;
+    }
+
+    while (server->connections_list.Count() > 0)
+    {
+        uring->submit(1, POLL_TIMEOUT_MS);
+        uring->processCompletions();
+    }
+
+    server->releaseUring();
+
+    return NULL;
+}
+
+bool TCPServer::startUring()
+{
+    uring = new UringEngine();
+    uring->server = this;
+
+    if (!uring->setup())
+    {
+        releaseUring();
+        return false;
+    }
+
+    return true;
+}
+
+void TCPServer::releaseUring()
+{
+    uring->teardown();
+    delete uring;
+    uring = NULL;
+    __atomic_store_n(&uring_send_queue_depth, 0, __ATOMIC_RELAXED);
+}
+
+// the first receive is armed here, the next ones after each completion
+bool Connection::startUring()
+{
+    out_pending.len = out_sending.len = out_sent = 0;
+    uring_ops = 0;
+    closing = false;
+    disconnect_pending = false;
+    read_paused = false;
+
+    server->uring->armRecv(this);
+    return true;
+}
+
+// collect the output until the current completion batch is processed
+bool Connection::queueOutput(const char *data, int size)
+{
+    if (closing || !out_pending.append(server->buffer_pool, data, size))
+        return false;
+
+    server->uring->queueSend(this);
+    if (out_pending.len >= server->output_flush_threshold)
+        server->uring->sendNow(this);
+    return true;
+}
+
+void Connection::flushUring()
+{
+    if (!closing)
+        server->uring->sendNow(this);
+}
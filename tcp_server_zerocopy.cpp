@@ -0,0 +1,218 @@
+#include "tcp_server.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+
+// the socket option is set with the first large output, a socket that can't send without a copy
+// keeps the state marked, so the option isn't tried again
+bool Connection::startZerocopy(uint32_t seq)
+{
+    zerocopy = (ZerocopyState *)calloc(1, sizeof(ZerocopyState));
+    if (!zerocopy)
+    {
+        perror("can't allocate zero-copy state");
+        return false;
+    }
+
+    zerocopy->next_seq = zerocopy->done_seq = seq;
+
+    int on = 1;
+    if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)))
+        zerocopy->copied = zerocopy->unsupported = true;
+    return true;
+}
+
+// the flush goes with MSG_ZEROCOPY when its output is large and all copied to the output buffer -
+// the views into the received data are sent with a copy, their buffers are reused right after
+bool Connection::zerocopyReady()
+{
+    if (server->zerocopy_min_size <= 0 || out_bytes < server->zerocopy_min_size || out_pending.len != out_bytes)
+        return false;
+
+    if (!zerocopy && !startZerocopy(0))
+        return false;
+
+    // after the fallback the error queue is read only to return the held buffers
+    if (zerocopy->copied && zerocopy->buffer_count == 0)
+        return false;
+
+    reapZerocopy();
+
+    // the peers that stop reading keep the buffers of their closed sockets, past the limit the memory isn't taken
+    if (__atomic_load_n(&server->zerocopy_held_bytes, __ATOMIC_RELAXED) >= server->zerocopy_max_held)
+        return false;
+    return zerocopy->buffer_count < ZEROCOPY_MAX_BUFFERS && zerocopyRoom();
+}
+
+// checked before each send call, the notification window can't track more calls in flight
+bool Connection::zerocopyRoom()
+{
+    return !zerocopy->copied && zerocopy->next_seq - zerocopy->done_seq < ZEROCOPY_MAX_INFLIGHT;
+}
+
+// the output buffer taken by the zero-copy calls of the flush is held, the next output gets another one
+void Connection::holdZerocopy(uint32_t first_seq)
+{
+    if (zerocopy->next_seq == first_seq)
+        return;
+
+    auto &held = zerocopy->buffers[(zerocopy->buffer_head + zerocopy->buffer_count) % ZEROCOPY_MAX_BUFFERS];
+    held.data = out_pending.data;
+    held.cap = out_pending.cap;
+    held.end_seq = zerocopy->next_seq;
+    zerocopy->buffer_count++;
+
+    out_pending.data = NULL;
+    out_pending.cap = out_pending.len = 0;
+}
+
+static long heldBytes(ZerocopyState *state)
+{
+    long bytes = 0;
+    for (int i = 0; i < state->buffer_count; i++)
+        bytes += state->buffers[(state->buffer_head + i) % ZEROCOPY_MAX_BUFFERS].cap;
+    return bytes;
+}
+
+// read the completion notifications without waiting and return the buffers of the completed calls,
+// a range the kernel had to copy turns the zero-copy off for the connection
+void Connection::reapZerocopy()
+{
+    server->reapZerocopy(zerocopy, socket);
+}
+
+void TCPServer::reapZerocopy(ZerocopyState *state, int socket)
+{
+    // a Unix socket would take the error queue read for a normal one
+    if (state->unsupported)
+        return;
+
+    char control[128];
+    while (true)
+    {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 || !(msg.msg_flags & MSG_ERRQUEUE))
+            break;
+
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            sock_extended_err *err = (sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // the calls from ee_info to ee_data, the ones before done_seq were passed by a hot upgrade
+            uint32_t count = err->ee_data - err->ee_info + 1;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                state->copied = true;
+                zerocopy_copied.Add(count);
+            }
+            else
+                zerocopy_done.Add(count);
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t offset = err->ee_info + i - state->done_seq;
+                if (offset < ZEROCOPY_MAX_INFLIGHT)
+                    state->done_bits |= 1ULL << offset;
+            }
+        }
+    }
+
+    while (state->done_bits & 1)
+    {
+        state->done_bits >>= 1;
+        state->done_seq++;
+    }
+
+    while (state->buffer_count > 0 && (int32_t)(state->buffers[state->buffer_head].end_seq - state->done_seq) <= 0)
+    {
+        auto &held = state->buffers[state->buffer_head];
+        buffer_pool.Free(held.data, held.cap);
+        state->buffer_head = (state->buffer_head + 1) % ZEROCOPY_MAX_BUFFERS;
+        state->buffer_count--;
+    }
+}
+
+// before the socket is closed or passed to the next process - the kernel may still send from the held
+// buffers (a retransmission reads the same pages), so they never return to the pool without their completion:
+// a closed socket is kept for its error queue, the notifications of a passed one are read by the next process
+void Connection::finishZerocopy(bool passed)
+{
+    if (!zerocopy)
+        return;
+
+    reapZerocopy();
+    if (zerocopy->buffer_count > 0)
+    {
+        if (!passed && server->deferZerocopy(zerocopy, socket))
+        {
+            zerocopy = NULL;
+            return;
+        }
+        server->zerocopy_leaked.Add(zerocopy->buffer_count);
+        __atomic_add_fetch(&server->zerocopy_held_bytes, heldBytes(zerocopy), __ATOMIC_RELAXED);
+    }
+
+    free(zerocopy);
+    zerocopy = NULL;
+}
+
+// the connection's socket is shut down now and closed with the last completion
+bool TCPServer::deferZerocopy(ZerocopyState *state, int socket)
+{
+    state->socket = fcntl(socket, F_DUPFD_CLOEXEC, 0);
+    if (state->socket == -1)
+    {
+        perror("can't keep the zero-copy socket");
+        return false;
+    }
+    shutdown(socket, SHUT_RDWR);
+    state->deadline = monotonicNs() + ZEROCOPY_DEFER_MAX_MS * 1'000'000ULL;
+
+    pthread_mutex_lock(&zerocopy_lock);
+    state->next = zerocopy_deferred;
+    zerocopy_deferred = state;
+    __atomic_add_fetch(&zerocopy_deferred_buffers, state->buffer_count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&zerocopy_held_bytes, heldBytes(state), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&zerocopy_lock);
+    return true;
+}
+
+// called with each closed connection and once after the engines stop (final) -
+// a peer that hasn't read its output by the deadline leaves the buffers leaked, still counted in zerocopy_held_bytes
+void TCPServer::reapDeferredZerocopy(bool final)
+{
+    if (!__atomic_load_n(&zerocopy_deferred_buffers, __ATOMIC_RELAXED))
+        return;
+
+    uint64_t now = monotonicNs();
+    pthread_mutex_lock(&zerocopy_lock);
+    for (ZerocopyState **link = &zerocopy_deferred; *link;)
+    {
+        ZerocopyState *state = *link;
+        int held = state->buffer_count;
+        long held_bytes = heldBytes(state);
+        reapZerocopy(state, state->socket);
+        __atomic_sub_fetch(&zerocopy_held_bytes, held_bytes - heldBytes(state), __ATOMIC_RELAXED);
+        if (state->buffer_count > 0 && !final && now < state->deadline)
+        {
+            __atomic_sub_fetch(&zerocopy_deferred_buffers, held - state->buffer_count, __ATOMIC_RELAXED);
+            link = &state->next;
+            continue;
+        }
+
+        __atomic_sub_fetch(&zerocopy_deferred_buffers, held, __ATOMIC_RELAXED);
+        zerocopy_leaked.Add(state->buffer_count);
+        close(state->socket);
+        *link = state->next;
+        free(state);
+    }
+    pthread_mutex_unlock(&zerocopy_lock);
+}
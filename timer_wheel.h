@@ -0,0 +1,221 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define WHEEL_ROOT_BITS 8           // 256 one-tick slots
+#define WHEEL_LEVEL_BITS 6          // 64 slots in each upper level
+#define WHEEL_LEVELS 4              // up to 2^26 ticks ahead
+#define WHEEL_ROOT_SIZE (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_SLOTS (WHEEL_ROOT_SIZE + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_SIZE)
+#define WHEEL_MAX_DELTA ((1u << (WHEEL_ROOT_BITS + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_BITS)) - 1)
+
+// hierarchical timer wheel of integer ids (the connection slots), one timer per id.
+// Scheduling and cancelling are O(1) list operations on the slot of the expiry tick, the
+// timers far ahead sit in the coarser levels and are cascaded down when the lower level wraps
+class TimerWheel
+{
+    struct Entry
+    {
+        int next;
+        int prev;
+        uint32_t expires;
+        int slot;           // -1 - not scheduled
+    };
+
+    Entry* entries = NULL;
+    int capacity = 0;
+    int heads[WHEEL_SLOTS];
+    uint32_t now = 0;       // the last processed tick
+    int count = 0;
+
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    int slotOf(uint32_t expires);
+    void place(int id, uint32_t expires);
+    void link(int id, int slot);
+    void unlink(int id);
+    void cascade(int level);
+
+public:
+    TimerWheel() { Reset(0, 0); }
+    ~TimerWheel() { free(entries); }
+
+    bool Reset(int new_capacity, uint32_t tick);
+    bool Schedule(int id, uint32_t expires);
+    void Cancel(int id);
+    template <class F>
+    void Advance(uint32_t tick, F expire);
+    inline int Count() { return __atomic_load_n(&count, __ATOMIC_RELAXED); }
+    inline uint32_t Now() { return __atomic_load_n(&now, __ATOMIC_RELAXED); }
+    inline long MemoryBytes() { return (long)capacity * sizeof(Entry); }
+};
+
+// not thread-safe, called only when no timer is in use
+inline bool TimerWheel::Reset(int new_capacity, uint32_t tick)
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+        heads[i] = -1;
+    now = tick;
+    count = 0;
+
+    free(entries);
+    entries = NULL;
+    capacity = 0;
+    if (new_capacity <= 0)
+        return true;
+
+    entries = (Entry*)malloc(new_capacity * sizeof(Entry));
+    if (!entries)
+    {
+        perror("can't allocate timer wheel");
+        return false;
+    }
+
+    capacity = new_capacity;
+    for (int i = 0; i < capacity; i++)
+        entries[i].slot = -1;
+    return true;
+}
+
+// the root level keeps the next 256 ticks, each upper level 64 times longer spans
+inline int TimerWheel::slotOf(uint32_t expires)
+{
+    uint32_t delta = expires - now;
+    if (delta < WHEEL_ROOT_SIZE)
+        return expires & (WHEEL_ROOT_SIZE - 1);
+
+    int shift = WHEEL_ROOT_BITS;
+    int base = WHEEL_ROOT_SIZE;
+    for (int level = 1; level < WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < 1u << (shift + WHEEL_LEVEL_BITS))
+            return base + ((expires >> shift) & (WHEEL_LEVEL_SIZE - 1));
+        shift += WHEEL_LEVEL_BITS;
+        base += WHEEL_LEVEL_SIZE;
+    }
+    return base + ((expires >> shift) & (WHEEL_LEVEL_SIZE - 1));
+}
+
+inline void TimerWheel::link(int id, int slot)
+{
+    Entry& entry = entries[id];
+    entry.slot = slot;
+    entry.prev = -1;
+    entry.next = heads[slot];
+    if (entry.next != -1)
+        entries[entry.next].prev = id;
+    heads[slot] = id;
+}
+
+inline void TimerWheel::unlink(int id)
+{
+    Entry& entry = entries[id];
+    if (entry.prev != -1)
+        entries[entry.prev].next = entry.next;
+    else
+        heads[entry.slot] = entry.next;
+    if (entry.next != -1)
+        entries[entry.next].prev = entry.prev;
+    entry.slot = -1;
+}
+
+// arm the timer of the id, replacing its previous expiry; the ticks already passed expire on the next one
+inline bool TimerWheel::Schedule(int id, uint32_t expires)
+{
+    if (id < 0 || id >= capacity)
+        return false;
+
+    pthread_mutex_lock(&lock);
+    if (entries[id].slot != -1)
+        unlink(id);
+    else
+        count++;
+    place(id, expires);
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+inline void TimerWheel::place(int id, uint32_t expires)
+{
+    if ((int32_t)(expires - now) <= 0)
+        expires = now + 1;
+    else if (expires - now > WHEEL_MAX_DELTA)
+        expires = now + WHEEL_MAX_DELTA;
+
+    entries[id].expires = expires;
+    link(id, slotOf(expires));
+}
+
+inline void TimerWheel::Cancel(int id)
+{
+    if (id < 0 || id >= capacity)
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (entries[id].slot != -1)
+    {
+        unlink(id);
+        count--;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// move the timers of the current slot of the level one level down
+inline void TimerWheel::cascade(int level)
+{
+    int shift = WHEEL_ROOT_BITS + (level - 1) * WHEEL_LEVEL_BITS;
+    int slot = WHEEL_ROOT_SIZE + (level - 1) * WHEEL_LEVEL_SIZE + ((now >> shift) & (WHEEL_LEVEL_SIZE - 1));
+
+    int id = heads[slot];
+    heads[slot] = -1;
+    while (id != -1)
+    {
+        int next = entries[id].next;
+        link(id, slotOf(entries[id].expires));
+        id = next;
+    }
+}
+
+// process the ticks up to the given one, expire(id) is called under the lock for each due timer
+// and returns the next expiry of the id, 0 to leave its timer off
+template <class F>
+void TimerWheel::Advance(uint32_t tick, F expire)
+{
+    pthread_mutex_lock(&lock);
+    while ((int32_t)(tick - now) > 0)
+    {
+        now++;
+
+        // the root wrapped, the next spans come down from the upper levels
+        if ((now & (WHEEL_ROOT_SIZE - 1)) == 0)
+            for (int level = 1; level < WHEEL_LEVELS; level++)
+            {
+                cascade(level);
+                int shift = WHEEL_ROOT_BITS + (level - 1) * WHEEL_LEVEL_BITS;
+                if (((now >> shift) & (WHEEL_LEVEL_SIZE - 1)) != 0)
+                    break;
+            }
+
+        int slot = now & (WHEEL_ROOT_SIZE - 1);
+        int id = heads[slot];
+        heads[slot] = -1;
+        while (id != -1)
+        {
+            int next = entries[id].next;
+            uint32_t expires = expire(id);
+            if (expires)
+                place(id, expires);
+            else
+            {
+                entries[id].slot = -1;
+                count--;
+            }
+            id = next;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
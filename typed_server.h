@@ -0,0 +1,26 @@
+#pragma once
+
+#include "tcp_server_framing.h"
+
+// server with the message handler known at compile time - the framing loop is instantiated
+// with the handler, so there is one indirect call per receive instead of one per message.
+// The handler is a class with a static member
+//     static void Process(Connection* conn, const char* msg, int msg_len);
+// getting the messages as views like ProcessMessageViewPtr
+template <class Handler>
+class TypedServer : public TCPServer
+{
+    struct ViewHandler
+    {
+        static inline bool TakesViews(TCPServer*) { return true; }
+        static inline void Process(Connection* conn, const char* msg, int msg_len) { Handler::Process(conn, msg, msg_len); }
+    };
+
+    static void processData(Connection* conn, const unsigned char* data, int size)
+    {
+        conn->processMessages<ViewHandler>(data, size);
+    }
+
+public:
+    TypedServer() { ProcessDataPtr = &processData; }
+};